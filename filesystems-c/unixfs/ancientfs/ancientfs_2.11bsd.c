@@ -18,12 +18,46 @@
 
 DECL_UNIXFS("2.11BSD", 211bsd);
 
+#ifndef EXTERNALTIMES
+#define ANCIENTFS_211BSD_TIMES(e)                                            \
+    ip->I_atime_sec = fs32_to_host(e, dip->di_atime);                        \
+    ip->I_mtime_sec = fs32_to_host(e, dip->di_mtime);                        \
+    ip->I_ctime_sec = fs32_to_host(e, dip->di_ctime);
+#else
+#define ANCIENTFS_211BSD_TIMES(e)
+#endif
+
+#define ANCIENTFS_211BSD_DECODERS(order, e)                                  \
+static void                                                                  \
+ancientfs_211bsd_idecode_##order(struct inode* ip, const struct dinode* dip) \
+{                                                                            \
+    ip->I_mode  = fs16_to_host(e, dip->di_mode);                             \
+    ip->I_nlink = fs16_to_host(e, dip->di_nlink);                            \
+    ip->I_uid   = fs16_to_host(e, dip->di_uid);                              \
+    ip->I_gid   = fs16_to_host(e, dip->di_gid);                              \
+    ip->I_size  = fs32_to_host(e, dip->di_size);                             \
+    ANCIENTFS_211BSD_TIMES(e)                                                \
+    fs32_to_host_array_##order(ip->I_daddr, dip->di_addr, NADDR);            \
+}                                                                            \
+static void                                                                  \
+ancientfs_211bsd_ddecode_##order(struct direct* ep)                          \
+{                                                                            \
+    ep->d_ino = fs16_to_host(e, ep->d_ino);                                  \
+    ep->d_reclen = fs16_to_host(e, ep->d_reclen);                            \
+    ep->d_namlen = fs16_to_host(e, ep->d_namlen);                            \
+}
+
+UNIXFS_FS_VARIANTS(ANCIENTFS_211BSD_DECODERS)
+
+static void (*ancientfs_211bsd_idecode)(struct inode*, const struct dinode*);
+static void (*ancientfs_211bsd_ddecode)(struct direct*);
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +67,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct fs* fs = (struct fs*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -58,7 +92,8 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, SBSIZE, (off_t)(DEV_BSIZE * SUPERB)) != SBSIZE) {
+    if (unixfs_image_pread(fd, fs, SBSIZE,
+                           (off_t)(DEV_BSIZE * SUPERB)) != SBSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -71,15 +106,18 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    ancientfs_211bsd_idecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                              ancientfs_211bsd_idecode);
+    ancientfs_211bsd_ddecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                              ancientfs_211bsd_ddecode);
+
     fs->s_isize = fs16_to_host(unixfs->s_endian, fs->s_isize);
     fs->s_fsize = fs32_to_host(unixfs->s_endian, fs->s_fsize);
     fs->s_nfree = fs16_to_host(unixfs->s_endian, fs->s_nfree);
 
-    for (i = 0; i < NICFREE; i++)
-        fs->s_free[i] = fs32_to_host(unixfs->s_endian, fs->s_free[i]);
+    fs32_to_host_array(unixfs->s_endian, fs->s_free, fs->s_free, NICFREE);
     fs->s_ninode = fs16_to_host(unixfs->s_endian, fs->s_ninode);
-    for (i = 0; i < NICINOD; i++)
-        fs->s_inode[i] = fs16_to_host(unixfs->s_endian, fs->s_inode[i]);
+    fs16_to_host_array(unixfs->s_endian, fs->s_inode, fs->s_inode, NICINOD);
     fs->s_time = fs32_to_host(unixfs->s_endian, fs->s_time);
 
     unixfs->s_statvfs.f_bsize = DEV_BSIZE;
@@ -144,7 +182,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (fs)
             free(fs);
         if (sb)
@@ -162,7 +200,7 @@ unixfs_internal_fini(void* filsys)
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_image_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -194,8 +232,8 @@ unixfs_internal_alloc(void)
         if (ret == 0) {
             struct fblk* fblk = (struct fblk*)ubuf;
             fs->s_nfree = fs16_to_host(unixfs->s_endian, fblk->df_nfree);
-            for (i = 0; i < NICFREE; i++)
-                fs->s_free[i] = fs32_to_host(unixfs->s_endian, fblk->df_free[i]);
+            fs32_to_host_array(unixfs->s_endian, fs->s_free, fblk->df_free,
+                               NICFREE);
         } else
             return (off_t)0;
     }
@@ -305,8 +343,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)DEV_BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_image_pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
+                           blkno * (off_t)DEV_BSIZE) != UNIXFS_IOSIZE(unixfs))
         return EIO;
 
     return 0;
@@ -329,7 +367,8 @@ unixfs_internal_iget(ino_t ino)
 
     char ubuf[UNIXFS_IOSIZE(unixfs)];
 
-    if (unixfs_internal_bread((off_t)itod((a_ino_t)ino), ubuf) != 0) {
+    if (unixfs_inodelayer_ibread((off_t)itod((a_ino_t)ino), ubuf,
+                                 sizeof(ubuf), unixfs_internal_bread) != 0) {
         unixfs_inodelayer_ifailed(ip);
         return NULL;
     }
@@ -339,28 +378,9 @@ unixfs_internal_iget(ino_t ino)
 
     ip->I_number = ino;
 
-    /* ip->I_ic1 = dip->di_ic1 */
-
-    ip->I_mode  = fs16_to_host(unixfs->s_endian, dip->di_mode);
-    ip->I_nlink = fs16_to_host(unixfs->s_endian, dip->di_nlink);
-    ip->I_uid   = fs16_to_host(unixfs->s_endian, dip->di_uid);
-    ip->I_gid   = fs16_to_host(unixfs->s_endian, dip->di_gid);
-    ip->I_size  = fs32_to_host(unixfs->s_endian, dip->di_size);
+    /* ip->I_ic1 = dip->di_ic1, ip->I_ic2 = dip->di_ic2 */
 
-#ifndef EXTERNALTIMES
-
-    /* ip->I_ic2 = dip->di_ic2 */
-
-    ip->I_atime_sec = fs32_to_host(unixfs->s_endian, dip->di_atime);
-    ip->I_mtime_sec = fs32_to_host(unixfs->s_endian, dip->di_mtime);
-    ip->I_ctime_sec = fs32_to_host(unixfs->s_endian, dip->di_ctime);
-
-#endif
-
-    int i;
-
-    for (i = 0; i < NADDR; i++)
-        ip->I_daddr[i] = fs32_to_host(unixfs->s_endian, dip->di_addr[i]);
+    ancientfs_211bsd_idecode(ip, dip);
 
     if (S_ISCHR(ip->I_mode) || S_ISBLK(ip->I_mode)) {
         uint32_t rdev = ip->I_daddr[0];
@@ -472,9 +492,7 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
             entryoffsetinblock = 0;
         }
         ep = (struct direct*)((char*)ubuf + entryoffsetinblock);
-        ep->d_ino = fs16_to_host(unixfs->s_endian, ep->d_ino);
-        ep->d_reclen = fs16_to_host(unixfs->s_endian, ep->d_reclen);
-        ep->d_namlen = fs16_to_host(unixfs->s_endian, ep->d_namlen);
+        ancientfs_211bsd_ddecode(ep);
         if (ep->d_reclen == 0 ||
             __unixfs_internal_dirbadentry(ep, entryoffsetinblock)) {
             i = ANCIENTFS_211BSD_DIRBLKSIZ -
@@ -508,25 +526,25 @@ static int
 unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
                              off_t* offset, struct unixfs_direntry* dent)
 {
-    struct direct* ep;
+    struct direct de, *ep = &de;
     off_t ni_offset = *offset;
     off_t entryoffsetinblock = blkoff(ni_offset);
+    off_t base = ni_offset - entryoffsetinblock;
     int endsearch = roundup(dp->I_size, ANCIENTFS_211BSD_DIRBLKSIZ);
 
     if (ni_offset >= endsearch)
         return -1;
 
-    if (!dirbuf->flags.initialized || (blkoff(ni_offset) == 0)) {
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret = __unixfs_internal_blkatoff(dp, ni_offset, dirbuf->data);
         if (ret)
             return ret;
-        entryoffsetinblock = 0;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
-    ep = (struct direct*)((char*)dirbuf->data + entryoffsetinblock);
-    ep->d_ino = fs16_to_host(unixfs->s_endian, ep->d_ino);
-    ep->d_reclen = fs16_to_host(unixfs->s_endian, ep->d_reclen);
-    ep->d_namlen = fs16_to_host(unixfs->s_endian, ep->d_namlen);
+    /* swap a copy; the block stays as it is on disk */
+    memcpy(&de, dirbuf->data + entryoffsetinblock, sizeof(de));
+    ancientfs_211bsd_ddecode(ep);
     if (ep->d_reclen == 0 ||
         __unixfs_internal_dirbadentry(ep, entryoffsetinblock)) {
         int i =
@@ -6,6 +6,7 @@
 
 #include "ancientfs_32v.h"
 #include "unixfs_common.h"
+#include "unixfs_dirent16.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -18,12 +19,48 @@
 
 DECL_UNIXFS("UNIX/32V", 32v);
 
+/* block addresses are 3 bytes on disk; widen them before swapping */
+#define ANCIENTFS_32V_DECODERS(order, e)                                     \
+static void                                                                  \
+ancientfs_32v_idecode_##order(struct inode* ip, const struct dinode* dip)    \
+{                                                                            \
+    char* p1 = (char*)(ip->I_daddr);                                         \
+    const char* p2 = (const char*)(dip->di_addr);                            \
+    int i;                                                                   \
+    ip->I_mode  = fs16_to_host(e, dip->di_mode);                             \
+    ip->I_nlink = fs16_to_host(e, dip->di_nlink);                            \
+    ip->I_uid   = fs16_to_host(e, dip->di_uid);                              \
+    ip->I_gid   = fs16_to_host(e, dip->di_gid);                              \
+    ip->I_size  = fs32_to_host(e, dip->di_size);                             \
+    ip->I_atime_sec = fs32_to_host(e, dip->di_atime);                        \
+    ip->I_mtime_sec = fs32_to_host(e, dip->di_mtime);                        \
+    ip->I_ctime_sec = fs32_to_host(e, dip->di_ctime);                        \
+    for (i = 0; i < NADDR; i++) {                                            \
+        *p1++ = *p2++;                                                       \
+        *p1++ = *p2++;                                                       \
+        *p1++ = *p2++;                                                       \
+        *p1++ = 0;                                                           \
+    }                                                                        \
+    fs32_to_host_array_##order(ip->I_daddr, ip->I_daddr, NADDR);             \
+}                                                                            \
+static void                                                                  \
+ancientfs_32v_ddecode_##order(struct dent* dep, const char* p)               \
+{                                                                            \
+    memcpy(dep, p, unixfs->s_dentsize);                                      \
+    dep->u_ino = fs16_to_host(e, dep->u_ino);                                \
+}
+
+UNIXFS_FS_VARIANTS(ANCIENTFS_32V_DECODERS)
+
+static void (*ancientfs_32v_idecode)(struct inode*, const struct dinode*);
+static void (*ancientfs_32v_ddecode)(struct dent*, const char*);
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +70,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -58,7 +95,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, BSIZE, (off_t)BSIZE) != BSIZE) {
+    if (unixfs_image_pread(fd, fs, BSIZE, (off_t)BSIZE) != BSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -71,14 +108,17 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    ancientfs_32v_idecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                           ancientfs_32v_idecode);
+    ancientfs_32v_ddecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                           ancientfs_32v_ddecode);
+
     fs->s_isize = fs16_to_host(unixfs->s_endian, fs->s_isize);
     fs->s_fsize = fs32_to_host(unixfs->s_endian, fs->s_fsize);
     fs->s_nfree = fs16_to_host(unixfs->s_endian, fs->s_nfree);
-    for (i = 0; i < NICFREE; i++)
-        fs->s_free[i] = fs32_to_host(unixfs->s_endian, fs->s_free[i]);
+    fs32_to_host_array(unixfs->s_endian, fs->s_free, fs->s_free, NICFREE);
     fs->s_ninode = fs16_to_host(unixfs->s_endian, fs->s_ninode);
-    for (i = 0; i < NICINOD; i++)
-        fs->s_inode[i] = fs16_to_host(unixfs->s_endian, fs->s_inode[i]);
+    fs16_to_host_array(unixfs->s_endian, fs->s_inode, fs->s_inode, NICINOD);
     fs->s_time = fs32_to_host(unixfs->s_endian, fs->s_time); 
     unixfs->s_statvfs.f_bsize = BSIZE * CLSIZE;
     unixfs->s_statvfs.f_frsize = BSIZE;
@@ -143,7 +183,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (fs)
             free(fs);
         if (sb)
@@ -161,7 +201,7 @@ unixfs_internal_fini(void* filsys)
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_image_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -193,8 +233,8 @@ unixfs_internal_alloc(void)
         if (ret == 0) {
             struct fblk* fblk = (struct fblk*)ubuf;
             fs->s_nfree = fs32_to_host(unixfs->s_endian, fblk->df_nfree);
-            for (i = 0; i < NICFREE; i++)
-                fs->s_free[i] = fs32_to_host(unixfs->s_endian, fblk->df_free[i]);
+            fs32_to_host_array(unixfs->s_endian, fs->s_free, fblk->df_free,
+                               NICFREE);
         } else
             return (off_t)0;
     }
@@ -304,8 +344,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_image_pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
+                           blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
         return EIO;
 
     return 0;
@@ -328,7 +368,8 @@ unixfs_internal_iget(ino_t ino)
 
     char ubuf[UNIXFS_IOSIZE(unixfs)];
 
-    if (unixfs_internal_bread((off_t)itod((a_ino_t)ino), ubuf) != 0) {
+    if (unixfs_inodelayer_ibread((off_t)itod((a_ino_t)ino), ubuf,
+                                 sizeof(ubuf), unixfs_internal_bread) != 0) {
         unixfs_inodelayer_ifailed(ip);
         return NULL;
     }
@@ -338,30 +379,7 @@ unixfs_internal_iget(ino_t ino)
 
     ip->I_number = ino;
 
-    ip->I_mode  = fs16_to_host(unixfs->s_endian, dip->di_mode);
-    ip->I_nlink = fs16_to_host(unixfs->s_endian, dip->di_nlink);
-    ip->I_uid   = fs16_to_host(unixfs->s_endian, dip->di_uid);
-    ip->I_gid   = fs16_to_host(unixfs->s_endian, dip->di_gid);
-    ip->I_size  = fs32_to_host(unixfs->s_endian, dip->di_size);
-
-    ip->I_atime_sec = fs32_to_host(unixfs->s_endian, dip->di_atime);
-    ip->I_mtime_sec = fs32_to_host(unixfs->s_endian, dip->di_mtime);
-    ip->I_ctime_sec = fs32_to_host(unixfs->s_endian, dip->di_ctime);
-
-    int i;
-
-    char* p1 = (char*)(ip->I_daddr);
-    char* p2 = (char*)(dip->di_addr);
-
-    for (i = 0; i < NADDR; i++) {
-        *p1++ = *p2++;
-        *p1++ = *p2++;
-        *p1++ = *p2++;
-        *p1++ = 0;
-    }
-
-    for (i = 0; i < NADDR; i++)
-        ip->I_daddr[i] = fs32_to_host(unixfs->s_endian, ip->I_daddr[i]);
+    ancientfs_32v_idecode(ip, dip);
 
     if (S_ISCHR(ip->I_mode) || S_ISBLK(ip->I_mode)) {
         uint32_t rdev = ip->I_daddr[0];
@@ -419,45 +437,33 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         return ENOTDIR;
     }
 
-    int ret = ENOENT, eo = 0, count = dp->I_size / unixfs->s_dentsize;
+    int ret = ENOENT, count = dp->I_size / unixfs->s_dentsize;
     a_int offset = 0;
     char ubuf[UNIXFS_IOSIZE(unixfs)];
     struct dent udent;
 
-eloop:
-    if (count == 0) {
-        ret = ENOENT;
-        goto out;
-    }
-
-    if ((offset & BMASK) == 0) {
+    while (count > 0) {
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(offset/BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
             goto out;
-        if (unixfs_internal_bread(blkno, ubuf) != 0)
+        if (unixfs_internal_bread(blkno, ubuf) != 0) {
+            ret = EIO;
             goto out;
-    }
-
-    memset(&udent, 0, sizeof(udent));
-    memcpy(&udent, ubuf + (offset & BMASK), unixfs->s_dentsize);
-
-    udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+        }
 
-    offset += unixfs->s_dentsize;
-    count--;
+        int n = min(count, BSIZE / unixfs->s_dentsize);
+        int i = unixfs_dirent16_find(ubuf, n, name);
+        if (i >= 0) { /* matched */
+            ancientfs_32v_ddecode(&udent, ubuf + i * unixfs->s_dentsize);
+            ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+            goto out;
+        }
 
-    if (udent.u_ino == 0) {
-        if (eo == 0)
-            eo = offset;
-        goto eloop;
+        offset += n * unixfs->s_dentsize;
+        count -= n;
     }
 
-    if (strncmp(name, udent.u_name, DIRSIZ) != 0)
-        goto eloop;
-
-    /* matched */
-
-    ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+    ret = ENOENT;
 
 out:
     unixfs_internal_iput(dp);
@@ -472,7 +478,9 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     if ((*offset + unixfs->s_dentsize) > dp->I_size)
         return -1;
 
-    if (!dirbuf->flags.initialized || ((*offset & BMASK) == 0)) {
+    off_t base = *offset & ~(off_t)BMASK;
+
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret;
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset / BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
@@ -480,6 +488,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         ret = unixfs_internal_bread(blkno, dirbuf->data);
         if (ret != 0)
             return ret;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
 
@@ -487,8 +496,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     size_t dirnamelen = min(DIRSIZ, UNIXFS_MAXNAMLEN);
 
     memset(&udent, 0, sizeof(udent));
-    memcpy(&udent, dirbuf->data + (*offset & BMASK), unixfs->s_dentsize);
-    udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+    ancientfs_32v_ddecode(&udent, dirbuf->data + (*offset & BMASK));
     dent->ino = udent.u_ino;
     memcpy(dent->name, udent.u_name, dirnamelen);
     dent->name[dirnamelen] = '\0';
@@ -517,6 +517,9 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
 
     /* caller already checked for bounds */
 
+    if (offset == 0)
+        unixfs_archive_readahead(unixfs->s_bdev, start, ip->I_size);
+
     return pread(unixfs->s_bdev, buf, nbyte, start + offset);
 }
 
@@ -66,6 +66,7 @@ struct bcpio_node_info {
     struct bcpio_node_info* ci_next_sibling;
     char*                   ci_name;
     char*                   ci_linktargetname;
+    char*                   ci_data; /* inlined contents, if small */
 };
 
 /* modes */
@@ -30,6 +30,7 @@ struct cpio_newc_entry {
     char   name[UNIXFS_MAXPATHLEN + 1];
     char   linktargetname[UNIXFS_MAXPATHLEN + 1];
     off_t  daddr;
+    char*  data; /* inlined contents, if small */
     struct stat stat;
 };
 
@@ -128,6 +129,13 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
 
     if (!S_ISLNK(ce->stat.st_mode) || !ce->stat.st_size) {
         off_t dataend = ce->stat.st_size;
+        if (S_ISREG(ce->stat.st_mode) &&
+            (ce->data = unixfs_inline_alloc(ce->stat.st_size)) &&
+            (pread(fd, ce->data, ce->stat.st_size, ce->daddr) !=
+             ce->stat.st_size)) {
+            unixfs_inline_free(ce->data, ce->stat.st_size);
+            ce->data = NULL;
+        }
         dataend += (dataend & 3) ? (4 - (dataend % 4)) : 0;
         (void)lseek(fd, dataend, SEEK_CUR); 
         return 0;
@@ -266,7 +274,14 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
     struct cpio_newc_entry _ce, *ce = &_ce;
 
+    ce->data = NULL;
+
     for (;;) {
+        if (ce->data) { /* not taken by any node */
+            unixfs_inline_free(ce->data, ce->stat.st_size);
+            ce->data = NULL;
+        }
+
         if ((err = ancientfs_cpio_newc_readheader(fd, ce)) != 0) {
             if (err == 1)
                 break;
@@ -381,6 +396,11 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
             if (term && !S_ISDIR(ip->I_mode)) /* out of order */
                 ip->I_mode = S_IFDIR | 0755;
 
+            if (S_ISREG(ip->I_mode)) {
+                ci->ci_data = ce->data;
+                ce->data = NULL;
+            }
+
             if (S_ISDIR(ip->I_mode)) {
                 fs->s_directories++;
                 parent_ino = fs->s_lastino + 1;
@@ -453,6 +473,7 @@ unixfs_internal_fini(void* filsys)
                 free(ci->ci_name);
                 if (ci->ci_linktargetname)
                     free(ci->ci_linktargetname);
+                unixfs_inline_free(ci->ci_data, tmp->I_size);
             }
             unixfs_internal_iput(tmp);
             unixfs_internal_iput(tmp);
@@ -629,9 +650,18 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
     off_t start = (off_t)ip->I_daddr[0];
+    struct cpio_newc_node_info* ci = (struct cpio_newc_node_info*)ip->I_private;
 
     /* caller already checked for bounds */
 
+    if (ci->ci_data) {
+        memcpy(buf, ci->ci_data + offset, nbyte);
+        return nbyte;
+    }
+
+    if (offset == 0)
+        unixfs_archive_readahead(unixfs->s_bdev, start, ip->I_size);
+
     return pread(unixfs->s_bdev, buf, nbyte, start + offset);
 }
 
@@ -56,6 +56,7 @@ struct cpio_newc_node_info {
     struct cpio_newc_node_info* ci_next_sibling;
     char*                       ci_name;
     char*                       ci_linktargetname;
+    char*                       ci_data; /* inlined contents, if small */
 };
 
 /* modes */
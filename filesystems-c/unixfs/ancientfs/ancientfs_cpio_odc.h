@@ -52,6 +52,7 @@ struct cpio_odc_node_info {
     struct cpio_odc_node_info* ci_next_sibling;
     char*                      ci_name;
     char*                      ci_linktargetname;
+    char*                      ci_data; /* inlined contents, if small */
 };
 
 /* modes */
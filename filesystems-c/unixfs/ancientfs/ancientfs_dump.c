@@ -536,14 +536,17 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     if ((*offset + unixfs->s_dentsize) > dp->I_size)
         return -1;
 
-    if (!dirbuf->flags.initialized || ((*offset & BMASK) == 0)) {
+    off_t base = *offset & ~(off_t)BMASK;
+
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret;
-        off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset/BSIZE), &ret);
+        off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset / BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
             return ret;
         ret = unixfs_internal_bread(blkno, dirbuf->data);
         if (ret != 0)
             return ret;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
 
@@ -573,22 +573,24 @@ static int
 unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
                              off_t* offset, struct unixfs_direntry* dent)
 {
-    struct direct* ep;
+    struct direct de, *ep = &de;
     off_t ni_offset = *offset;
     off_t entryoffsetinblock = blkoff(ni_offset);
+    off_t base = ni_offset - entryoffsetinblock;
     int endsearch = roundup(dp->I_size, ANCIENTFS_211BSD_DIRBLKSIZ);
 
     if (ni_offset >= endsearch)
         return -1;
 
-    if (!dirbuf->flags.initialized || (blkoff(ni_offset) == 0)) {
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret = __unixfs_internal_blkatoff(dp, ni_offset, dirbuf->data);
         if (ret)
             return ret;
-        entryoffsetinblock = 0;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
-    ep = (struct direct*)((char*)dirbuf->data + entryoffsetinblock);
+    /* swap a copy; the block stays as it is on disk */
+    memcpy(&de, dirbuf->data + entryoffsetinblock, sizeof(de));
     ep->d_ino = fs16_to_host(unixfs->s_endian, ep->d_ino);
     ep->d_reclen = fs16_to_host(unixfs->s_endian, ep->d_reclen);
     ep->d_namlen = fs16_to_host(unixfs->s_endian, ep->d_namlen);
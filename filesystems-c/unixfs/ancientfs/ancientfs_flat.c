@@ -0,0 +1,426 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ */
+
+#include "ancientfs_flat.h"
+#include "unixfs_common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+DECL_UNIXFS("UNIX Flattened Image", flat);
+
+/*
+ * Everything is checked once at mount time, so that the operations below
+ * can index the mapped tables without further bounds checks.
+ */
+static int
+ancientfs_flat_validate(struct filsys* fs)
+{
+    const struct unixfs_flat_super* sp = fs->s_super;
+    size_t size = fs->s_size;
+    uint64_t i;
+
+    if (memcmp(sp->f_magic, UNIXFS_FLAT_MAGIC, sizeof(sp->f_magic)) != 0) {
+        fprintf(stderr, "not a flattened image\n");
+        return EINVAL;
+    }
+
+    if (sp->f_byteorder != UNIXFS_FLAT_BYTEORDER) {
+        fprintf(stderr, "flattened image was written on a host of the "
+                "other byte order\n");
+        return EINVAL;
+    }
+
+    if ((sp->f_ninodes < 1) ||
+        (sp->f_inodes > size) || (sp->f_dirents > size) ||
+        (sp->f_strings > size) ||
+        (sp->f_ninodes > (size - sp->f_inodes) /
+                         sizeof(struct unixfs_flat_inode)) ||
+        (sp->f_ndirents > (size - sp->f_dirents) /
+                          sizeof(struct unixfs_flat_dirent)) ||
+        (sp->f_stringsize > size - sp->f_strings) ||
+        (sp->f_inodes % sizeof(uint64_t)) ||
+        (sp->f_dirents % sizeof(uint32_t)))
+        goto bad;
+
+    fs->s_inodes =
+        (const struct unixfs_flat_inode*)(fs->s_base + sp->f_inodes);
+    fs->s_dirents =
+        (const struct unixfs_flat_dirent*)(fs->s_base + sp->f_dirents);
+    fs->s_strings = fs->s_base + sp->f_strings;
+
+    if (!S_ISDIR(fs->s_inodes[ROOTINO - 1].i_mode))
+        goto bad;
+
+    for (i = 0; i < sp->f_ninodes; i++) {
+        const struct unixfs_flat_inode* rec = &fs->s_inodes[i];
+        if (S_ISDIR(rec->i_mode)) {
+            if ((rec->i_data > sp->f_ndirents) ||
+                (rec->i_nentries > sp->f_ndirents - rec->i_data))
+                goto bad;
+        } else if (S_ISREG(rec->i_mode) || S_ISLNK(rec->i_mode)) {
+            if ((rec->i_data > size) || (rec->i_size > size - rec->i_data))
+                goto bad;
+        }
+    }
+
+    for (i = 0; i < sp->f_ndirents; i++) {
+        const struct unixfs_flat_dirent* d = &fs->s_dirents[i];
+        if ((d->d_ino < ROOTINO) || (d->d_ino > sp->f_ninodes) ||
+            (d->d_namelen > UNIXFS_MAXNAMLEN) ||
+            (d->d_name > sp->f_stringsize) ||
+            (d->d_namelen > sp->f_stringsize - d->d_name))
+            goto bad;
+    }
+
+    return 0;
+
+bad:
+    fprintf(stderr, "flattened image is damaged\n");
+    return EINVAL;
+}
+
+static void
+ancientfs_flat_stat(ino_t ino, struct stat* stbuf)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    const struct unixfs_flat_inode* rec = &fs->s_inodes[ino - 1];
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino     = ino;
+    stbuf->st_mode    = rec->i_mode;
+    stbuf->st_nlink   = rec->i_nlink;
+    stbuf->st_uid     = rec->i_uid;
+    stbuf->st_gid     = rec->i_gid;
+    stbuf->st_rdev    = rec->i_rdev;
+    stbuf->st_size    = rec->i_size;
+    stbuf->st_blocks  = (rec->i_size + 511) / 512;
+    stbuf->st_blksize = BSIZE;
+    stbuf->st_atime   = rec->i_atime;
+    stbuf->st_mtime   = rec->i_mtime;
+    stbuf->st_ctime   = rec->i_ctime;
+}
+
+static inline int
+ancientfs_flat_valid(ino_t ino)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    return (ino >= ROOTINO) && (ino <= fs->s_super->f_ninodes);
+}
+
+static void*
+unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
+                     char** fsname, char** volname)
+{
+    int fd = -1;
+    if ((fd = open(dmg, O_RDONLY)) < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    int err;
+    struct stat stbuf;
+    struct super_block* sb = (struct super_block*)0;
+    struct filsys* fs = (struct filsys*)0;
+    void* base = MAP_FAILED;
+
+    if ((err = fstat(fd, &stbuf)) != 0) {
+        perror("fstat");
+        goto out;
+    }
+
+    if (stbuf.st_size < UNIXFS_FLAT_SUPERSIZE) {
+        err = EINVAL;
+        fprintf(stderr, "%s is not a flattened image\n", dmg);
+        goto out;
+    }
+
+    base = mmap(NULL, (size_t)stbuf.st_size, PROT_READ, MAP_SHARED, fd,
+                (off_t)0);
+    if (base == MAP_FAILED) {
+        err = errno;
+        perror("mmap");
+        goto out;
+    }
+
+    fs = calloc(1, sizeof(struct filsys));
+    if (!fs) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    fs->s_base = (const char*)base;
+    fs->s_size = (size_t)stbuf.st_size;
+    fs->s_super = (const struct unixfs_flat_super*)base;
+
+    if ((err = ancientfs_flat_validate(fs)) != 0)
+        goto out;
+
+    sb = malloc(sizeof(struct super_block));
+    if (!sb) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    unixfs = sb;
+
+    unixfs->s_flags = flags;
+    unixfs->s_endian = UNIXFS_FS_LITTLE; /* not used */
+    unixfs->s_fs_info = (void*)fs;
+    unixfs->s_bdev = fd;
+
+    if ((err = unixfs_inodelayer_init(sizeof(struct flat_node_info))) != 0)
+        goto out;
+
+    const struct unixfs_flat_super* sp = fs->s_super;
+
+    unixfs->s_statvfs.f_bsize = BSIZE;
+    unixfs->s_statvfs.f_frsize = BSIZE;
+    unixfs->s_statvfs.f_ffree = 0;
+    unixfs->s_statvfs.f_files = sp->f_ninodes;
+    unixfs->s_statvfs.f_blocks = (fs->s_size + BSIZE - 1) / BSIZE;
+    unixfs->s_statvfs.f_bfree = 0;
+    unixfs->s_statvfs.f_bavail = 0;
+    unixfs->s_dentsize = 1;
+    unixfs->s_statvfs.f_namemax =
+        sp->f_namemax ? sp->f_namemax : UNIXFS_MAXNAMLEN;
+
+    /* the original's names, so the copy mounts looking the same */
+    snprintf(unixfs->s_fsname, UNIXFS_MNAMELEN, "%.*s",
+             (int)sizeof(sp->f_fsname) - 1, sp->f_fsname);
+    if (!unixfs->s_fsname[0])
+        snprintf(unixfs->s_fsname, UNIXFS_MNAMELEN, "%s", unixfs_fstype);
+
+    snprintf(unixfs->s_volname, UNIXFS_MAXNAMLEN, "%.*s",
+             (int)sizeof(sp->f_volname) - 1, sp->f_volname);
+    if (!unixfs->s_volname[0]) {
+        char* dmg_basename = basename((char*)dmg);
+        snprintf(unixfs->s_volname, UNIXFS_MAXNAMLEN, "%s (image=%s)",
+                 unixfs_fstype,
+                 (dmg_basename) ? dmg_basename : "Flattened Image");
+    }
+
+    *fsname = unixfs->s_fsname;
+    *volname = unixfs->s_volname;
+
+out:
+    if (err) {
+        if (base != MAP_FAILED)
+            munmap(base, (size_t)stbuf.st_size);
+        if (fd >= 0)
+            close(fd);
+        if (fs)
+            free(fs);
+        if (sb)
+            free(sb);
+        return NULL;
+    }
+
+    return sb;
+}
+
+static void
+unixfs_internal_fini(void* filsys)
+{
+    struct super_block* sb = (struct super_block*)filsys;
+
+    unixfs_inodelayer_fini();
+
+    if (sb) {
+        struct filsys* fs = (struct filsys*)sb->s_fs_info;
+        if (fs) {
+            munmap((void*)fs->s_base, fs->s_size);
+            free(fs);
+        }
+        sb->s_fs_info = NULL;
+        if (sb->s_bdev >= 0)
+            close(sb->s_bdev);
+        sb->s_bdev = -1;
+    }
+}
+
+static off_t
+unixfs_internal_alloc(void)
+{
+    return (off_t)0;
+}
+
+static off_t
+unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
+{
+    return (off_t)0;
+}
+
+static int
+unixfs_internal_bread(off_t blkno, char* blkbuf)
+{
+    return EIO;
+}
+
+static struct inode*
+unixfs_internal_iget(ino_t ino)
+{
+    if (!ancientfs_flat_valid(ino))
+        return NULL;
+
+    struct inode* ip = unixfs_inodelayer_iget(ino);
+    if (!ip) {
+        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        abort();
+    }
+
+    if (ip->I_initialized)
+        return ip;
+
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    struct flat_node_info* fi = (struct flat_node_info*)ip->I_private;
+
+    fi->fi_rec = &fs->s_inodes[ino - 1];
+    ancientfs_flat_stat(ino, &ip->I_stat);
+
+    unixfs_inodelayer_isucceeded(ip);
+
+    return ip;
+}
+
+static void
+unixfs_internal_iput(struct inode* ip)
+{
+    unixfs_inodelayer_iput(ip);
+}
+
+static int
+unixfs_internal_igetattr(ino_t ino, struct stat* stbuf)
+{
+    if (!ancientfs_flat_valid(ino))
+        return ENOENT;
+
+    ancientfs_flat_stat(ino, stbuf);
+
+    return 0;
+}
+
+static void
+unixfs_internal_istat(struct inode* ip, struct stat* stbuf)
+{
+    memcpy(stbuf, &ip->I_stat, sizeof(struct stat));
+}
+
+static int
+unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    stbuf->st_ino = 0;
+
+    size_t namelen = strlen(name);
+    if (namelen > UNIXFS_MAXNAMLEN)
+        return ENAMETOOLONG;
+
+    if (!ancientfs_flat_valid(parentino))
+        return ENOENT;
+
+    const struct unixfs_flat_inode* dp = &fs->s_inodes[parentino - 1];
+    if (!S_ISDIR(dp->i_mode))
+        return ENOTDIR;
+
+    const struct unixfs_flat_dirent* d = &fs->s_dirents[dp->i_data];
+    uint32_t hash = unixfs_flat_hash(name, namelen);
+    size_t lo = 0, hi = dp->i_nentries;
+
+    while (lo < hi) { /* the first entry with this hash */
+        size_t mid = lo + (hi - lo) / 2;
+        if (d[mid].d_hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; (lo < dp->i_nentries) && (d[lo].d_hash == hash); lo++) {
+        if ((d[lo].d_namelen == namelen) &&
+            (memcmp(fs->s_strings + d[lo].d_name, name, namelen) == 0)) {
+            ancientfs_flat_stat((ino_t)d[lo].d_ino, stbuf);
+            return 0;
+        }
+    }
+
+    return ENOENT;
+}
+
+static int
+unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
+                             off_t* offset, struct unixfs_direntry* dent)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    const struct unixfs_flat_inode* rec =
+        ((struct flat_node_info*)dp->I_private)->fi_rec;
+
+    if ((*offset < 0) || (*offset >= rec->i_nentries))
+        return -1;
+
+    const struct unixfs_flat_dirent* d = &fs->s_dirents[rec->i_data + *offset];
+
+    dent->ino = (ino_t)d->d_ino;
+    memcpy(dent->name, fs->s_strings + d->d_name, d->d_namelen);
+    dent->name[d->d_namelen] = '\0';
+
+    *offset += 1;
+
+    return 0;
+}
+
+static ssize_t
+unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
+                       int* error)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    const struct unixfs_flat_inode* rec =
+        ((struct flat_node_info*)ip->I_private)->fi_rec;
+
+    if ((offset < 0) || ((uint64_t)offset >= rec->i_size))
+        return 0;
+
+    size_t n = (size_t)min((uint64_t)nbyte, rec->i_size - offset);
+
+    memcpy(buf, fs->s_base + rec->i_data + offset, n);
+
+    return (ssize_t)n;
+}
+
+static int
+unixfs_internal_readlink(ino_t ino, char path[UNIXFS_MAXPATHLEN])
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+
+    if (!ancientfs_flat_valid(ino))
+        return ENOENT;
+
+    const struct unixfs_flat_inode* rec = &fs->s_inodes[ino - 1];
+    if (!S_ISLNK(rec->i_mode))
+        return EINVAL;
+
+    size_t len = (size_t)min(rec->i_size, (uint64_t)(UNIXFS_MAXPATHLEN - 1));
+    memcpy(path, fs->s_base + rec->i_data, len);
+    path[len] = '\0';
+
+    return 0;
+}
+
+static int
+unixfs_internal_sanitycheck(void* filsys, off_t disksize)
+{
+    return 0;
+}
+
+static int
+unixfs_internal_statvfs(struct statvfs* svb)
+{
+    memcpy(svb, &unixfs->s_statvfs, sizeof(struct statvfs));
+    return 0;
+}
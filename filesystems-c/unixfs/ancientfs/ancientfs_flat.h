@@ -0,0 +1,31 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ */
+
+#ifndef _ANCIENTFS_FLAT_H_
+#define _ANCIENTFS_FLAT_H_
+
+#include "unixfs_internal.h"
+#include "unixfs_flat.h"
+#include "ancientfs.h"
+
+#define BSIZE   UNIXFS_FLAT_ALIGN
+
+#define ROOTINO 1
+
+struct filsys
+{
+    const char*                      s_base; /* the mapped image */
+    size_t                           s_size;
+    const struct unixfs_flat_super*  s_super;
+    const struct unixfs_flat_inode*  s_inodes;
+    const struct unixfs_flat_dirent* s_dirents;
+    const char*                      s_strings;
+};
+
+struct flat_node_info
+{
+    const struct unixfs_flat_inode* fi_rec;
+};
+
+#endif /* _ANCIENTFS_FLAT_H_ */
@@ -0,0 +1,1045 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ *
+ * The checkpointing scheme follows Mark Adler's zran.c from the zlib
+ * distribution.
+ */
+
+#include "ancientfs_gzip.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define GZ_WINSIZE  32768U /* deflate history */
+#define GZ_CHUNK    16384U /* compressed input per read */
+#define GZ_NCURSORS 4      /* idle cursors kept around for sequential reads */
+
+#define GZ_PAR_MAXTHREADS 16
+#define GZ_PAR_MAXSLOTS   64    /* reorder buffer depth */
+#define GZ_BGZF_MAXBLOCK  65536 /* BGZF bounds both BSIZE and ISIZE */
+
+#define GZ_IDXMAGIC "AFSGZIX1"
+#define GZ_IDXMAGLEN 8
+
+struct gz_point {
+    off_t          out;    /* uncompressed offset */
+    off_t          in;     /* compressed offset of first full byte */
+    int            bits;   /* number of bits (1-7) from byte at in - 1 */
+    uint32_t       winlen; /* bytes of history; 0 at the start of a member */
+    unsigned char* window;
+};
+
+struct gz_cursor {
+    z_stream      strm;
+    int           raw;  /* resumed at a checkpoint, so inflating raw deflate */
+    int           eof;
+    off_t         in;   /* compressed offset of the next input read */
+    off_t         pos;  /* uncompressed offset of window[next] */
+    unsigned      have; /* bytes of output in window */
+    unsigned      next; /* next unconsumed byte in window */
+    unsigned char inbuf[GZ_CHUNK];
+    unsigned char window[GZ_WINSIZE];
+};
+
+/* member states */
+#define GZ_MEMBER_PENDING 0
+#define GZ_MEMBER_DONE    1
+#define GZ_MEMBER_ERROR   2
+
+struct gz_member {
+    off_t          in;   /* compressed offset of the member */
+    uint32_t       clen; /* compressed length, header and trailer included */
+    int            state;
+    unsigned char* data;
+    size_t         len;
+};
+
+/* why the dispatcher stopped handing out members */
+#define GZ_PAR_MORE       0
+#define GZ_PAR_EOF        1
+#define GZ_PAR_SEQUENTIAL 2 /* a member without a BGZF header */
+
+struct gz_par {
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    pthread_cond_t   done;
+    int              stop;
+    int              end;
+    int              nthreads;
+    unsigned         nslots;
+    uint64_t         head;     /* next member to be consumed */
+    uint64_t         nextwork; /* next member to be claimed by a worker */
+    uint64_t         tail;     /* next member to be dispatched */
+    size_t           consumed; /* bytes consumed from the head member */
+    off_t            nextin;   /* compressed offset of the next member */
+    pthread_t        threads[GZ_PAR_MAXTHREADS];
+    struct gz_member slots[GZ_PAR_MAXSLOTS];
+};
+
+struct ancientfs_gz {
+    int               fd;
+    char*             idxpath;
+    off_t             csize;
+    time_t            mtime;
+    off_t             span;
+    off_t             usize;
+    int               building; /* still recording checkpoints */
+    int               npoints;
+    int               maxpoints;
+    struct gz_point*  points;
+    struct gz_cursor* scan;
+    struct gz_par*    par;      /* parallel inflate of the scan, if BGZF */
+    pthread_mutex_t   lock;
+    struct gz_cursor* idle[GZ_NCURSORS];
+};
+
+struct gz_idxheader {
+    char     magic[GZ_IDXMAGLEN];
+    uint64_t csize;
+    int64_t  mtime;
+    uint64_t usize;
+    uint64_t span;
+    uint32_t npoints;
+    uint32_t reserved;
+};
+
+struct gz_idxpoint {
+    uint64_t out;
+    uint64_t in;
+    int32_t  bits;
+    uint32_t winlen;
+};
+
+static struct gz_cursor*
+gz_cursor_new(void)
+{
+    struct gz_cursor* cur = calloc(1, sizeof(struct gz_cursor));
+    if (!cur)
+        return NULL;
+
+    if (inflateInit2(&cur->strm, 15 + 16) != Z_OK) {
+        free(cur);
+        return NULL;
+    }
+
+    return cur;
+}
+
+static void
+gz_cursor_free(struct gz_cursor* cur)
+{
+    if (cur) {
+        (void)inflateEnd(&cur->strm);
+        free(cur);
+    }
+}
+
+static void
+gz_cursor_rewind(struct gz_cursor* cur)
+{
+    (void)inflateReset2(&cur->strm, 15 + 16);
+    cur->strm.avail_in = 0;
+    cur->raw = cur->eof = 0;
+    cur->in = cur->pos = 0;
+    cur->have = cur->next = 0;
+}
+
+static int
+gz_cursor_resume(struct ancientfs_gz* gz, struct gz_cursor* cur,
+                 struct gz_point* pt)
+{
+    cur->strm.avail_in = 0;
+    cur->in = pt->in;
+    cur->eof = 0;
+    cur->pos = pt->out;
+    cur->have = cur->next = 0;
+
+    if (!pt->winlen && !pt->bits) { /* start of a member */
+        (void)inflateReset2(&cur->strm, 15 + 16);
+        cur->raw = 0;
+        return 0;
+    }
+
+    (void)inflateReset2(&cur->strm, -15);
+
+    if (pt->bits) {
+        unsigned char c;
+        if (pread(gz->fd, &c, 1, pt->in - 1) != 1)
+            return -1;
+        (void)inflatePrime(&cur->strm, pt->bits, c >> (8 - pt->bits));
+    }
+
+    if (pt->winlen)
+        (void)inflateSetDictionary(&cur->strm, pt->window, pt->winlen);
+
+    cur->raw = 1;
+
+    return 0;
+}
+
+static struct gz_point*
+gz_findpoint(struct ancientfs_gz* gz, off_t offset)
+{
+    int lo = 0, hi = gz->npoints - 1;
+    struct gz_point* found = NULL;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (gz->points[mid].out <= offset) {
+            found = &gz->points[mid];
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+
+    return found;
+}
+
+static void
+gz_thin(struct ancientfs_gz* gz)
+{
+    int i, j;
+
+    for (i = 0, j = 0; i < gz->npoints; i++) {
+        if (i & 1)
+            free(gz->points[i].window);
+        else
+            gz->points[j++] = gz->points[i];
+    }
+
+    gz->npoints = j;
+    gz->span *= 2;
+}
+
+static struct gz_point*
+gz_newpoint(struct ancientfs_gz* gz, off_t out)
+{
+    if (gz->npoints && (out - gz->points[gz->npoints - 1].out) <= gz->span)
+        return NULL;
+
+    if (gz->npoints == ANCIENTFS_GZ_MAXPOINTS)
+        gz_thin(gz);
+
+    if (gz->npoints == gz->maxpoints) {
+        int newmax = gz->maxpoints ? gz->maxpoints * 2 : 64;
+        struct gz_point* newpoints =
+            realloc(gz->points, newmax * sizeof(struct gz_point));
+        if (!newpoints)
+            return NULL; /* just a sparser index */
+        gz->points = newpoints;
+        gz->maxpoints = newmax;
+    }
+
+    struct gz_point* pt = &gz->points[gz->npoints++];
+    memset(pt, 0, sizeof(*pt));
+    pt->out = out;
+
+    return pt;
+}
+
+static void
+gz_addpoint(struct ancientfs_gz* gz, struct gz_cursor* cur, int bits)
+{
+    off_t out = cur->pos + (cur->have - cur->next);
+
+    if (gz->npoints && (out - gz->points[gz->npoints - 1].out) <= gz->span)
+        return;
+
+    unsigned char* window = malloc(GZ_WINSIZE);
+    if (!window)
+        return;
+
+    /* the ring holds the newest output below have, older output above it */
+    unsigned left = GZ_WINSIZE - cur->have;
+    if (left)
+        memcpy(window, cur->window + cur->have, left);
+    if (cur->have)
+        memcpy(window + left, cur->window, cur->have);
+
+    struct gz_point* pt = gz_newpoint(gz, out);
+    if (!pt) {
+        free(window);
+        return;
+    }
+
+    pt->in = cur->in - cur->strm.avail_in;
+    pt->bits = bits;
+    pt->winlen = GZ_WINSIZE;
+    pt->window = window;
+}
+
+static int
+gz_refill(struct ancientfs_gz* gz, struct gz_cursor* cur)
+{
+    z_stream* strm = &cur->strm;
+
+    if (strm->avail_in && strm->next_in != cur->inbuf)
+        memmove(cur->inbuf, strm->next_in, strm->avail_in);
+
+    ssize_t n = pread(gz->fd, cur->inbuf + strm->avail_in,
+                      GZ_CHUNK - strm->avail_in, cur->in);
+    if (n < 0)
+        return -1;
+
+    cur->in += n;
+    strm->next_in = cur->inbuf;
+    strm->avail_in += n;
+
+    return (int)n;
+}
+
+/* Moves on to the next gzip member, if any, after a Z_STREAM_END. */
+static int
+gz_nextmember(struct ancientfs_gz* gz, struct gz_cursor* cur)
+{
+    z_stream* strm = &cur->strm;
+
+    if (cur->raw) { /* raw inflate leaves the gzip trailer to us */
+        unsigned skip = 8;
+        while (skip) {
+            if (!strm->avail_in && gz_refill(gz, cur) <= 0)
+                return -1;
+            unsigned k = (skip < strm->avail_in) ? skip : strm->avail_in;
+            strm->next_in += k;
+            strm->avail_in -= k;
+            skip -= k;
+        }
+    }
+
+    if ((strm->avail_in < 2) && (gz_refill(gz, cur) < 0))
+        return -1;
+
+    if ((strm->avail_in < 2) ||
+        (strm->next_in[0] != 0x1f) || (strm->next_in[1] != 0x8b))
+        return -1; /* end of archive; ignore any trailing padding */
+
+    (void)inflateReset2(strm, 15 + 16);
+    cur->raw = 0;
+
+    return 0;
+}
+
+/* Returns the number of unconsumed bytes in the window, 0 at EOF. */
+static int
+gz_fill(struct ancientfs_gz* gz, struct gz_cursor* cur)
+{
+    z_stream* strm = &cur->strm;
+
+    if (cur->next < cur->have)
+        return cur->have - cur->next;
+
+    if (cur->eof)
+        return 0;
+
+    if (cur->have == GZ_WINSIZE)
+        cur->have = cur->next = 0;
+
+    for (;;) {
+
+        if (!strm->avail_in) {
+            int n = gz_refill(gz, cur);
+            if (n < 0)
+                return -1;
+            if (n == 0) {
+                cur->eof = 1;
+                return 0;
+            }
+        }
+
+        strm->next_out = cur->window + cur->have;
+        strm->avail_out = GZ_WINSIZE - cur->have;
+
+        int ret = inflate(strm, Z_BLOCK);
+
+        cur->have = GZ_WINSIZE - strm->avail_out;
+
+        if ((ret == Z_NEED_DICT) || (ret == Z_DATA_ERROR) ||
+            (ret == Z_MEM_ERROR)) {
+            fprintf(stderr, "*** warning: corrupt gzip data near offset %llu\n",
+                    (unsigned long long)(cur->in - strm->avail_in));
+            cur->eof = 1;
+            return -1;
+        }
+
+        if (ret == Z_STREAM_END) {
+            if (gz_nextmember(gz, cur) != 0)
+                cur->eof = 1;
+        } else if ((cur == gz->scan) && gz->building &&
+                   (strm->data_type & 128) && !(strm->data_type & 64)) {
+            gz_addpoint(gz, cur, strm->data_type & 7);
+        }
+
+        if (cur->next < cur->have)
+            return cur->have - cur->next;
+
+        if (cur->eof)
+            return 0;
+    }
+}
+
+static ssize_t
+gz_cursor_read(struct ancientfs_gz* gz, struct gz_cursor* cur, void* buf,
+               size_t nbyte)
+{
+    ssize_t done = 0;
+    char* p = buf;
+
+    while (nbyte > 0) {
+        int avail = gz_fill(gz, cur);
+        if (avail < 0) {
+            if (done)
+                break;
+            errno = EIO;
+            return -1;
+        }
+        if (avail == 0)
+            break;
+        size_t tomove = ((size_t)avail < nbyte) ? (size_t)avail : nbyte;
+        if (p) {
+            memcpy(p, cur->window + cur->next, tomove);
+            p += tomove;
+        }
+        cur->next += tomove;
+        cur->pos += tomove;
+        nbyte -= tomove;
+        done += tomove;
+    }
+
+    return done;
+}
+
+static int
+gz_cursor_seek(struct ancientfs_gz* gz, struct gz_cursor* cur, off_t offset)
+{
+    off_t base = cur->pos - cur->next; /* uncompressed offset of window[0] */
+
+    if ((offset >= base) && (offset <= base + cur->have)) {
+        cur->next = (unsigned)(offset - base);
+        cur->pos = offset;
+        return 0;
+    }
+
+    struct gz_point* pt = gz_findpoint(gz, offset);
+
+    if ((offset < base) || (pt && (pt->out > cur->pos))) {
+        if (pt) {
+            if (gz_cursor_resume(gz, cur, pt) != 0)
+                return -1;
+        } else
+            gz_cursor_rewind(cur);
+    }
+
+    off_t toskip = offset - cur->pos;
+    if (toskip > 0) {
+        ssize_t skipped = gz_cursor_read(gz, cur, NULL, (size_t)toskip);
+        if (skipped < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parallel inflate for BGZF (bgzip) archives. Every BGZF member carries its
+ * own compressed length in the gzip extra field, so member boundaries are
+ * known without inflating anything. The scanning thread hands members out
+ * to a pool of workers and consumes their output in archive order through
+ * a small reorder buffer. A member start needs no history, so checkpoints
+ * recorded here carry no window.
+ */
+
+/* Returns 1 for a BGZF member, 0 at the end of the gzip data, -1 otherwise. */
+static int
+gz_bgzf_member(struct ancientfs_gz* gz, off_t in, uint32_t* clen)
+{
+    unsigned char h[18];
+
+    ssize_t n = pread(gz->fd, h, sizeof(h), in);
+    if ((n < 2) || (h[0] != 0x1f) || (h[1] != 0x8b))
+        return (n < 0) ? -1 : 0;
+
+    if ((n != sizeof(h)) || (h[2] != Z_DEFLATED) || !(h[3] & 4))
+        return -1;
+
+    /* bgzip writes exactly one extra subfield: 'B' 'C' with BSIZE */
+    if ((h[10] != 6) || h[11] || (h[12] != 'B') || (h[13] != 'C') ||
+        (h[14] != 2) || h[15])
+        return -1;
+
+    *clen = (uint32_t)(h[16] | (h[17] << 8)) + 1;
+
+    return 1;
+}
+
+static void*
+gz_par_worker(void* arg)
+{
+    struct ancientfs_gz* gz = (struct ancientfs_gz*)arg;
+    struct gz_par* par = gz->par;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    int ok = (inflateInit2(&strm, 15 + 16) == Z_OK);
+    unsigned char* cbuf = malloc(GZ_BGZF_MAXBLOCK);
+
+    for (;;) {
+
+        pthread_mutex_lock(&par->lock);
+        while (!par->stop && (par->nextwork == par->tail))
+            pthread_cond_wait(&par->work, &par->lock);
+        if (par->stop) {
+            pthread_mutex_unlock(&par->lock);
+            break;
+        }
+        struct gz_member* m = &par->slots[par->nextwork++ % GZ_PAR_MAXSLOTS];
+        off_t in = m->in;
+        uint32_t clen = m->clen;
+        pthread_mutex_unlock(&par->lock);
+
+        unsigned char* data = NULL;
+        size_t len = 0;
+        int state = GZ_MEMBER_ERROR;
+
+        if (ok && cbuf && (clen >= 18 + 8) &&
+            (pread(gz->fd, cbuf, clen, in) == clen)) {
+            uint32_t isize = cbuf[clen - 4] | (cbuf[clen - 3] << 8) |
+                             (cbuf[clen - 2] << 16) | (cbuf[clen - 1] << 24);
+            if ((isize <= GZ_BGZF_MAXBLOCK) && (data = malloc(isize + 1))) {
+                (void)inflateReset(&strm);
+                strm.next_in = cbuf;
+                strm.avail_in = clen;
+                strm.next_out = data;
+                strm.avail_out = isize + 1;
+                if ((inflate(&strm, Z_FINISH) == Z_STREAM_END) &&
+                    (strm.total_out == isize)) {
+                    state = GZ_MEMBER_DONE;
+                    len = isize;
+                } else {
+                    free(data);
+                    data = NULL;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&par->lock);
+        m->data = data;
+        m->len = len;
+        m->state = state;
+        pthread_cond_broadcast(&par->done);
+        pthread_mutex_unlock(&par->lock);
+    }
+
+    if (ok)
+        (void)inflateEnd(&strm);
+    free(cbuf);
+
+    return NULL;
+}
+
+static void
+gz_par_start(struct ancientfs_gz* gz)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t clen;
+
+    if ((ncpu < 2) || (gz_bgzf_member(gz, (off_t)0, &clen) != 1))
+        return;
+
+    struct gz_par* par = calloc(1, sizeof(struct gz_par));
+    if (!par)
+        return;
+
+    par->nthreads = (ncpu > GZ_PAR_MAXTHREADS) ? GZ_PAR_MAXTHREADS : (int)ncpu;
+    par->nslots = par->nthreads * 4;
+    if (par->nslots > GZ_PAR_MAXSLOTS)
+        par->nslots = GZ_PAR_MAXSLOTS;
+
+    pthread_mutex_init(&par->lock, (const pthread_mutexattr_t*)0);
+    pthread_cond_init(&par->work, (const pthread_condattr_t*)0);
+    pthread_cond_init(&par->done, (const pthread_condattr_t*)0);
+
+    gz->par = par;
+
+    int i;
+    for (i = 0; i < par->nthreads; i++) {
+        if (pthread_create(&par->threads[i], (const pthread_attr_t*)0,
+                           gz_par_worker, gz) != 0)
+            break;
+    }
+
+    if (i == 0) {
+        pthread_cond_destroy(&par->done);
+        pthread_cond_destroy(&par->work);
+        pthread_mutex_destroy(&par->lock);
+        free(par);
+        gz->par = NULL;
+        return;
+    }
+
+    par->nthreads = i;
+}
+
+static void
+gz_par_stop(struct ancientfs_gz* gz)
+{
+    struct gz_par* par = gz->par;
+    if (!par)
+        return;
+
+    pthread_mutex_lock(&par->lock);
+    par->stop = 1;
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->lock);
+
+    int i;
+    for (i = 0; i < par->nthreads; i++)
+        (void)pthread_join(par->threads[i], NULL);
+
+    uint64_t n;
+    for (n = par->head; n < par->tail; n++)
+        free(par->slots[n % GZ_PAR_MAXSLOTS].data);
+
+    pthread_cond_destroy(&par->done);
+    pthread_cond_destroy(&par->work);
+    pthread_mutex_destroy(&par->lock);
+    free(par);
+    gz->par = NULL;
+}
+
+static void
+gz_par_dispatch(struct ancientfs_gz* gz)
+{
+    struct gz_par* par = gz->par;
+
+    while ((par->end == GZ_PAR_MORE) &&
+           ((par->tail - par->head) < par->nslots)) {
+        uint32_t clen;
+        int ret = gz_bgzf_member(gz, par->nextin, &clen);
+        if (ret != 1) {
+            par->end = (ret == 0) ? GZ_PAR_EOF : GZ_PAR_SEQUENTIAL;
+            break;
+        }
+        pthread_mutex_lock(&par->lock);
+        struct gz_member* m = &par->slots[par->tail % GZ_PAR_MAXSLOTS];
+        m->in = par->nextin;
+        m->clen = clen;
+        m->state = GZ_MEMBER_PENDING;
+        m->data = NULL;
+        m->len = 0;
+        par->tail++;
+        pthread_cond_signal(&par->work);
+        pthread_mutex_unlock(&par->lock);
+        par->nextin += clen;
+    }
+}
+
+/* Hands the rest of the stream, if any, back to the scan cursor. */
+static void
+gz_par_end(struct ancientfs_gz* gz)
+{
+    struct gz_cursor* cur = gz->scan;
+    int sequential = (gz->par->end == GZ_PAR_SEQUENTIAL);
+    struct gz_point pt = { cur->pos, gz->par->nextin, 0, 0, NULL };
+
+    gz_par_stop(gz);
+
+    if (sequential)
+        (void)gz_cursor_resume(gz, cur, &pt);
+    else
+        cur->eof = 1;
+}
+
+static ssize_t
+gz_par_read(struct ancientfs_gz* gz, void* buf, size_t nbyte)
+{
+    struct gz_par* par = gz->par;
+    struct gz_cursor* cur = gz->scan;
+    ssize_t done = 0;
+    char* p = buf;
+
+    while (nbyte > 0) {
+
+        gz_par_dispatch(gz);
+
+        if (par->head == par->tail) {
+            gz_par_end(gz);
+            break;
+        }
+
+        struct gz_member* m = &par->slots[par->head % GZ_PAR_MAXSLOTS];
+
+        pthread_mutex_lock(&par->lock);
+        while (m->state == GZ_MEMBER_PENDING)
+            pthread_cond_wait(&par->done, &par->lock);
+        pthread_mutex_unlock(&par->lock);
+
+        if (m->state == GZ_MEMBER_ERROR) {
+            fprintf(stderr, "*** warning: corrupt gzip member at offset %llu\n",
+                    (unsigned long long)m->in);
+            gz_par_stop(gz);
+            cur->eof = 1;
+            if (done)
+                break;
+            errno = EIO;
+            return -1;
+        }
+
+        if (!par->consumed && gz->building) {
+            struct gz_point* pt = gz_newpoint(gz, cur->pos);
+            if (pt)
+                pt->in = m->in;
+        }
+
+        size_t tomove = m->len - par->consumed;
+        if (tomove > nbyte)
+            tomove = nbyte;
+        if (p) {
+            memcpy(p, m->data + par->consumed, tomove);
+            p += tomove;
+        }
+        par->consumed += tomove;
+        cur->pos += tomove;
+        nbyte -= tomove;
+        done += tomove;
+
+        if (par->consumed == m->len) {
+            free(m->data);
+            m->data = NULL;
+            par->consumed = 0;
+            par->head++;
+        }
+    }
+
+    return done;
+}
+
+static int
+gz_loadindex(struct ancientfs_gz* gz)
+{
+    int fd = open(gz->idxpath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct gz_idxheader hdr;
+    struct gz_point* points = NULL;
+    uint32_t i, n = 0;
+
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto bad;
+
+    if ((memcmp(hdr.magic, GZ_IDXMAGIC, GZ_IDXMAGLEN) != 0) ||
+        (hdr.csize != (uint64_t)gz->csize) ||
+        (hdr.mtime != (int64_t)gz->mtime) || (hdr.npoints == 0))
+        goto bad;
+
+    points = calloc(hdr.npoints, sizeof(struct gz_point));
+    if (!points)
+        goto bad;
+
+    for (n = 0; n < hdr.npoints; n++) {
+        struct gz_idxpoint ip;
+        if (read(fd, &ip, sizeof(ip)) != sizeof(ip))
+            goto bad;
+        if ((ip.bits < 0) || (ip.bits > 7) || (ip.winlen > GZ_WINSIZE))
+            goto bad;
+        points[n].out = ip.out;
+        points[n].in = ip.in;
+        points[n].bits = ip.bits;
+        points[n].winlen = ip.winlen;
+        if (ip.winlen) {
+            points[n].window = malloc(ip.winlen);
+            if (!points[n].window)
+                goto bad;
+            if (read(fd, points[n].window, ip.winlen) != ip.winlen) {
+                free(points[n].window);
+                goto bad;
+            }
+        }
+    }
+
+    close(fd);
+
+    gz->points = points;
+    gz->npoints = gz->maxpoints = (int)hdr.npoints;
+    gz->usize = (off_t)hdr.usize;
+    gz->span = (off_t)hdr.span;
+    gz->building = 0;
+
+    return 0;
+
+bad:
+    for (i = 0; i < n; i++)
+        free(points[i].window);
+    free(points);
+    close(fd);
+    fprintf(stderr, "*** warning: ignoring stale or damaged %s\n", gz->idxpath);
+    return -1;
+}
+
+static int
+gz_saveindex(struct ancientfs_gz* gz)
+{
+    char tmppath[strlen(gz->idxpath) + 5];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", gz->idxpath);
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    struct gz_idxheader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, GZ_IDXMAGIC, GZ_IDXMAGLEN);
+    hdr.csize = gz->csize;
+    hdr.mtime = gz->mtime;
+    hdr.usize = gz->usize;
+    hdr.span = gz->span;
+    hdr.npoints = gz->npoints;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto bad;
+
+    int i;
+    for (i = 0; i < gz->npoints; i++) {
+        struct gz_point* pt = &gz->points[i];
+        struct gz_idxpoint ip = { pt->out, pt->in, pt->bits, pt->winlen };
+        if (write(fd, &ip, sizeof(ip)) != sizeof(ip))
+            goto bad;
+        if (pt->winlen && (write(fd, pt->window, pt->winlen) != pt->winlen))
+            goto bad;
+    }
+
+    if (close(fd) != 0) {
+        unlink(tmppath);
+        return -1;
+    }
+
+    if (rename(tmppath, gz->idxpath) != 0) {
+        unlink(tmppath);
+        return -1;
+    }
+
+    return 0;
+
+bad:
+    close(fd);
+    unlink(tmppath);
+    return -1;
+}
+
+int
+ancientfs_gz_detect(int fd)
+{
+    unsigned char magic[2];
+
+    if (pread(fd, magic, 2, (off_t)0) != 2)
+        return 0;
+
+    return (magic[0] == 0x1f) && (magic[1] == 0x8b);
+}
+
+struct ancientfs_gz*
+ancientfs_gz_open(int fd, const char* path)
+{
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) != 0)
+        return NULL;
+
+    struct ancientfs_gz* gz = calloc(1, sizeof(struct ancientfs_gz));
+    if (!gz)
+        return NULL;
+
+    size_t pathlen = strlen(path) + sizeof(ANCIENTFS_GZ_IDXSUFFIX);
+    gz->idxpath = malloc(pathlen);
+    gz->scan = gz_cursor_new();
+    if (!gz->idxpath || !gz->scan ||
+        pthread_mutex_init(&gz->lock, (const pthread_mutexattr_t*)0)) {
+        gz_cursor_free(gz->scan);
+        free(gz->idxpath);
+        free(gz);
+        return NULL;
+    }
+
+    snprintf(gz->idxpath, pathlen, "%s%s", path, ANCIENTFS_GZ_IDXSUFFIX);
+
+    gz->fd = fd;
+    gz->csize = stbuf.st_size;
+    gz->mtime = stbuf.st_mtime;
+    gz->span = ANCIENTFS_GZ_SPAN;
+    gz->building = 1;
+
+    (void)gz_loadindex(gz);
+
+    gz_par_start(gz);
+
+    return gz;
+}
+
+void
+ancientfs_gz_close(struct ancientfs_gz* gz)
+{
+    if (!gz)
+        return;
+
+    int i;
+
+    gz_par_stop(gz);
+
+    for (i = 0; i < GZ_NCURSORS; i++)
+        gz_cursor_free(gz->idle[i]);
+
+    for (i = 0; i < gz->npoints; i++)
+        free(gz->points[i].window);
+
+    gz_cursor_free(gz->scan);
+    (void)pthread_mutex_destroy(&gz->lock);
+    free(gz->points);
+    free(gz->idxpath);
+    free(gz);
+}
+
+ssize_t
+ancientfs_gz_read(struct ancientfs_gz* gz, void* buf, size_t nbyte)
+{
+    if (!gz->scan) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (gz->par) {
+        ssize_t done = gz_par_read(gz, buf, nbyte);
+        if ((done < 0) || ((size_t)done == nbyte) || gz->par)
+            return done;
+        /* the rest of the stream is not BGZF */
+        ssize_t more = gz_cursor_read(gz, gz->scan, buf ? (char*)buf + done :
+                                      NULL, nbyte - done);
+        return (more < 0) ? done : done + more;
+    }
+
+    return gz_cursor_read(gz, gz->scan, buf, nbyte);
+}
+
+off_t
+ancientfs_gz_seek(struct ancientfs_gz* gz, off_t offset, int whence)
+{
+    struct gz_cursor* cur = gz->scan;
+
+    if (!cur) {
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    if (whence == SEEK_CUR)
+        offset += cur->pos;
+    else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    if (gz->par) {
+        if (offset >= cur->pos) {
+            (void)ancientfs_gz_read(gz, NULL, (size_t)(offset - cur->pos));
+            return cur->pos;
+        }
+        gz_par_stop(gz); /* backwards: fall back to the checkpoints */
+    }
+
+    if ((offset != cur->pos) && (gz_cursor_seek(gz, cur, offset) != 0)) {
+        errno = EIO;
+        return (off_t)-1;
+    }
+
+    return cur->pos;
+}
+
+int
+ancientfs_gz_finish(struct ancientfs_gz* gz)
+{
+    if (!gz->scan)
+        return 0;
+
+    if (gz->building) {
+        /* make sure the index covers the whole stream */
+        while (ancientfs_gz_read(gz, NULL, (size_t)1 << 30) > 0)
+            continue;
+        gz->usize = gz->scan->pos;
+        gz->building = 0;
+        if (gz_saveindex(gz) != 0)
+            fprintf(stderr, "*** warning: failed to save checkpoints to %s\n",
+                    gz->idxpath);
+    }
+
+    gz_par_stop(gz);
+    gz_cursor_free(gz->scan);
+    gz->scan = NULL;
+
+    return 0;
+}
+
+off_t
+ancientfs_gz_size(struct ancientfs_gz* gz)
+{
+    return gz->usize;
+}
+
+ssize_t
+ancientfs_gz_pread(struct ancientfs_gz* gz, void* buf, size_t nbyte,
+                   off_t offset)
+{
+    struct gz_cursor* cur = NULL;
+    int i, best = -1;
+
+    /* prefer an idle cursor that can get there by inflating forward */
+    pthread_mutex_lock(&gz->lock);
+    for (i = 0; i < GZ_NCURSORS; i++) {
+        struct gz_cursor* c = gz->idle[i];
+        if (!c || (c->pos - c->next) > offset || (offset - c->pos) > gz->span)
+            continue;
+        if ((best < 0) || (c->pos > gz->idle[best]->pos))
+            best = i;
+    }
+    if (best < 0) {
+        for (i = 0; i < GZ_NCURSORS; i++)
+            if (gz->idle[i]) {
+                best = i;
+                break;
+            }
+    }
+    if (best >= 0) {
+        cur = gz->idle[best];
+        gz->idle[best] = NULL;
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    if (!cur && !(cur = gz_cursor_new())) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t ret = -1;
+
+    if (gz_cursor_seek(gz, cur, offset) == 0)
+        ret = gz_cursor_read(gz, cur, buf, nbyte);
+    else
+        errno = EIO;
+
+    pthread_mutex_lock(&gz->lock);
+    for (i = 0; i < GZ_NCURSORS; i++) {
+        if (!gz->idle[i]) {
+            gz->idle[i] = cur;
+            cur = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    gz_cursor_free(cur);
+
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ */
+
+#ifndef _ANCIENTFS_GZIP_H_
+#define _ANCIENTFS_GZIP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Random access to gzip-compressed archives.
+ *
+ * The first sequential pass over the archive (the tape scan done by init)
+ * records inflate checkpoints in the manner of zlib's zran example: at a
+ * deflate block boundary roughly every span bytes of uncompressed output,
+ * we remember the compressed and uncompressed offsets, the bit offset, and
+ * the 32KB of output preceding the boundary. A later read at an arbitrary
+ * uncompressed offset only has to inflate from the nearest checkpoint.
+ *
+ * The checkpoints are saved next to the archive (DMG.gzidx) so that the
+ * next mount need not rebuild them.
+ *
+ * Archives written by bgzip (BGZF) consist of small gzip members that carry
+ * their own compressed length; the scan inflates those on all processors.
+ */
+
+#define ANCIENTFS_GZ_SPAN      (1024 * 1024) /* minimum checkpoint spacing */
+#define ANCIENTFS_GZ_MAXPOINTS 1024          /* bound on window memory */
+#define ANCIENTFS_GZ_IDXSUFFIX ".gzidx"
+
+struct ancientfs_gz;
+
+int                  ancientfs_gz_detect(int fd);
+struct ancientfs_gz* ancientfs_gz_open(int fd, const char* path);
+void                 ancientfs_gz_close(struct ancientfs_gz* gz);
+
+/* sequential access; used while scanning the archive */
+ssize_t ancientfs_gz_read(struct ancientfs_gz* gz, void* buf, size_t nbyte);
+off_t   ancientfs_gz_seek(struct ancientfs_gz* gz, off_t offset, int whence);
+
+/* finishes the scan, completing and saving the checkpoint index */
+int     ancientfs_gz_finish(struct ancientfs_gz* gz);
+off_t   ancientfs_gz_size(struct ancientfs_gz* gz);
+
+/* random access; safe to call from multiple threads once finished */
+ssize_t ancientfs_gz_pread(struct ancientfs_gz* gz, void* buf, size_t nbyte,
+                           off_t offset);
+
+#endif /* _ANCIENTFS_GZIP_H_ */
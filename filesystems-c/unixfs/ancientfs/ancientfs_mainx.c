@@ -187,12 +187,24 @@ static struct filesystems {
         "ustar, pre-POSIX ustar, or V7 tar archive",
         257, { 0x75, 0x73, 0x74, 0x61, 0x72, 0x20 }, 6, /* pre-POSIX ustar */
     },
+    {
+        1, "tar", "tar",
+        0,
+        "ustar, pre-POSIX ustar, or V7 tar archive",
+        0, { 0x1f, 0x8b }, 2, /* gzip-compressed tar */
+    },
     {
         1, "tar", "tar",
         0,
         "ustar, pre-POSIX ustar, or V7 tar archive",
         0, { 0 }, 0, /* V7 tar */
     },
+    {
+        0, "flat", "flat",
+        0,
+        "Flattened image written by --flatten from any supported type",
+        0, { 0x55, 0x46, 0x53, 0x46, 0x4c, 0x41, 0x54, 0x31 }, 8, /* UFSFLAT1 */
+    },
     {
         0, "v1", "v123",
         ANCIENTFS_UNIX_V1,
@@ -309,7 +321,7 @@ unixfs_usage(void)
 "AncientFS (%s): a OSXFUSE file system to mount ancient Unix disks and tapes\n"
 "Amit Singh <http://osxbook.com>\n"
 "usage:\n"
-"      %s [--force] [--fsendian pdp|big|little] --dmg DMG --type TYPE MOUNTPOINT [OSXFUSE args...]\n"
+"      %s [--force] [--immutable] [--prewarm PATHS] [--fsendian pdp|big|little] --dmg DMG --type TYPE MOUNTPOINT [OSXFUSE args...]\n"
 "where:\n"
 "     . DMG is an ancient Unix disk or tape image of a valid type\n"
 "     . TYPE is one of the following:\n\n",
@@ -325,6 +337,22 @@ PROGVERS, PROGNAME);
 
     fprintf(stderr, "%s",
     "     . --force attempts mounting even if there are warnings or errors\n"
+    "     . --immutable lets the kernel cache names, attributes and data\n"
+    "       indefinitely (the image must not change while mounted)\n"
+    "     . --prewarm PATH[:PATH...] pushes the files under those paths into\n"
+    "       the kernel's cache after mounting; --prewarm-budget BYTES caps it\n"
+    "     . --prefetch-meta sequentially reads the image's file system\n"
+    "       metadata (the i-list) in the background after mounting (v7 only)\n"
+    "     . --nocache-image keeps the image out of the host's buffer cache,\n"
+    "       so file data is cached only once, by the mount\n"
+    "     . --workers N hands requests to N worker threads (0: one per CPU),\n"
+    "       serving lookups and attributes ahead of reads and listings\n"
+    "     . --inline-max BYTES keeps tar and cpio members up to that size in\n"
+    "       memory from mount time on (default 2048; 0 turns this off)\n"
+    "     . --disk-cache DIR[,BYTES] keeps image blocks in DIR across mounts,\n"
+    "       for images on slow media (default 1 GB per image)\n"
+    "     . --flatten OUT writes the file system out as a flattened image\n"
+    "       instead of mounting it; ancientfs mounts that as type flat\n"
     );
 }
 
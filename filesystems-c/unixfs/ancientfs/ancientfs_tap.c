@@ -471,6 +471,13 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
     char blkbuf[iosize];
     char* p = buf;
 
+    if ((offset == 0) && (ip->I_size > 0)) { /* members are contiguous */
+        off_t bn = unixfs_internal_bmap(ip, 0, error);
+        if (!*error)
+            unixfs_archive_readahead(unixfs->s_bdev, bn * (off_t)BSIZE,
+                                     ip->I_size);
+    }
+
     while (remaining > 0) {
         off_t lbn = offset / BSIZE;
         off_t bn = unixfs_internal_bmap(ip, lbn, error);
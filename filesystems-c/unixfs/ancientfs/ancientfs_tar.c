@@ -35,6 +35,30 @@ struct tar_entry {
 
 static int ancientfs_tar_readheader(int fd, struct tar_entry* te);
 static int ancientfs_tar_chksum(union hblock* hb);
+static ssize_t ancientfs_tar_read(int fd, void* buf, size_t nbyte);
+static off_t ancientfs_tar_seek(int fd, off_t offset, int whence);
+
+static ssize_t
+ancientfs_tar_read(int fd, void* buf, size_t nbyte)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+
+    if (fs->s_gz)
+        return ancientfs_gz_read(fs->s_gz, buf, nbyte);
+
+    return read(fd, buf, nbyte);
+}
+
+static off_t
+ancientfs_tar_seek(int fd, off_t offset, int whence)
+{
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+
+    if (fs->s_gz)
+        return ancientfs_gz_seek(fs->s_gz, offset, whence);
+
+    return lseek(fd, offset, whence);
+}
 
 int
 ancientfs_tar_chksum(union hblock* hb)
@@ -63,7 +87,7 @@ ancientfs_tar_readheader(int fd, struct tar_entry* te)
 retry:
 
     ustar = unixfs->s_flags & ANCIENTFS_USTAR;
-    nr = read(fd, hb, sizeof(union hblock));
+    nr = ancientfs_tar_read(fd, hb, sizeof(union hblock));
     if (nr != sizeof(union hblock)) {
         if (!nr)
             return 1;
@@ -195,6 +219,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
+    struct ancientfs_gz* gz = (struct ancientfs_gz*)0;
 
     if ((err = fstat(fd, &stbuf)) != 0) {
         perror("fstat");
@@ -207,9 +232,19 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
+    if (ancientfs_gz_detect(fd)) {
+        if (!(gz = ancientfs_gz_open(fd, dmg))) {
+            fprintf(stderr, "failed to set up gzip decompression\n");
+            err = ENOMEM;
+            goto out;
+        }
+    }
+
     char hb[sizeof(union hblock) + 1];
 
-    if (read(fd, hb, sizeof(union hblock)) != sizeof(union hblock)) {
+    ssize_t nr = (gz) ? ancientfs_gz_pread(gz, hb, sizeof(union hblock), 0) :
+                        read(fd, hb, sizeof(union hblock));
+    if (nr != sizeof(union hblock)) {
         fprintf(stderr, "failed to read data from file\n");
         err = EIO;
         goto out;
@@ -250,6 +285,8 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    fs->s_gz = gz;
+
     /* must initialize the inode layer before sanity checking */
     if ((err = unixfs_inodelayer_init(sizeof(struct tar_node_info))) != 0)
         goto out;
@@ -280,13 +317,14 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     fs->s_rootip = rootip;
     fs->s_lastino = ROOTINO;
 
-    lseek(fd, (off_t)0, SEEK_SET); /* rewind tape */
+    ancientfs_tar_seek(fd, (off_t)0, SEEK_SET); /* rewind tape */
 
     struct tar_entry _te, *te = &_te;
 
     for (;;) {
 
-        off_t toseek = 0;
+        off_t toseek = 0, consumed = 0;
+        struct tar_node_info* dti = NULL;
 
         if ((err = ancientfs_tar_readheader(fd, te)) != 0) {
             if (err == 1)
@@ -359,7 +397,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
             memcpy(ti->ti_name, cnp, namelen);
             ti->ti_name[namelen] = '\0';
 
-            ip->I_daddr[0] = 0;
+            ti->ti_dataoffset = 0;
 
             if (S_ISLNK(ip->I_mode)) {
                 namelen = strlen(te->linktargetname);
@@ -373,8 +411,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                 ti->ti_linktargetname[namelen] = '\0';
             } else if (S_ISREG(ip->I_mode)) {
 
-                ip->I_daddr[0] = (uint32_t)lseek(fd, (off_t)0, SEEK_CUR);
+                ti->ti_dataoffset = ancientfs_tar_seek(fd, (off_t)0, SEEK_CUR);
                 toseek = ip->I_size;
+                dti = ti;
 
             }
              
@@ -401,14 +440,30 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
         } /* for each component */
 
+        /* small members are read in passing instead of being skipped */
+        if (dti && (dti->ti_data = unixfs_inline_alloc(toseek))) {
+            if (ancientfs_tar_read(fd, dti->ti_data, toseek) == toseek)
+                consumed = toseek;
+            else {
+                unixfs_inline_free(dti->ti_data, toseek);
+                dti->ti_data = NULL;
+                (void)ancientfs_tar_seek(fd, dti->ti_dataoffset, SEEK_SET);
+            }
+        }
+
         if (toseek) {
             toseek = (toseek + TBLOCK - 1)/TBLOCK;
             toseek *= TBLOCK;
-            (void)lseek(fd, (off_t)toseek, SEEK_CUR);
+            (void)ancientfs_tar_seek(fd, (off_t)(toseek - consumed), SEEK_CUR);
         }
 
     } /* for each block */
 
+    if (gz) {
+        (void)ancientfs_gz_finish(gz);
+        fs->s_fsize = ancientfs_gz_size(gz) / TBLOCK;
+    }
+
     err = 0;
 
     unixfs->s_statvfs.f_bsize = TBLOCK;
@@ -433,6 +488,8 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
 out:
     if (err) {
+        if (gz)
+            ancientfs_gz_close(gz);
         if (fd >= 0)
             close(fd);
         if (fs)
@@ -459,6 +516,7 @@ unixfs_internal_fini(void* filsys)
                 free(ti->ti_name);
                 if (ti->ti_linktargetname)
                     free(ti->ti_linktargetname);
+                unixfs_inline_free(ti->ti_data, tmp->I_size);
             }
             unixfs_internal_iput(tmp);
             unixfs_internal_iput(tmp);
@@ -467,6 +525,10 @@ unixfs_internal_fini(void* filsys)
 
     unixfs_inodelayer_fini();
 
+    if (fs->s_gz)
+        ancientfs_gz_close(fs->s_gz);
+    fs->s_gz = NULL;
+
     if (sb) {
         if (sb->s_bdev >= 0)
             close(sb->s_bdev);
@@ -634,10 +696,23 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    off_t start = (off_t)ip->I_daddr[0];
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    struct tar_node_info* ti = (struct tar_node_info*)ip->I_private;
+    off_t start = ti->ti_dataoffset;
 
     /* caller already checked for bounds */
 
+    if (ti->ti_data) {
+        memcpy(buf, ti->ti_data + offset, nbyte);
+        return nbyte;
+    }
+
+    if ((offset == 0) && !fs->s_gz) /* no use on compressed offsets */
+        unixfs_archive_readahead(unixfs->s_bdev, start, ip->I_size);
+
+    if (fs->s_gz)
+        return ancientfs_gz_pread(fs->s_gz, buf, nbyte, start + offset);
+
     return pread(unixfs->s_bdev, buf, nbyte, start + offset);
 }
 
@@ -9,6 +9,7 @@
 
 #include "unixfs_internal.h"
 #include "ancientfs.h"
+#include "ancientfs_gzip.h"
 
 #define TBLOCK   512
 #define NAMSIZ   100
@@ -23,6 +24,7 @@ struct filsys
     uint32_t s_lastino;
     uint32_t s_dataoffset;
     struct inode* s_rootip;
+    struct ancientfs_gz* s_gz; /* non-NULL for a gzip-compressed archive */
 };
 
 #define TMAGIC   "ustar" /* space terminated (pre POSIX) or null terminated */
@@ -69,6 +71,8 @@ struct tar_node_info {
     struct   tar_node_info* ti_next_sibling;
     char*                   ti_name;
     char*                   ti_linktargetname;
+    off_t                   ti_dataoffset;
+    char*                   ti_data; /* inlined contents, if small */
 };
 
 /* modes */
@@ -23,7 +23,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +33,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -56,7 +56,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, SBSIZE, SUPERB) != SBSIZE) {
+    if (unixfs_image_pread(fd, fs, SBSIZE, SUPERB) != SBSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -137,7 +137,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (fs)
             free(fs);
         if (sb)
@@ -155,7 +155,7 @@ unixfs_internal_fini(void* filsys)
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_image_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -239,8 +239,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_image_pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
+                           blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
         return EIO;
 
     return 0;
@@ -402,7 +402,9 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     if ((*offset + unixfs->s_dentsize) > dp->I_size)
         return -1;
 
-    if (!dirbuf->flags.initialized || ((*offset & 0777) == 0)) {
+    off_t base = *offset & ~(off_t)0777;
+
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret;
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset / BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
@@ -410,6 +412,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         ret = unixfs_internal_bread(blkno, dirbuf->data);
         if (ret != 0)
             return ret;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
 
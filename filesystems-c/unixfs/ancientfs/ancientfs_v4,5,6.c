@@ -6,6 +6,7 @@
 
 #include "ancientfs_v4,5,6.h"
 #include "unixfs_common.h"
+#include "unixfs_dirent16.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -23,7 +24,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +34,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -56,7 +57,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, BSIZE, (off_t)(BSIZE * 1)) != BSIZE) {
+    if (unixfs_image_pread(fd, fs, BSIZE, (off_t)(BSIZE * 1)) != BSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -150,7 +151,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (fs)
             free(fs);
         if (sb)
@@ -168,7 +169,7 @@ unixfs_internal_fini(void* filsys)
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_image_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -299,8 +300,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_image_pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
+                           blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
         return EIO;
 
     return 0;
@@ -321,7 +322,8 @@ unixfs_internal_iget(ino_t ino)
     char ubuf[UNIXFS_IOSIZE(unixfs)];
     off_t blkno = (off_t)(((a_ino_t)ino + 31) / 16);
 
-    if (unixfs_internal_bread(blkno, ubuf) != 0) {
+    if (unixfs_inodelayer_ibread(blkno, ubuf, sizeof(ubuf),
+                                 unixfs_internal_bread) != 0) {
         unixfs_inodelayer_ifailed(ip);
         return NULL;
     }
@@ -406,45 +408,34 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         return ENOTDIR;
     }
 
-    int ret = ENOENT, eo = 0, count = dp->I_size / unixfs->s_dentsize;
+    int ret = ENOENT, count = dp->I_size / unixfs->s_dentsize;
     a_int offset = 0;
     char ubuf[UNIXFS_IOSIZE(unixfs)];
     struct dent udent;
 
-eloop:
-    if (count == 0) {
-        ret = ENOENT;
-        goto out;
-    }
-
-    if ((offset & 0777) == 0) {
+    while (count > 0) {
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(offset/BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
             goto out;
-        if (unixfs_internal_bread(blkno, ubuf) != 0)
+        if (unixfs_internal_bread(blkno, ubuf) != 0) {
+            ret = EIO;
             goto out;
-    }
-
-    memset(&udent, 0, sizeof(udent));
-    memcpy(&udent, ubuf + (offset & 0777), unixfs->s_dentsize);
-
-    udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+        }
 
-    offset += unixfs->s_dentsize;
-    count--;
+        int n = min(count, BSIZE / unixfs->s_dentsize);
+        int i = unixfs_dirent16_find(ubuf, n, name);
+        if (i >= 0) { /* matched */
+            memcpy(&udent, ubuf + i * unixfs->s_dentsize, unixfs->s_dentsize);
+            udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+            ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+            goto out;
+        }
 
-    if (udent.u_ino == 0) {
-        if (eo == 0)
-            eo = offset;
-        goto eloop;
+        offset += n * unixfs->s_dentsize;
+        count -= n;
     }
 
-    if (strncmp(name, udent.u_name, DIRSIZ) != 0)
-        goto eloop;
-
-    /* matched */
-
-    ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+    ret = ENOENT;
 
 out:
     unixfs_internal_iput(dp);
@@ -459,7 +450,9 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     if ((*offset + unixfs->s_dentsize) > dp->I_size)
         return -1;
 
-    if (!dirbuf->flags.initialized || ((*offset & 0777) == 0)) {
+    off_t base = *offset & ~(off_t)0777;
+
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret;
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset / BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
@@ -467,6 +460,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         ret = unixfs_internal_bread(blkno, dirbuf->data);
         if (ret != 0)
             return ret;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
 
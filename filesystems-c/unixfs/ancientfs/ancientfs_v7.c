@@ -6,6 +6,7 @@
 
 #include "ancientfs_v7.h"
 #include "unixfs_common.h"
+#include "unixfs_dirent16.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -22,22 +23,61 @@ DECL_UNIXFS("UNIX V10", v10);
 DECL_UNIXFS("UNIX V7", v7);
 #endif
 
+static off_t ancientfs_v7_alloc(struct filsys* fs);
+static void  ancientfs_v7_count(struct super_block* sb, struct statvfs* svb);
+
+/* block addresses are 3 bytes on disk; widen them before swapping */
+#define ANCIENTFS_V7_DECODERS(order, e)                                      \
+static void                                                                  \
+ancientfs_v7_idecode_##order(struct inode* ip, const struct dinode* dip)     \
+{                                                                            \
+    char* p1 = (char*)(ip->I_daddr);                                         \
+    const char* p2 = (const char*)(dip->di_addr);                            \
+    int i;                                                                   \
+    ip->I_mode  = fs16_to_host(e, dip->di_mode);                             \
+    ip->I_nlink = fs16_to_host(e, dip->di_nlink);                            \
+    ip->I_uid   = fs16_to_host(e, dip->di_uid);                              \
+    ip->I_gid   = fs16_to_host(e, dip->di_gid);                              \
+    ip->I_size  = fs32_to_host(e, dip->di_size);                             \
+    ip->I_atime_sec = fs32_to_host(e, dip->di_atime);                        \
+    ip->I_mtime_sec = fs32_to_host(e, dip->di_mtime);                        \
+    ip->I_ctime_sec = fs32_to_host(e, dip->di_ctime);                        \
+    for (i = 0; i < NADDR; i++) {                                            \
+        *p1++ = *p2++;                                                       \
+        *p1++ = 0;                                                           \
+        *p1++ = *p2++;                                                       \
+        *p1++ = *p2++;                                                       \
+    }                                                                        \
+    fs32_to_host_array_##order(ip->I_daddr, ip->I_daddr, NADDR);             \
+}                                                                            \
+static void                                                                  \
+ancientfs_v7_ddecode_##order(struct dent* dep, const char* p)                \
+{                                                                            \
+    memcpy(dep, p, unixfs->s_dentsize);                                      \
+    dep->u_ino = fs16_to_host(e, dep->u_ino);                                \
+}
+
+UNIXFS_FS_VARIANTS(ANCIENTFS_V7_DECODERS)
+
+static void (*ancientfs_v7_idecode)(struct inode*, const struct dinode*);
+static void (*ancientfs_v7_ddecode)(struct dent*, const char*);
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
 
-    int err, i;
+    int err;
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -60,7 +100,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, BSIZE, (off_t)(BSIZE * SUPERB)) != BSIZE) {
+    if (unixfs_image_pread(fd, fs, BSIZE, (off_t)(BSIZE * SUPERB)) != BSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -73,14 +113,17 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    ancientfs_v7_idecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                          ancientfs_v7_idecode);
+    ancientfs_v7_ddecode = UNIXFS_FS_PICK(unixfs->s_endian,
+                                          ancientfs_v7_ddecode);
+
     fs->s_isize = fs16_to_host(unixfs->s_endian, fs->s_isize);
     fs->s_fsize = fs32_to_host(unixfs->s_endian, fs->s_fsize);
     fs->s_nfree = fs16_to_host(unixfs->s_endian, fs->s_nfree);
-    for (i = 0; i < NICFREE; i++)
-        fs->s_free[i] = fs32_to_host(unixfs->s_endian, fs->s_free[i]);
+    fs32_to_host_array(unixfs->s_endian, fs->s_free, fs->s_free, NICFREE);
     fs->s_ninode = fs16_to_host(unixfs->s_endian, fs->s_ninode);
-    for (i = 0; i < NICINOD; i++)
-        fs->s_inode[i] = fs16_to_host(unixfs->s_endian, fs->s_inode[i]);
+    fs16_to_host_array(unixfs->s_endian, fs->s_inode, fs->s_inode, NICINOD);
     fs->s_time = fs32_to_host(unixfs->s_endian, fs->s_time);
 
     unixfs->s_statvfs.f_bsize = BSIZE;
@@ -99,37 +142,20 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         }
     }
 
-    int iblock;
-    unixfs->s_statvfs.f_files = 0;
-    unixfs->s_statvfs.f_ffree = 0;
-
-    char* ubuf = malloc(UNIXFS_IOSIZE(unixfs));
-    if (!ubuf) {
-        err = ENOMEM;
-        goto out;
-    }
-
-    for (iblock = 2; iblock < fs->s_isize; iblock++) {
-        if (unixfs_internal_bread((off_t)iblock, ubuf) != 0)
-            continue;
-        struct dinode* dip = (struct dinode*)ubuf;
-        for (i = 0; i < INOPB; i++, dip++) {
-            if (dip->di_nlink == 0)
-                unixfs->s_statvfs.f_ffree++;
-            else
-                unixfs->s_statvfs.f_files++;
-        }
-    }
-
-    free(ubuf);
+    /* until the real counts are in, go by the super block's totals */
+    a_daddr_t tfree = fs32_to_host(unixfs->s_endian, fs->s_tfree);
+    a_ino_t tinode = fs16_to_host(unixfs->s_endian, fs->s_tinode);
+    uint32_t ninodes = (fs->s_isize > 2) ? (fs->s_isize - 2) * INOPB : 0;
+    if ((tfree < 0) || (tfree > fs->s_fsize))
+        tfree = 0;
+    if (tinode > ninodes)
+        tinode = 0;
 
     unixfs->s_statvfs.f_blocks = fs->s_fsize;
-    unixfs->s_statvfs.f_bfree = 0;
-
-    while (unixfs_internal_alloc())
-        unixfs->s_statvfs.f_bfree++;
-
-    unixfs->s_statvfs.f_bavail = unixfs->s_statvfs.f_bfree;
+    unixfs->s_statvfs.f_bfree = tfree;
+    unixfs->s_statvfs.f_bavail = tfree;
+    unixfs->s_statvfs.f_files = ninodes - tinode;
+    unixfs->s_statvfs.f_ffree = tinode;
     unixfs->s_dentsize = DIRSIZ + 2;
     unixfs->s_statvfs.f_namemax = DIRSIZ;
 
@@ -143,10 +169,21 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     *fsname = unixfs->s_fsname;
     *volname = unixfs->s_volname;
 
+    (void)unixfs_statvfs_defer(unixfs, ancientfs_v7_count);
+
+    if ((flags & UNIXFS_PREFETCH) && (fs->s_isize > 2)) {
+        struct unixfs_extent* ext = malloc(sizeof(struct unixfs_extent));
+        if (ext) { /* the i-list */
+            ext->e_offset = (off_t)2 * BSIZE;
+            ext->e_length = (off_t)(fs->s_isize - 2) * BSIZE;
+            (void)unixfs_metaprefetch(unixfs, ext, 1);
+        }
+    }
+
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (fs)
             free(fs);
         if (sb)
@@ -160,11 +197,13 @@ out:
 static void
 unixfs_internal_fini(void* filsys)
 {
+    unixfs_metaprefetch_stop();
+    unixfs_statvfs_wait();
     unixfs_inodelayer_fini();
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_image_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -174,8 +213,12 @@ unixfs_internal_fini(void* filsys)
 static off_t
 unixfs_internal_alloc(void)
 {
-    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
+    return ancientfs_v7_alloc((struct filsys*)unixfs->s_fs_info);
+}
 
+static off_t
+ancientfs_v7_alloc(struct filsys* fs)
+{
     a_int i = --fs->s_nfree;
     if (i < 0)
         goto nospace;
@@ -196,8 +239,8 @@ unixfs_internal_alloc(void)
         if (ret == 0) {
             struct fblk* fblk = (struct fblk*)ubuf;
             fs->s_nfree = fs16_to_host(unixfs->s_endian, fblk->df_nfree);
-            for (i = 0; i < NICFREE; i++)
-                fs->s_free[i] = fs32_to_host(unixfs->s_endian, fblk->df_free[i]);
+            fs32_to_host_array(unixfs->s_endian, fs->s_free, fblk->df_free,
+                               NICFREE);
         } else
             return (off_t)0;
     }
@@ -209,6 +252,44 @@ nospace:
     return (off_t)0; /* ENOSPC */
 }
 
+static void
+ancientfs_v7_count(struct super_block* sb, struct statvfs* svb)
+{
+    struct filsys* fs = (struct filsys*)sb->s_fs_info;
+    int iblock, i;
+
+    char* ubuf = malloc(UNIXFS_IOSIZE(sb));
+    if (!ubuf)
+        return;
+
+    svb->f_files = 0;
+    svb->f_ffree = 0;
+
+    for (iblock = 2; iblock < fs->s_isize; iblock++) {
+        if (unixfs_internal_bread((off_t)iblock, ubuf) != 0)
+            continue;
+        struct dinode* dip = (struct dinode*)ubuf;
+        for (i = 0; i < INOPB; i++, dip++) {
+            if (dip->di_nlink == 0)
+                svb->f_ffree++;
+            else
+                svb->f_files++;
+        }
+    }
+
+    free(ubuf);
+
+    /* walk a copy of the free list so as to leave the real one alone */
+    struct filsys tfs;
+    memcpy(&tfs, fs, sizeof(struct filsys));
+
+    svb->f_bfree = 0;
+    while (ancientfs_v7_alloc(&tfs))
+        svb->f_bfree++;
+
+    svb->f_bavail = svb->f_bfree;
+}
+
 static off_t
 unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
 {
@@ -307,8 +388,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_image_pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
+                           blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
         return EIO;
 
     return 0;
@@ -331,7 +412,8 @@ unixfs_internal_iget(ino_t ino)
 
     char ubuf[UNIXFS_IOSIZE(unixfs)];
 
-    if (unixfs_internal_bread((off_t)itod((a_ino_t)ino), ubuf) != 0) {
+    if (unixfs_inodelayer_ibread((off_t)itod((a_ino_t)ino), ubuf,
+                                 sizeof(ubuf), unixfs_internal_bread) != 0) {
         unixfs_inodelayer_ifailed(ip);
         return NULL;
     }
@@ -341,30 +423,7 @@ unixfs_internal_iget(ino_t ino)
 
     ip->I_number = ino;
 
-    ip->I_mode  = fs16_to_host(unixfs->s_endian, dip->di_mode);
-    ip->I_nlink = fs16_to_host(unixfs->s_endian, dip->di_nlink);
-    ip->I_uid   = fs16_to_host(unixfs->s_endian, dip->di_uid);
-    ip->I_gid   = fs16_to_host(unixfs->s_endian, dip->di_gid);
-    ip->I_size  = fs32_to_host(unixfs->s_endian, dip->di_size);
-
-    ip->I_atime_sec = fs32_to_host(unixfs->s_endian, dip->di_atime);
-    ip->I_mtime_sec = fs32_to_host(unixfs->s_endian, dip->di_mtime);
-    ip->I_ctime_sec = fs32_to_host(unixfs->s_endian, dip->di_ctime);
-
-    int i;
-
-    char* p1 = (char*)(ip->I_daddr);
-    char* p2 = (char*)(dip->di_addr);
-
-    for (i = 0; i < NADDR; i++) {
-        *p1++ = *p2++;
-        *p1++ = 0;
-        *p1++ = *p2++;
-        *p1++ = *p2++;
-    }
-
-    for (i = 0; i < NADDR; i++)
-        ip->I_daddr[i] = fs32_to_host(unixfs->s_endian, ip->I_daddr[i]);
+    ancientfs_v7_idecode(ip, dip);
 
     if (S_ISCHR(ip->I_mode) || S_ISBLK(ip->I_mode)) {
         uint32_t rdev = ip->I_daddr[0];
@@ -422,45 +481,33 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         return ENOTDIR;
     }
 
-    int ret = ENOENT, eo = 0, count = dp->I_size / unixfs->s_dentsize;
+    int ret = ENOENT, count = dp->I_size / unixfs->s_dentsize;
     a_int offset = 0;
     char ubuf[UNIXFS_IOSIZE(unixfs)];
     struct dent udent;
 
-eloop:
-    if (count == 0) {
-        ret = ENOENT;
-        goto out;
-    }
-
-    if ((offset & BMASK) == 0) {
+    while (count > 0) {
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(offset/BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
             goto out;
-        if (unixfs_internal_bread(blkno, ubuf) != 0)
+        if (unixfs_internal_bread(blkno, ubuf) != 0) {
+            ret = EIO;
             goto out;
-    }
-
-    memset(&udent, 0, sizeof(udent));
-    memcpy(&udent, ubuf + (offset & BMASK), unixfs->s_dentsize);
-
-    udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+        }
 
-    offset += unixfs->s_dentsize;
-    count--;
+        int n = min(count, BSIZE / unixfs->s_dentsize);
+        int i = unixfs_dirent16_find(ubuf, n, name);
+        if (i >= 0) { /* matched */
+            ancientfs_v7_ddecode(&udent, ubuf + i * unixfs->s_dentsize);
+            ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+            goto out;
+        }
 
-    if (udent.u_ino == 0) {
-        if (eo == 0)
-            eo = offset;
-        goto eloop;
+        offset += n * unixfs->s_dentsize;
+        count -= n;
     }
 
-    if (strncmp(name, udent.u_name, DIRSIZ) != 0)
-        goto eloop;
-
-    /* matched */
-
-    ret = unixfs_internal_igetattr((ino_t)(udent.u_ino), stbuf);
+    ret = ENOENT;
 
 out:
     unixfs_internal_iput(dp);
@@ -475,7 +522,9 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     if ((*offset + unixfs->s_dentsize) > dp->I_size)
         return -1;
 
-    if (!dirbuf->flags.initialized || ((*offset & BMASK) == 0)) {
+    off_t base = *offset & ~(off_t)BMASK;
+
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, base)) {
         int ret;
         off_t blkno = unixfs_internal_bmap(dp, (off_t)(*offset / BSIZE), &ret);
         if (UNIXFS_BADBLOCK(blkno, ret))
@@ -483,6 +532,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         ret = unixfs_internal_bread(blkno, dirbuf->data);
         if (ret != 0)
             return ret;
+        dirbuf->base = base;
         dirbuf->flags.initialized = 1;
     }
 
@@ -490,8 +540,7 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
     size_t dirnamelen = min(DIRSIZ, UNIXFS_MAXNAMLEN);
 
     memset(&udent, 0, sizeof(udent));
-    memcpy(&udent, dirbuf->data + (*offset & BMASK), unixfs->s_dentsize);
-    udent.u_ino = fs16_to_host(unixfs->s_endian, udent.u_ino);
+    ancientfs_v7_ddecode(&udent, dirbuf->data + (*offset & BMASK));
     dent->ino = udent.u_ino;
     memcpy(dent->name, udent.u_name, dirnamelen);
     dent->name[dirnamelen] = '\0';
@@ -595,6 +644,6 @@ unixfs_internal_sanitycheck(void* filsys, off_t disksize)
 static int
 unixfs_internal_statvfs(struct statvfs* svb)
 {
-    memcpy(svb, &unixfs->s_statvfs, sizeof(struct statvfs));
+    unixfs_statvfs_get(unixfs, svb);
     return 0;
 }
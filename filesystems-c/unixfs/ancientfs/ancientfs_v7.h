@@ -57,7 +57,7 @@ struct filsys
     char      s_ilock;          /* lock during i-list manipulation */
     char      s_fmod;           /* super block modified flag */
     char      s_ronly;          /* mounted read-only flag */
-    time_t    s_time;           /* last super block update */
+    a_time_t  s_time;           /* last super block update */
 
     /* remainder not maintained by this version of the system */
 
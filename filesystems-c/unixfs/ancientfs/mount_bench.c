@@ -0,0 +1,165 @@
+/*
+ * Ancient UNIX File Systems for OSXFUSE
+ *
+ * Request latency and read throughput over a mounted tree, for comparing
+ * session loops (the libfuse 2 loop against "make FUSE3=1", with or without
+ * -o io_uring). Mount the same image each way with -o attr_timeout=0 and
+ * -o entry_timeout=0, so that every stat reaches the file system, then run
+ *
+ *     make bench MNT=/path/to/mountpoint [THREADS=N]
+ *
+ * Latency is per lstat, over the whole tree, from one thread. Throughput
+ * is N threads reading all regular files in 128 KB requests; remount (or
+ * use -o direct_io) between runs so the second one is not served from the
+ * page cache.
+ */
+
+#define _XOPEN_SOURCE 700 /* nftw */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_IOSIZE   (128 * 1024)
+#define BENCH_MAXFILES (1024 * 1024)
+
+static char** paths;
+static int    npaths;
+static int    nregular;
+static int    next_path;
+
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+collect(const char* path, const struct stat* sb, int flag, struct FTW* ftw)
+{
+    if (npaths == BENCH_MAXFILES)
+        return 1;
+
+    if ((paths[npaths] = strdup(path)) == NULL)
+        return -1;
+
+    /* regular files first, so the readers can take a prefix */
+    if (S_ISREG(sb->st_mode)) {
+        char* t = paths[nregular];
+        paths[nregular++] = paths[npaths];
+        paths[npaths] = t;
+    }
+    npaths++;
+
+    return 0;
+}
+
+static int
+cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static void*
+reader(void* arg)
+{
+    unsigned long long* bytes = (unsigned long long*)arg;
+    char* buf = malloc(BENCH_IOSIZE);
+
+    while (buf) {
+        pthread_mutex_lock(&next_lock);
+        int i = (next_path < nregular) ? next_path++ : -1;
+        pthread_mutex_unlock(&next_lock);
+        if (i < 0)
+            break;
+
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0)
+            continue;
+        ssize_t n;
+        while ((n = read(fd, buf, BENCH_IOSIZE)) > 0) {
+            bytes[0] += n;
+            bytes[1]++;
+        }
+        close(fd);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    int i, nthreads = (argc > 2) ? atoi(argv[2]) : 8;
+
+    if ((argc < 2) || (nthreads < 1)) {
+        fprintf(stderr, "usage: %s MOUNTPOINT [THREADS]\n", argv[0]);
+        return 1;
+    }
+
+    if ((paths = calloc(BENCH_MAXFILES, sizeof(char*))) == NULL)
+        return 1;
+
+    if (nftw(argv[1], collect, 64, FTW_PHYS) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    double* lat = malloc(npaths * sizeof(double));
+    if (!lat || (npaths == 0))
+        return 1;
+
+    struct stat st;
+    double t0 = now();
+    for (i = 0; i < npaths; i++) {
+        double t = now();
+        (void)lstat(paths[i], &st);
+        lat[i] = now() - t;
+    }
+    double t1 = now();
+
+    qsort(lat, npaths, sizeof(double), cmp_double);
+
+    printf("lstat:  %d calls, %.0f/s, median %.1f us, p99 %.1f us\n",
+           npaths, npaths / (t1 - t0), lat[npaths / 2] * 1e6,
+           lat[(int)(npaths * 0.99)] * 1e6);
+
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    unsigned long long (*counts)[2] = calloc(nthreads, sizeof(*counts));
+    if (!threads || !counts)
+        return 1;
+
+    t0 = now();
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, reader, counts[i]) != 0)
+            return 1;
+    unsigned long long bytes = 0, reads = 0;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += counts[i][0];
+        reads += counts[i][1];
+    }
+    t1 = now();
+
+    printf("read:   %d files, %d threads, %.1f MB/s, %.0f requests/s\n",
+           nregular, nthreads, bytes / (t1 - t0) / 1e6, reads / (t1 - t0));
+
+    return 0;
+}
@@ -4,16 +4,14 @@
 #include <stdlib.h>
 
 #include "unixfs_internal.h"
+#include "unixfs_bcache.h"
 #include "linux.h"
 
 int
 sb_bread_intobh(struct super_block* sb, off_t block, struct buffer_head* bh)
 {
-    if (pread(sb->s_bdev, bh->b_data, sb->s_blocksize,
-              block * (off_t)sb->s_blocksize) != sb->s_blocksize)
-        return EIO;
-
-    return 0;
+    return unixfs_bcache_bread(sb->s_bdev, block, (char*)bh->b_data,
+                               sb->s_blocksize);
 }
 
 void
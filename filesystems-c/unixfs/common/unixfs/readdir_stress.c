@@ -0,0 +1,198 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ *
+ * Concurrent directory listing check, without FUSE. One directory of an
+ * image is listed once for reference, then STRESS_THREADS threads list it
+ * over and over through nextdirentry, each with its own dirbuf and offset,
+ * and look every name up again with namei. Every listing must match the
+ * reference entry for entry. Built with ThreadSanitizer, against one file
+ * system's objects, by "make stress" in its directory:
+ *
+ *     make stress IMAGE=image [TYPE=type] [DIR=path/in/image]
+ */
+
+#include "unixfs.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define STRESS_THREADS 32
+#define STRESS_ROUNDS  50
+#define STRESS_ROOTINO 1 /* FUSE's; each file system maps it to its root */
+
+static struct unixfs* fs;
+static ino_t dirino;
+static struct unixfs_direntry* want;
+static int nwant;
+static int failures;
+
+static int
+list(struct unixfs_direntry** entsp, int* nentsp)
+{
+    struct inode* dp = fs->ops->iget(dirino);
+    if (!dp)
+        return ENOENT;
+
+    struct unixfs_dirbuf* dirbuf = malloc(sizeof(struct unixfs_dirbuf));
+    struct unixfs_direntry* ents = NULL;
+    int n = 0, max = 0, ret = 0;
+    off_t offset = 0;
+
+    if (!dirbuf) {
+        ret = ENOMEM;
+        goto out;
+    }
+    dirbuf->flags.initialized = 0;
+
+    for (;;) {
+        if (n == max) {
+            max = max ? 2 * max : 256;
+            struct unixfs_direntry* p =
+                realloc(ents, max * sizeof(struct unixfs_direntry));
+            if (!p) {
+                ret = ENOMEM;
+                goto out;
+            }
+            ents = p;
+        }
+        memset(&ents[n], 0, sizeof(struct unixfs_direntry));
+        if ((ret = fs->ops->nextdirentry(dp, dirbuf, &offset, &ents[n])) != 0)
+            break;
+        if (ents[n].ino != 0) /* empty slot */
+            n++;
+    }
+    ret = (ret < 0) ? 0 : ret;
+
+out:
+    free(dirbuf);
+    fs->ops->iput(dp);
+
+    if (ret)
+        free(ents);
+    else {
+        *entsp = ents;
+        *nentsp = n;
+    }
+
+    return ret;
+}
+
+static void*
+stress(void* arg)
+{
+    int round, i;
+    struct stat stbuf;
+
+    for (round = 0; round < STRESS_ROUNDS; round++) {
+        struct unixfs_direntry* ents;
+        int n;
+
+        if (list(&ents, &n) != 0) {
+            __sync_fetch_and_add(&failures, 1);
+            continue;
+        }
+
+        if (n != nwant) {
+            fprintf(stderr, "thread %ld: %d entries, want %d\n",
+                    (long)arg, n, nwant);
+            __sync_fetch_and_add(&failures, 1);
+        }
+
+        for (i = 0; i < n && i < nwant; i++) {
+            if ((ents[i].ino != want[i].ino) ||
+                strcmp(ents[i].name, want[i].name)) {
+                fprintf(stderr, "thread %ld: entry %d is %s (%llu), "
+                        "want %s (%llu)\n", (long)arg, i, ents[i].name,
+                        (unsigned long long)ents[i].ino, want[i].name,
+                        (unsigned long long)want[i].ino);
+                __sync_fetch_and_add(&failures, 1);
+                break;
+            }
+            /* look names up against the other threads' listings */
+            if (((i + round + (long)arg) % 8) == 0 &&
+                strcmp(ents[i].name, ".") && strcmp(ents[i].name, "..") &&
+                ((fs->ops->namei(dirino, ents[i].name, &stbuf) != 0) ||
+                 (stbuf.st_ino != ents[i].ino))) {
+                fprintf(stderr, "thread %ld: namei %s failed\n",
+                        (long)arg, ents[i].name);
+                __sync_fetch_and_add(&failures, 1);
+            }
+        }
+
+        free(ents);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    char* type;
+    char* fsname;
+    char* volname;
+    struct stat stbuf;
+    pthread_t threads[STRESS_THREADS];
+    long i;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s TYPE IMAGE [DIR]\n", argv[0]);
+        return 1;
+    }
+
+    type = argv[1];
+    if (!unixfs_preflight(argv[2], &type, &fs)) {
+        fprintf(stderr, "invalid file system type %s\n", argv[1]);
+        return 1;
+    }
+
+    fsname = type; /* as main passes it */
+    if ((fs->filsys = fs->ops->init(argv[2], fs->flags, UNIXFS_FS_INVALID,
+                                    &fsname, &volname)) == NULL) {
+        fprintf(stderr, "failed to initialize file system\n");
+        return 1;
+    }
+
+    dirino = STRESS_ROOTINO;
+    if (argc > 3) {
+        char* path = strdup(argv[3]);
+        char* name;
+        while (path && (name = strsep(&path, "/")) != NULL) {
+            if (*name == '\0')
+                continue;
+            if (fs->ops->namei(dirino, name, &stbuf) != 0) {
+                fprintf(stderr, "%s: no such directory\n", argv[3]);
+                return 1;
+            }
+            dirino = stbuf.st_ino;
+        }
+    }
+
+    if (list(&want, &nwant) != 0) {
+        fprintf(stderr, "failed to list %s\n", (argc > 3) ? argv[3] : "/");
+        return 1;
+    }
+
+    for (i = 0; i < STRESS_THREADS; i++)
+        if (pthread_create(&threads[i], NULL, stress, (void*)i) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    for (i = 0; i < STRESS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    printf("%d entries, %d threads x %d listings, %d failures\n", nwant,
+           STRESS_THREADS, STRESS_ROUNDS, failures);
+
+    free(want);
+    fs->ops->fini(fs->filsys);
+
+    return failures ? 1 : 0;
+}
@@ -9,6 +9,11 @@
  */
 
 #include "unixfs.h"
+#include "unixfs_bcache.h"
+#include "unixfs_pcache.h"
+#include "unixfs_exec.h"
+#include "unixfs_flat.h"
+#include "unixfs_image.h"
 
 #include <errno.h>
 #include <stddef.h>
@@ -18,13 +23,146 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <dlfcn.h>
-
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#if FUSE_USE_VERSION >= 30
+#include <fuse3/fuse_opt.h>
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_opt.h>
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #define UNIXFS_META_TIMEOUT 60.0 /* timeout for nodes and their attributes */
 
+/*
+ * With --immutable the image is taken to never change while mounted, so the
+ * kernel may keep names, attributes, file pages and directory listings for
+ * as long as it likes. It does not change readahead: max_readahead in init
+ * can only lower what the kernel offers, and the kernel's window is the
+ * bdi's read_ahead_kb (/sys/class/bdi/0:NN/read_ahead_kb for the mount).
+ */
+#define UNIXFS_IMMUTABLE_TIMEOUT (365.0 * 86400.0)
+
 static struct unixfs* unixfs = (struct unixfs*)0;
+static int unixfs_immutable = 0;
+static int unixfs_queued = 0;
+static int unixfs_queue_nworkers = 0;
+static int unixfs_foreground = 0;
+static double unixfs_meta_timeout = UNIXFS_META_TIMEOUT;
+
+/*
+ * Lookup counts. Every inode the kernel has been handed through a lookup
+ * reply stays referenced (and so stays in the inode cache) until the kernel
+ * forgets it, instead of being dropped at the end of each request.
+ */
+
+#define UNIXFS_PIN_HASHSIZE 4096
+
+struct unixfs_pin {
+    struct unixfs_pin* next;
+    fuse_ino_t         ino;
+    struct inode*      ip;
+    uint64_t           nlookup;
+};
+
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct unixfs_pin* pin_table[UNIXFS_PIN_HASHSIZE];
+
+static struct unixfs_pin**
+unixfs_pin_find(fuse_ino_t ino)
+{
+    struct unixfs_pin** pp = &pin_table[ino & (UNIXFS_PIN_HASHSIZE - 1)];
+
+    while (*pp && (*pp)->ino != ino)
+        pp = &(*pp)->next;
+
+    return pp;
+}
+
+static int
+unixfs_pin(fuse_ino_t ino)
+{
+    struct unixfs_pin** pp;
+
+    pthread_mutex_lock(&pin_lock);
+    if (*(pp = unixfs_pin_find(ino))) {
+        (*pp)->nlookup++;
+        pthread_mutex_unlock(&pin_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&pin_lock);
+
+    struct inode* ip = unixfs->ops->iget(ino);
+    if (!ip)
+        return ENOENT;
+
+    struct unixfs_pin* pin = malloc(sizeof(struct unixfs_pin));
+    if (!pin) {
+        unixfs->ops->iput(ip);
+        return ENOMEM;
+    }
+
+    pthread_mutex_lock(&pin_lock);
+    if (*(pp = unixfs_pin_find(ino))) { /* pinned meanwhile */
+        (*pp)->nlookup++;
+        pthread_mutex_unlock(&pin_lock);
+        free(pin);
+        unixfs->ops->iput(ip);
+        return 0;
+    }
+    pin->next = NULL;
+    pin->ino = ino;
+    pin->ip = ip;
+    pin->nlookup = 1;
+    *pp = pin;
+    pthread_mutex_unlock(&pin_lock);
+
+    return 0;
+}
+
+static void
+unixfs_unpin(fuse_ino_t ino, uint64_t nlookup)
+{
+    struct unixfs_pin** pp;
+    struct unixfs_pin* pin = NULL;
+
+    pthread_mutex_lock(&pin_lock);
+    if (*(pp = unixfs_pin_find(ino))) {
+        if ((*pp)->nlookup > nlookup)
+            (*pp)->nlookup -= nlookup;
+        else {
+            pin = *pp;
+            *pp = pin->next;
+        }
+    }
+    pthread_mutex_unlock(&pin_lock);
+
+    if (pin) {
+        unixfs->ops->iput(pin->ip);
+        free(pin);
+    }
+}
+
+static void
+unixfs_unpin_all(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pin_lock);
+    for (i = 0; i < UNIXFS_PIN_HASHSIZE; i++) {
+        while (pin_table[i]) {
+            struct unixfs_pin* pin = pin_table[i];
+            pin_table[i] = pin->next;
+            unixfs->ops->iput(pin->ip);
+            free(pin);
+        }
+    }
+    pthread_mutex_unlock(&pin_lock);
+}
 
 static void
 unixfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
@@ -39,7 +177,18 @@ unixfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 static void
 unixfs_ll_destroy(void* data)
 {
+    if (unixfs_queued) {
+        unixfs_exec_stop();
+        if (unixfs_foreground) { /* stderr is /dev/null once daemonized */
+            fprintf(stderr, "request queueing delay:\n");
+            unixfs_exec_stats(stderr);
+        }
+    }
+    unixfs_image_async_fini();
+    unixfs_unpin_all();
     unixfs->ops->fini(unixfs->filsys);
+    unixfs_bcache_stats(stderr);
+    unixfs_bcache_fini();
 }
 
 static void
@@ -55,11 +204,41 @@ unixfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
     }
 
     e.ino = e.attr.st_ino;
-    e.attr_timeout = e.entry_timeout = UNIXFS_META_TIMEOUT;
+    e.attr_timeout = e.entry_timeout = unixfs_meta_timeout;
+
+    if ((error = unixfs_pin(e.ino)) != 0) {
+        fuse_reply_err(req, error);
+        return;
+    }
 
     fuse_reply_entry(req, &e);
 }
 
+static void
+#if FUSE_USE_VERSION >= 30
+unixfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
+unixfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
+{
+    unixfs_unpin(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+static void
+unixfs_ll_forget_multi(fuse_req_t req, size_t count,
+                       struct fuse_forget_data* forgets)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        unixfs_unpin((fuse_ino_t)forgets[i].ino, forgets[i].nlookup);
+
+    fuse_reply_none(req);
+}
+#endif
+
 static
 void unixfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
                        struct fuse_file_info* fi)
@@ -67,7 +246,7 @@ void unixfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
     struct stat stbuf;
     int error = unixfs->ops->igetattr(ino, &stbuf);
     if (!error)
-        fuse_reply_attr(req, &stbuf, UNIXFS_META_TIMEOUT);
+        fuse_reply_attr(req, &stbuf, unixfs_meta_timeout);
     else
         fuse_reply_err(req, error);
 }
@@ -85,6 +264,62 @@ unixfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
     fuse_reply_readlink(req, path);
 }
 
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+static void
+unixfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (unixfs_immutable) {
+        fi->keep_cache = 1;
+        fi->cache_readdir = 1;
+    }
+
+    fuse_reply_open(req, fi);
+}
+#endif
+
+/*
+ * A listing's attributes are fetched in inode-number order, not directory
+ * order. Every backend lays its inode table out by inode number, so this
+ * groups the entries by inode block and walks the blocks in ascending order;
+ * the inode block cache then serves a block's remaining entries, and each
+ * block is read at most once per listing.
+ */
+
+struct unixfs_rdent {
+    ino_t       ino;
+    size_t      name;  /* offset into the name pool */
+    int         error; /* from igetattr */
+    struct stat st;
+};
+
+struct unixfs_rdorder {
+    ino_t  ino;
+    size_t index;
+};
+
+static int
+unixfs_rdorder_cmp(const void* a, const void* b)
+{
+    const struct unixfs_rdorder* x = (const struct unixfs_rdorder*)a;
+    const struct unixfs_rdorder* y = (const struct unixfs_rdorder*)b;
+
+    if (x->ino != y->ino)
+        return (x->ino < y->ino) ? -1 : 1;
+
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static void*
+unixfs_ll_realloc(void* p, size_t size)
+{
+    void* newp = realloc(p, size);
+    if (!newp && size) {
+        fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+        abort();
+    }
+    return newp;
+}
+
 static void
 unixfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                   struct fuse_file_info* fi)
@@ -116,30 +351,79 @@ unixfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
     memset(&b, 0, sizeof(b));
 
+    struct unixfs_rdent* ents = NULL;
+    size_t nents = 0, maxents = 0;
+    char* names = NULL;
+    size_t namesize = 0, maxnames = 0;
+    size_t i;
+
     struct unixfs_dirbuf dirbuf;
+    dirbuf.flags.initialized = 0;
 
     while (unixfs->ops->nextdirentry(dp, &dirbuf, &offset, &dent) == 0) {
 
         if (dent.ino == 0)
             continue;
 
-        if (unixfs->ops->igetattr(dent.ino, &stbuf) != 0)
-            continue;
+        size_t len = strlen(dent.name) + 1;
 
-        size_t oldsize = b.size;
-        b.size += fuse_add_direntry(req, NULL, 0, dent.name, NULL, 0);
-        char* newp = (char *)realloc(b.p, b.size);
-        if (!newp) {
-            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
-            abort();
+        if (nents == maxents) {
+            maxents = maxents ? 2 * maxents : 64;
+            ents = unixfs_ll_realloc(ents,
+                                     maxents * sizeof(struct unixfs_rdent));
         }
-        b.p = newp;
-        fuse_add_direntry(req, b.p + oldsize, b.size - oldsize, dent.name,
-                          &stbuf, b.size);
+        if (namesize + len > maxnames) {
+            maxnames = max(2 * maxnames, namesize + len + 1024);
+            names = unixfs_ll_realloc(names, maxnames);
+        }
+
+        ents[nents].ino = dent.ino;
+        ents[nents].name = namesize;
+        memcpy(names + namesize, dent.name, len);
+        namesize += len;
+        nents++;
     }
 
     unixfs->ops->iput(dp);
 
+    struct unixfs_rdorder* order =
+        unixfs_ll_realloc(NULL, nents * sizeof(struct unixfs_rdorder));
+
+    for (i = 0; i < nents; i++) {
+        order[i].ino = ents[i].ino;
+        order[i].index = i;
+    }
+
+    qsort(order, nents, sizeof(struct unixfs_rdorder), unixfs_rdorder_cmp);
+
+    for (i = 0; i < nents; i++) {
+        struct unixfs_rdent* e = &ents[order[i].index];
+        if (i && (order[i - 1].ino == e->ino)) { /* "." or a hard link */
+            struct unixfs_rdent* prev = &ents[order[i - 1].index];
+            e->error = prev->error;
+            e->st = prev->st;
+        } else
+            e->error = unixfs->ops->igetattr(e->ino, &e->st);
+    }
+
+    free(order);
+
+    for (i = 0; i < nents; i++) {
+
+        if (ents[i].error != 0)
+            continue;
+
+        const char* name = names + ents[i].name;
+        size_t oldsize = b.size;
+        b.size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        b.p = unixfs_ll_realloc(b.p, b.size);
+        fuse_add_direntry(req, b.p + oldsize, b.size - oldsize, name,
+                          &ents[i].st, b.size);
+    }
+
+    free(ents);
+    free(names);
+
     if (off < b.size)
         fuse_reply_buf(req, b.p + off, min(b.size - off, size));
     else
@@ -168,6 +452,8 @@ unixfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
         unixfs->ops->iput(ip);
     } else {
         fi->fh = (uint64_t)(long)ip;
+        if (unixfs_immutable)
+            fi->keep_cache = 1;
         fuse_reply_open(req, fi);
     }
 }
@@ -183,6 +469,22 @@ unixfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
     fuse_reply_err(req, 0);
 }
 
+struct unixfs_aread {
+    fuse_req_t r_req;
+    char*      r_buf;
+};
+
+static void
+unixfs_ll_read_done(void* arg, ssize_t nread, int error)
+{
+    struct unixfs_aread* r = (struct unixfs_aread*)arg;
+
+    fuse_reply_buf(r->r_req, r->r_buf, (nread > 0) ? nread : 0);
+
+    free(r->r_buf);
+    free(r);
+}
+
 static void
 unixfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t count, off_t offset,
                struct fuse_file_info* fi)
@@ -205,11 +507,26 @@ unixfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t count, off_t offset,
     if ((offset + count) > size)
         count = size - offset;
 
-    char *buf = calloc(count, 1);
-    if (!buf) {
+    /* aligned, so that reads from an uncached image can land in it directly */
+    char *buf = NULL;
+    if (posix_memalign((void**)&buf, UNIXFS_IMAGE_ALIGN, count) != 0) {
         fuse_reply_err(req, ENOMEM);
         return;
     }
+    memset(buf, 0, count);
+
+    /* let the image reads complete (and the reply go out) elsewhere */
+    if (unixfs->ops->pbread_async) {
+        struct unixfs_aread* r = malloc(sizeof(struct unixfs_aread));
+        if (r) {
+            r->r_req = req;
+            r->r_buf = buf;
+            if (unixfs->ops->pbread_async(ip, buf, count, offset,
+                                          unixfs_ll_read_done, r) == 0)
+                return;
+            free(r);
+        }
+    }
 
     int error = 0;
     char* bp = buf;
@@ -235,17 +552,464 @@ static struct fuse_lowlevel_ops unixfs_ll_oper = {
     .statfs     = unixfs_ll_statfs,
     .destroy    = unixfs_ll_destroy,
     .lookup     = unixfs_ll_lookup,
+    .forget     = unixfs_ll_forget,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+    .forget_multi = unixfs_ll_forget_multi,
+#endif
     .getattr    = unixfs_ll_getattr,
     .readlink   = unixfs_ll_readlink,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+    .opendir    = unixfs_ll_opendir,
+#endif
     .readdir    = unixfs_ll_readdir,
     .open       = unixfs_ll_open,
     .release    = unixfs_ll_release,
     .read       = unixfs_ll_read,
 };
 
+/*
+ * Queued requests. With --workers, the FUSE loop only hands requests to the
+ * executor in unixfs_exec.c. Cheap metadata requests are queued ahead of
+ * directory listings and file reads, so they are not stuck behind a burst
+ * of slow image I/O. The operations are swapped before the session is
+ * created, but the workers are only started once the daemon has forked;
+ * until then (or if they cannot be started) requests run in the loop.
+ */
+
+enum {
+    UNIXFS_OP_LOOKUP,
+    UNIXFS_OP_GETATTR,
+    UNIXFS_OP_READLINK,
+    UNIXFS_OP_STATFS,
+    UNIXFS_OP_OPEN,
+    UNIXFS_OP_READDIR, /* bulk from here on */
+    UNIXFS_OP_READ,
+    UNIXFS_OP_MAX
+};
+
+static const char* const unixfs_opnames[UNIXFS_OP_MAX] = {
+    "lookup", "getattr", "readlink", "statfs", "open", "readdir", "read",
+};
+
+struct unixfs_call {
+    int                   c_op;
+    fuse_req_t            c_req;
+    fuse_ino_t            c_ino;
+    size_t                c_size;
+    off_t                 c_off;
+    int                   c_hasfi;
+    struct fuse_file_info c_fi;
+    char                  c_name[];
+};
+
+static void
+unixfs_call_run(void* arg)
+{
+    struct unixfs_call* c = (struct unixfs_call*)arg;
+    struct fuse_file_info* fi = c->c_hasfi ? &c->c_fi : NULL;
+
+    switch (c->c_op) {
+    case UNIXFS_OP_LOOKUP:
+        unixfs_ll_lookup(c->c_req, c->c_ino, c->c_name);
+        break;
+    case UNIXFS_OP_GETATTR:
+        unixfs_ll_getattr(c->c_req, c->c_ino, fi);
+        break;
+    case UNIXFS_OP_READLINK:
+        unixfs_ll_readlink(c->c_req, c->c_ino);
+        break;
+    case UNIXFS_OP_STATFS:
+        unixfs_ll_statfs(c->c_req, c->c_ino);
+        break;
+    case UNIXFS_OP_OPEN:
+        unixfs_ll_open(c->c_req, c->c_ino, fi);
+        break;
+    case UNIXFS_OP_READDIR:
+        unixfs_ll_readdir(c->c_req, c->c_ino, c->c_size, c->c_off, fi);
+        break;
+    case UNIXFS_OP_READ:
+        unixfs_ll_read(c->c_req, c->c_ino, c->c_size, c->c_off, fi);
+        break;
+    }
+
+    free(c);
+}
+
+static void
+unixfs_call_queue(int op, fuse_req_t req, fuse_ino_t ino, const char* name,
+                  size_t size, off_t off, struct fuse_file_info* fi)
+{
+    size_t namesize = name ? strlen(name) + 1 : 0;
+
+    struct unixfs_call* c = malloc(sizeof(struct unixfs_call) + namesize);
+    if (!c) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    c->c_op = op;
+    c->c_req = req;
+    c->c_ino = ino;
+    c->c_size = size;
+    c->c_off = off;
+    if ((c->c_hasfi = (fi != NULL)))
+        memcpy(&c->c_fi, fi, sizeof(struct fuse_file_info));
+    if (name)
+        memcpy(c->c_name, name, namesize);
+
+    unixfs_exec_class_t class = (op >= UNIXFS_OP_READDIR) ?
+                                UNIXFS_EXEC_BULK : UNIXFS_EXEC_META;
+
+    if (unixfs_exec_submit(class, op, unixfs_call_run, c) != 0)
+        unixfs_call_run(c); /* executor unavailable; do it here */
+}
+
+static void
+unixfs_q_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    unixfs_call_queue(UNIXFS_OP_LOOKUP, req, parent, name, 0, 0, NULL);
+}
+
+static void
+unixfs_q_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    unixfs_call_queue(UNIXFS_OP_GETATTR, req, ino, NULL, 0, 0, fi);
+}
+
+static void
+unixfs_q_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    unixfs_call_queue(UNIXFS_OP_READLINK, req, ino, NULL, 0, 0, NULL);
+}
+
+static void
+unixfs_q_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    unixfs_call_queue(UNIXFS_OP_STATFS, req, ino, NULL, 0, 0, NULL);
+}
+
+static void
+unixfs_q_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    unixfs_call_queue(UNIXFS_OP_OPEN, req, ino, NULL, 0, 0, fi);
+}
+
+static void
+unixfs_q_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                 struct fuse_file_info* fi)
+{
+    unixfs_call_queue(UNIXFS_OP_READDIR, req, ino, NULL, size, off, fi);
+}
+
+static void
+unixfs_q_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+              struct fuse_file_info* fi)
+{
+    unixfs_call_queue(UNIXFS_OP_READ, req, ino, NULL, size, off, fi);
+}
+
+static void
+unixfs_queue_requests(int nworkers)
+{
+    unixfs_queued = 1;
+    unixfs_queue_nworkers = nworkers;
+
+    unixfs_ll_oper.lookup   = unixfs_q_lookup;
+    unixfs_ll_oper.getattr  = unixfs_q_getattr;
+    unixfs_ll_oper.readlink = unixfs_q_readlink;
+    unixfs_ll_oper.statfs   = unixfs_q_statfs;
+    unixfs_ll_oper.open     = unixfs_q_open;
+    unixfs_ll_oper.readdir  = unixfs_q_readdir;
+    unixfs_ll_oper.read     = unixfs_q_read;
+}
+
+static void
+unixfs_queue_start(void)
+{
+    if (unixfs_queued)
+        (void)unixfs_exec_start(unixfs_queue_nworkers, unixfs_opnames,
+                                UNIXFS_OP_MAX);
+}
+
+/*
+ * Pre-warming. With --prewarm, a background thread walks the mounted tree
+ * once, through the mount point, so that the kernel has the names and
+ * attributes (and, with --immutable, the directory listings). It then pushes
+ * the contents of regular files into the kernel's page cache with
+ * fuse_lowlevel_notify_store(). Only paths under one of the given
+ * colon-separated prefixes are warmed. At most --prewarm-budget bytes of
+ * file data are stored, and no faster than UNIXFS_PREWARM_RATE.
+ */
+
+#define UNIXFS_PREWARM_BUDGET (64 * 1024 * 1024)
+#define UNIXFS_PREWARM_RATE   (32 * 1024 * 1024) /* bytes per second */
+#define UNIXFS_PREWARM_CHUNK  (128 * 1024)
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+
+struct unixfs_prewarm {
+    struct fuse_session* se;
+    char*                mountpoint;
+    char*                prefixes;
+    uint64_t             budget;
+    uint64_t             stored;
+    struct timespec      start;
+    char*                buf;
+    pthread_t            thread;
+    pthread_mutex_t      lock;     /* held across stores, and to stop */
+    int                  stopping; /* relaxed atomic */
+};
+
+static struct unixfs_prewarm* unixfs_prewarmer = NULL;
+
+static int
+unixfs_prewarm_wanted(struct unixfs_prewarm* pw, const char* path, int isdir)
+{
+    const char* p = pw->prefixes;
+    size_t pathlen = strlen(path);
+
+    while (*p) {
+        while (*p == '/')
+            p++;
+        size_t plen = strcspn(p, ":");
+        while (plen && p[plen - 1] == '/')
+            plen--;
+        if (plen == 0)
+            return 1;
+        /* at or below the prefix */
+        if ((pathlen >= plen) && !strncmp(path, p, plen) &&
+            ((path[plen] == '\0') || (path[plen] == '/')))
+            return 1;
+        /* a directory on the way to the prefix */
+        if (isdir && (plen > pathlen) && !strncmp(path, p, pathlen) &&
+            ((pathlen == 0) || (p[pathlen] == '/')))
+            return 1;
+        p += strcspn(p, ":");
+        if (*p == ':')
+            p++;
+    }
+
+    return 0;
+}
+
+static void
+unixfs_prewarm_throttle(struct unixfs_prewarm* pw)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (now.tv_sec - pw->start.tv_sec) +
+                     (now.tv_nsec - pw->start.tv_nsec) / 1e9;
+    double due = (double)pw->stored / UNIXFS_PREWARM_RATE;
+
+    if (due > elapsed) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(due - elapsed);
+        ts.tv_nsec = (long)((due - elapsed - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void
+unixfs_prewarm_file(struct unixfs_prewarm* pw, fuse_ino_t ino, off_t size)
+{
+    struct inode* ip = unixfs->ops->iget(ino);
+    if (!ip)
+        return;
+
+    off_t offset = 0;
+
+    while ((offset < size) && (pw->stored < pw->budget) &&
+           !__atomic_load_n(&pw->stopping, __ATOMIC_RELAXED) &&
+           !fuse_session_exited(pw->se)) {
+        size_t count = min(UNIXFS_PREWARM_CHUNK, size - offset);
+        if (count > pw->budget - pw->stored)
+            count = pw->budget - pw->stored;
+
+        size_t nbytes = 0;
+        int error = 0;
+        do {
+            ssize_t ret = unixfs->ops->pbread(ip, pw->buf + nbytes,
+                                              count - nbytes, offset + nbytes,
+                                              &error);
+            if (ret <= 0)
+                break;
+            nbytes += ret;
+        } while (!error && (nbytes < count));
+
+        if (nbytes == 0)
+            break;
+
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(nbytes);
+        bufv.buf[0].mem = pw->buf;
+        int ret = -1;
+        pthread_mutex_lock(&pw->lock);
+        if (!pw->stopping)
+#if FUSE_USE_VERSION >= 30
+            ret = fuse_lowlevel_notify_store(pw->se, ino, offset, &bufv, 0);
+#else
+            ret = fuse_lowlevel_notify_store(fuse_session_next_chan(pw->se,
+                                             NULL), ino, offset, &bufv, 0);
+#endif
+        pthread_mutex_unlock(&pw->lock);
+        if (ret != 0)
+            break; /* e.g. the kernel has already let go of the inode */
+
+        offset += nbytes;
+        pw->stored += nbytes;
+        unixfs_prewarm_throttle(pw);
+    }
+
+    unixfs->ops->iput(ip);
+}
+
+static void
+unixfs_prewarm_dir(struct unixfs_prewarm* pw, const char* path)
+{
+    char fullpath[UNIXFS_MAXPATHLEN];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", pw->mountpoint, path);
+
+    DIR* dir = opendir(fullpath);
+    if (!dir)
+        return;
+
+    struct dirent* de;
+
+    while (((de = readdir(dir)) != NULL) && (pw->stored < pw->budget) &&
+           !__atomic_load_n(&pw->stopping, __ATOMIC_RELAXED) &&
+           !fuse_session_exited(pw->se)) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char subpath[UNIXFS_MAXPATHLEN];
+        if (snprintf(subpath, sizeof(subpath), "%s%s%s", path,
+                     (*path) ? "/" : "", de->d_name) >= sizeof(subpath))
+            continue;
+
+        struct stat stbuf;
+        if ((snprintf(fullpath, sizeof(fullpath), "%s/%s", pw->mountpoint,
+                      subpath) >= sizeof(fullpath)) ||
+            (lstat(fullpath, &stbuf) != 0))
+            continue;
+
+        if (!unixfs_prewarm_wanted(pw, subpath, S_ISDIR(stbuf.st_mode)))
+            continue;
+
+        if (S_ISDIR(stbuf.st_mode))
+            unixfs_prewarm_dir(pw, subpath);
+        else if (S_ISREG(stbuf.st_mode))
+            unixfs_prewarm_file(pw, (fuse_ino_t)stbuf.st_ino, stbuf.st_size);
+    }
+
+    closedir(dir);
+}
+
+static void*
+unixfs_prewarm_worker(void* arg)
+{
+    struct unixfs_prewarm* pw = (struct unixfs_prewarm*)arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &pw->start);
+    unixfs_prewarm_dir(pw, "");
+
+    return NULL;
+}
+
+static void
+unixfs_prewarm_start(struct fuse_session* se, char* mountpoint,
+                     char* prefixes, uint64_t budget)
+{
+    struct unixfs_prewarm* pw = calloc(1, sizeof(struct unixfs_prewarm));
+    if (!pw || !(pw->buf = malloc(UNIXFS_PREWARM_CHUNK)) ||
+        !(pw->mountpoint = strdup(mountpoint)))
+        goto fail;
+
+    pw->se = se;
+    pw->prefixes = prefixes;
+    pw->budget = budget;
+    (void)pthread_mutex_init(&pw->lock, (const pthread_mutexattr_t*)0);
+
+    if (pthread_create(&pw->thread, (const pthread_attr_t*)0,
+                       unixfs_prewarm_worker, pw) == 0) {
+        unixfs_prewarmer = pw;
+        return;
+    }
+
+    (void)pthread_mutex_destroy(&pw->lock);
+
+fail:
+    fprintf(stderr, "*** warning: not pre-warming the cache\n");
+    if (pw) {
+        free(pw->buf);
+        free(pw->mountpoint);
+    }
+    free(pw);
+}
+
+/*
+ * Stopping, at unmount. Once unixfs_prewarm_stop returns, no more stores
+ * are sent. The thread may still be blocked in a call on the mount point,
+ * which only returns once the file system is unmounted, so the session is
+ * unmounted before unixfs_prewarm_wait joins the thread, and destroyed only
+ * after that.
+ */
+
+static void
+unixfs_prewarm_stop(void)
+{
+    struct unixfs_prewarm* pw = unixfs_prewarmer;
+
+    if (pw) {
+        pthread_mutex_lock(&pw->lock);
+        __atomic_store_n(&pw->stopping, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pw->lock);
+    }
+}
+
+static void
+unixfs_prewarm_wait(void)
+{
+    struct unixfs_prewarm* pw = unixfs_prewarmer;
+
+    if (!pw)
+        return;
+
+    (void)pthread_join(pw->thread, NULL);
+    unixfs_prewarmer = NULL;
+
+    (void)pthread_mutex_destroy(&pw->lock);
+    free(pw->buf);
+    free(pw->mountpoint);
+    free(pw);
+}
+
+#else
+
+static void
+unixfs_prewarm_stop(void)
+{
+}
+
+static void
+unixfs_prewarm_wait(void)
+{
+}
+
+#endif /* FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9) */
+
 struct options {
     char* dmg;
     int   force;
+    int   immutable;
+    int   prefetch_meta;
+    int   nocache_image;
+    char* prewarm;
+    char* prewarm_budget;
+    char* workers;
+    char* inline_max;
+    char* block_cache;
+    char* disk_cache;
+    char* flatten;
     char* fsendian;
     char* type;
 } options;
@@ -256,12 +1020,35 @@ static struct fuse_opt unixfs_opts[] = {
 
     UNIXFS_OPT_KEY("--dmg %s", dmg, 0),
     UNIXFS_OPT_KEY("--force", force, 1),
+    UNIXFS_OPT_KEY("--immutable", immutable, 1),
+    UNIXFS_OPT_KEY("--prefetch-meta", prefetch_meta, 1),
+    UNIXFS_OPT_KEY("--nocache-image", nocache_image, 1),
+    UNIXFS_OPT_KEY("--prewarm %s", prewarm, 0),
+    UNIXFS_OPT_KEY("--prewarm-budget %s", prewarm_budget, 0),
+    UNIXFS_OPT_KEY("--workers %s", workers, 0),
+    UNIXFS_OPT_KEY("--inline-max %s", inline_max, 0),
+    UNIXFS_OPT_KEY("--block-cache %s", block_cache, 0),
+    UNIXFS_OPT_KEY("--disk-cache %s", disk_cache, 0),
+    UNIXFS_OPT_KEY("--flatten %s", flatten, 0),
     UNIXFS_OPT_KEY("--fsendian %s", fsendian, 0),
     UNIXFS_OPT_KEY("--type %s", type, 0),
 
     FUSE_OPT_END
 };
 
+static void
+unixfs_prewarm(struct fuse_session* se, char* mountpoint)
+{
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+    uint64_t budget = UNIXFS_PREWARM_BUDGET;
+    if (options.prewarm_budget)
+        budget = strtoull(options.prewarm_budget, NULL, 0);
+    unixfs_prewarm_start(se, mountpoint, options.prewarm, budget);
+#else
+    fprintf(stderr, "*** warning: --prewarm needs FUSE 2.9\n");
+#endif
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -275,6 +1062,18 @@ main(int argc, char* argv[])
         return -1;
     }
 
+#if FUSE_USE_VERSION >= 30
+    struct fuse_cmdline_opts opts;
+
+    if ((fuse_parse_cmdline(&args, &opts) != 0) ||
+        (!opts.mountpoint && !options.flatten)) {
+       unixfs_usage();
+       return -1;
+    }
+
+    char* mountpoint = opts.mountpoint;
+    unixfs_foreground = opts.foreground;
+#else
     char* mountpoint;
     int   multithreaded;
     int   foregrounded;
@@ -285,6 +1084,9 @@ main(int argc, char* argv[])
        return -1;
     }
 
+    unixfs_foreground = foregrounded;
+#endif
+
     if (!(unixfs = unixfs_preflight(options.dmg, &(options.type), &unixfs))) {
         if (options.type)
             fprintf(stderr, "invalid file system type %s\n", options.type);
@@ -296,6 +1098,44 @@ main(int argc, char* argv[])
     if (options.force)
         unixfs->flags |= UNIXFS_FORCE;
 
+    if (options.nocache_image) {
+        unixfs_image_direct(1);
+        if (options.prefetch_meta) {
+            fprintf(stderr, "*** warning: --prefetch-meta has no effect with "
+                    "--nocache-image\n");
+            options.prefetch_meta = 0;
+        }
+    }
+
+    if (options.prefetch_meta)
+        unixfs->flags |= UNIXFS_PREFETCH;
+
+    if (options.inline_max)
+        unixfs_inline_limit(strtoull(options.inline_max, NULL, 0));
+
+    if (options.block_cache) { /* HOT[,COLD] */
+        char* cold = NULL;
+        size_t hot = strtoull(options.block_cache, &cold, 0);
+        unixfs_bcache_limit(hot, (cold && (*cold == ',')) ?
+                                 strtoull(cold + 1, NULL, 0) :
+                                 UNIXFS_BCACHE_COLD);
+    }
+
+    if (options.disk_cache) { /* DIR[,BYTES] */
+        char* limit = strrchr(options.disk_cache, ',');
+        off_t bytes = 0;
+        if (limit) {
+            *limit++ = '\0';
+            bytes = strtoll(limit, NULL, 0);
+        }
+        unixfs_pcache_config(options.disk_cache, bytes);
+    }
+
+    if (options.immutable) {
+        unixfs_immutable = 1;
+        unixfs_meta_timeout = UNIXFS_IMMUTABLE_TIMEOUT;
+    }
+
     unixfs->fsname = options.type; /* XXX quick fix */
 
     unixfs->fsendian = UNIXFS_FS_INVALID;
@@ -320,12 +1160,69 @@ main(int argc, char* argv[])
         return -1;
     }
 
+    if (options.flatten) { /* convert instead of mounting */
+        int ferr = unixfs_flatten(unixfs, options.flatten);
+        if (ferr)
+            fprintf(stderr, "failed to flatten into %s: %s\n",
+                    options.flatten, strerror(ferr));
+        unixfs->ops->fini(unixfs->filsys);
+        return ferr ? 1 : 0;
+    }
+
     char extra_args[UNIXFS_ARGLEN] = { 0 };
     unixfs_postflight(unixfs->fsname, unixfs->volname, extra_args);
 
     fuse_opt_add_arg(&args, extra_args);
 
     int err = -1;
+
+    if (options.workers)
+        unixfs_queue_requests(atoi(options.workers));
+
+#if FUSE_USE_VERSION >= 30
+    /*
+     * libfuse 3: every worker of the multithreaded loop gets its own cloned
+     * /dev/fuse descriptor unless told otherwise. On kernels and libraries
+     * that support FUSE over io_uring, -o io_uring is passed through to the
+     * library, which then serves the per-CPU ring queues from the same loop.
+     */
+    struct fuse_session* se;
+
+    se = fuse_session_new(&args, &unixfs_ll_oper, sizeof(unixfs_ll_oper),
+                          (void*)&unixfs);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            if (fuse_session_mount(se, mountpoint) == 0) {
+                if ((err = fuse_daemonize(opts.foreground)) == -1)
+                    goto unmount;
+                unixfs_background_start();
+                unixfs_statvfs_start();
+                unixfs_queue_start();
+                if (options.prewarm)
+                    unixfs_prewarm(se, mountpoint);
+                if (opts.singlethread)
+                    err = fuse_session_loop(se);
+                else {
+                    struct fuse_loop_config* config = fuse_loop_cfg_create();
+                    fuse_loop_cfg_set_clone_fd(config, 1);
+                    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+                    fuse_loop_cfg_set_idle_threads(config,
+                                                   opts.max_idle_threads);
+                    err = fuse_session_loop_mt(se, config);
+                    fuse_loop_cfg_destroy(config);
+                }
+                unixfs_prewarm_stop();
+unmount:
+                fuse_session_unmount(se);
+                unixfs_prewarm_wait();
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+#else
     struct fuse_chan *ch;
 
     if ((ch = fuse_mount(mountpoint, &args)) != NULL) {
@@ -337,12 +1234,23 @@ main(int argc, char* argv[])
         if (se != NULL) {
             if ((err = fuse_daemonize(foregrounded)) == -1)
                 goto bailout;
+            unixfs_background_start();
+            unixfs_statvfs_start();
+            unixfs_queue_start();
             if (fuse_set_signal_handlers(se) != -1) {
                 fuse_session_add_chan(se, ch);
+                if (options.prewarm)
+                    unixfs_prewarm(se, mountpoint);
                 if (multithreaded)
                     err = fuse_session_loop_mt(se);
                 else
                     err = fuse_session_loop(se);
+                if (options.prewarm) {
+                    /* unmount, but keep the channel until the thread is gone */
+                    unixfs_prewarm_stop();
+                    fuse_unmount(mountpoint, NULL);
+                    unixfs_prewarm_wait();
+                }
                 fuse_remove_signal_handlers(se);
                 fuse_session_remove_chan(ch);
             }
@@ -351,6 +1259,7 @@ bailout:
         }
         fuse_unmount(mountpoint, ch);
     }
+#endif
 
     fuse_opt_free_args(&args);
 
@@ -44,6 +44,7 @@ struct unixfs {
 /* flags */
 
 #define UNIXFS_FORCE           0x00000001 /* mount even if things look fishy */
+#define UNIXFS_PREFETCH        0x00000002 /* warm metadata after mounting */
 
 /* Our encapsulation of an Ancient Unix directory entry. */
 
@@ -54,18 +55,36 @@ struct unixfs_direntry {
 
 #define UNIXFS_DIRBUFSIZ 8192
 
+/*
+ * A directory cursor is the caller's offset plus this buffer, which belongs
+ * to the caller too. data holds the directory block (or page) that starts at
+ * directory offset base; a nextdirentry implementation keeps no other state,
+ * so any number of listings of the same directory can run at once. Clear
+ * flags.initialized before the first call.
+ */
 struct unixfs_dirbuf {
     struct flags {
        uint32_t initialized;
     } flags;
+    off_t base;
     char data[UNIXFS_DIRBUFSIZ];
 };
 
+#define UNIXFS_DIRBUF_HAS(dirbuf, off) \
+    ((dirbuf)->flags.initialized && ((dirbuf)->base == (off)))
+
 /* Interface to Ancient Unix file system internals. */
 
 struct inode;
 struct stat;
 
+/*
+ * pbread_async is optional. If it returns 0, it has taken the read and will
+ * call done exactly once, possibly from another thread, with what pbread
+ * would have returned. Otherwise the caller falls back to pbread.
+ */
+typedef void (*unixfs_pbread_done_t)(void* arg, ssize_t nread, int error);
+
 struct unixfs_ops {
     void*         (*init)(const char* dmg, uint32_t flags, fs_endian_t fse,
                           char** fsname, char** volname);
@@ -85,6 +104,9 @@ struct unixfs_ops {
                                   struct unixfs_direntry* dent);
     ssize_t       (*pbread)(struct inode*ip, char* buf, size_t nbyte,
                             off_t offset, int* error);
+    int           (*pbread_async)(struct inode* ip, char* buf, size_t nbyte,
+                                  off_t offset, unixfs_pbread_done_t done,
+                                  void* arg);
     int           (*readlink)(ino_t, char path[UNIXFS_MAXPATHLEN]);
     int           (*sanitycheck)(void* filsys, off_t disksize);
     int           (*statvfs)(struct statvfs* svb);
@@ -96,5 +118,8 @@ struct unixfs_ops {
 extern void           unixfs_usage(void);
 extern struct unixfs* unixfs_preflight(char*, char**, struct unixfs**);
 extern void           unixfs_postflight(char*, char*, char*);
+extern void           unixfs_background_start(void);
+extern void           unixfs_statvfs_start(void);
+extern void           unixfs_inline_limit(size_t max);
 
 #endif /* _UNIXFS_H_ */
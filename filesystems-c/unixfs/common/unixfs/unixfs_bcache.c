@@ -0,0 +1,331 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs_bcache.h"
+#include "unixfs_image.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if __linux__
+#include <darwin/queue.h>
+#else
+#include <sys/queue.h>
+#endif
+
+#if UNIXFS_BCACHE_LZ4
+#include <lz4.h>
+#endif
+
+struct bcache_entry {
+    LIST_ENTRY(bcache_entry)  b_hash;
+    TAILQ_ENTRY(bcache_entry) b_lru;
+    int                       b_fd;
+    int                       b_cold;
+    off_t                     b_blkno;
+    size_t                    b_size;  /* of the block */
+    size_t                    b_csize; /* held; 0: zero block, b_size: raw */
+    char*                     b_data;
+};
+
+LIST_HEAD(bcache_bucket, bcache_entry);
+TAILQ_HEAD(bcache_lru, bcache_entry);
+
+#define BCACHE_OVERHEAD sizeof(struct bcache_entry)
+
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bcache_bucket bcache_hash[UNIXFS_BCACHE_HASH];
+static struct bcache_lru bcache_hot = TAILQ_HEAD_INITIALIZER(bcache_hot);
+static struct bcache_lru bcache_cold = TAILQ_HEAD_INITIALIZER(bcache_cold);
+
+static size_t bcache_hotmax = UNIXFS_BCACHE_HOT;
+static size_t bcache_coldmax = UNIXFS_BCACHE_COLD;
+static size_t bcache_hotbytes = 0;
+static size_t bcache_coldbytes = 0;
+static size_t bcache_coldraw = 0;   /* what the cold blocks would take */
+static size_t bcache_coldblocks = 0;
+static size_t bcache_coldzero = 0;
+
+static struct {
+    uint64_t hothits;
+    uint64_t coldhits;
+    uint64_t misses;
+    uint64_t demoted;
+    uint64_t dropped; /* from the cold tier, or not compressible at all */
+} bcache_stats;
+
+static struct bcache_bucket*
+bcache_bucket(int fd, off_t blkno)
+{
+    uint64_t h = ((uint64_t)blkno * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)fd;
+    return &bcache_hash[(h >> 32) & (UNIXFS_BCACHE_HASH - 1)];
+}
+
+static struct bcache_entry*
+bcache_find(int fd, off_t blkno, size_t size)
+{
+    struct bcache_entry* e;
+
+    LIST_FOREACH(e, bcache_bucket(fd, blkno), b_hash)
+        if ((e->b_blkno == blkno) && (e->b_fd == fd) && (e->b_size == size))
+            return e;
+
+    return NULL;
+}
+
+static void
+bcache_unlink(struct bcache_entry* e)
+{
+    if (e->b_cold) {
+        TAILQ_REMOVE(&bcache_cold, e, b_lru);
+        bcache_coldbytes -= e->b_csize + BCACHE_OVERHEAD;
+        bcache_coldraw -= e->b_size;
+        bcache_coldblocks--;
+        if (!e->b_csize)
+            bcache_coldzero--;
+    } else {
+        TAILQ_REMOVE(&bcache_hot, e, b_lru);
+        bcache_hotbytes -= e->b_size + BCACHE_OVERHEAD;
+    }
+}
+
+static void
+bcache_free(struct bcache_entry* e)
+{
+    bcache_unlink(e);
+    LIST_REMOVE(e, b_hash);
+    free(e->b_data);
+    free(e);
+}
+
+static int
+bcache_iszero(const char* p, size_t size)
+{
+    return (size == 0) || ((p[0] == 0) && !memcmp(p, p + 1, size - 1));
+}
+
+static void
+bcache_trimcold(void)
+{
+    struct bcache_entry* e;
+
+    while ((bcache_coldbytes > bcache_coldmax) &&
+           ((e = TAILQ_LAST(&bcache_cold, bcache_lru)) != NULL)) {
+        bcache_free(e);
+        bcache_stats.dropped++;
+    }
+}
+
+/* hot to cold */
+static void
+bcache_demote(struct bcache_entry* e)
+{
+    bcache_unlink(e);
+
+    if (bcache_iszero(e->b_data, e->b_size)) {
+        free(e->b_data);
+        e->b_data = NULL;
+        e->b_csize = 0;
+        bcache_coldzero++;
+    } else {
+#if UNIXFS_BCACHE_LZ4
+        int bound = LZ4_compressBound((int)e->b_size);
+        char* c = malloc(bound);
+        int n = c ? LZ4_compress_default(e->b_data, c, (int)e->b_size,
+                                         bound) : 0;
+        if ((n > 0) && ((size_t)n < e->b_size)) {
+            char* shrunk = realloc(c, n);
+            free(e->b_data);
+            e->b_data = shrunk ? shrunk : c;
+            e->b_csize = n;
+        } else { /* incompressible: keep it raw */
+            free(c);
+            e->b_csize = e->b_size;
+        }
+#else
+        LIST_REMOVE(e, b_hash);
+        free(e->b_data);
+        free(e);
+        bcache_stats.dropped++;
+        return;
+#endif
+    }
+
+    e->b_cold = 1;
+    TAILQ_INSERT_HEAD(&bcache_cold, e, b_lru);
+    bcache_coldbytes += e->b_csize + BCACHE_OVERHEAD;
+    bcache_coldraw += e->b_size;
+    bcache_coldblocks++;
+    bcache_stats.demoted++;
+
+    bcache_trimcold();
+}
+
+static void
+bcache_trimhot(void)
+{
+    struct bcache_entry* e;
+
+    while ((bcache_hotbytes > bcache_hotmax) &&
+           ((e = TAILQ_LAST(&bcache_hot, bcache_lru)) != NULL))
+        bcache_demote(e);
+}
+
+/* cold to hot; buf gets the block */
+static int
+bcache_promote(struct bcache_entry* e, char* buf)
+{
+    if (!e->b_csize)
+        memset(buf, 0, e->b_size);
+    else if (e->b_csize == e->b_size)
+        memcpy(buf, e->b_data, e->b_size);
+#if UNIXFS_BCACHE_LZ4
+    else if (LZ4_decompress_safe(e->b_data, buf, (int)e->b_csize,
+                                 (int)e->b_size) != (int)e->b_size) {
+        bcache_free(e);
+        return EIO;
+    }
+#endif
+
+    char* data = malloc(e->b_size);
+    if (!data) { /* still served from the cold tier */
+        TAILQ_REMOVE(&bcache_cold, e, b_lru);
+        TAILQ_INSERT_HEAD(&bcache_cold, e, b_lru);
+        return 0;
+    }
+    memcpy(data, buf, e->b_size);
+
+    bcache_unlink(e);
+    free(e->b_data);
+    e->b_data = data;
+    e->b_csize = e->b_size;
+    e->b_cold = 0;
+    TAILQ_INSERT_HEAD(&bcache_hot, e, b_lru);
+    bcache_hotbytes += e->b_size + BCACHE_OVERHEAD;
+
+    bcache_trimhot();
+
+    return 0;
+}
+
+static void
+bcache_insert(int fd, off_t blkno, const char* buf, size_t size)
+{
+    if (bcache_find(fd, blkno, size)) /* someone else read it meanwhile */
+        return;
+
+    struct bcache_entry* e = calloc(1, sizeof(struct bcache_entry));
+    if (!e)
+        return;
+    if (!(e->b_data = malloc(size))) {
+        free(e);
+        return;
+    }
+
+    memcpy(e->b_data, buf, size);
+    e->b_fd = fd;
+    e->b_blkno = blkno;
+    e->b_size = size;
+    e->b_csize = size;
+
+    LIST_INSERT_HEAD(bcache_bucket(fd, blkno), e, b_hash);
+    TAILQ_INSERT_HEAD(&bcache_hot, e, b_lru);
+    bcache_hotbytes += size + BCACHE_OVERHEAD;
+
+    bcache_trimhot();
+}
+
+void
+unixfs_bcache_limit(size_t hot, size_t cold)
+{
+    pthread_mutex_lock(&bcache_lock);
+    bcache_hotmax = hot;
+    bcache_coldmax = cold;
+    bcache_trimhot();
+    bcache_trimcold();
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+int
+unixfs_bcache_bread(int fd, off_t blkno, char* buf, size_t size)
+{
+    if (bcache_hotmax) {
+        pthread_mutex_lock(&bcache_lock);
+        struct bcache_entry* e = bcache_find(fd, blkno, size);
+        if (e && !e->b_cold) {
+            memcpy(buf, e->b_data, size);
+            TAILQ_REMOVE(&bcache_hot, e, b_lru);
+            TAILQ_INSERT_HEAD(&bcache_hot, e, b_lru);
+            bcache_stats.hothits++;
+            pthread_mutex_unlock(&bcache_lock);
+            return 0;
+        }
+        if (e && (bcache_promote(e, buf) == 0)) {
+            bcache_stats.coldhits++;
+            pthread_mutex_unlock(&bcache_lock);
+            return 0;
+        }
+        bcache_stats.misses++;
+        pthread_mutex_unlock(&bcache_lock);
+    }
+
+    if (unixfs_image_pread(fd, buf, size, blkno * (off_t)size) != size)
+        return EIO;
+
+    if (bcache_hotmax) {
+        pthread_mutex_lock(&bcache_lock);
+        bcache_insert(fd, blkno, buf, size);
+        pthread_mutex_unlock(&bcache_lock);
+    }
+
+    return 0;
+}
+
+void
+unixfs_bcache_fini(void)
+{
+    struct bcache_entry* e;
+
+    pthread_mutex_lock(&bcache_lock);
+    while ((e = TAILQ_FIRST(&bcache_hot)) != NULL)
+        bcache_free(e);
+    while ((e = TAILQ_FIRST(&bcache_cold)) != NULL)
+        bcache_free(e);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+void
+unixfs_bcache_stats(FILE* fp)
+{
+    pthread_mutex_lock(&bcache_lock);
+
+    uint64_t lookups = bcache_stats.hothits + bcache_stats.coldhits +
+                       bcache_stats.misses;
+    if (!lookups) {
+        pthread_mutex_unlock(&bcache_lock);
+        return;
+    }
+
+    fprintf(fp, "block cache: %llu lookups, %.1f%% hot hits, "
+            "%.1f%% cold hits, %.1f%% misses\n", (unsigned long long)lookups,
+            100.0 * bcache_stats.hothits / lookups,
+            100.0 * bcache_stats.coldhits / lookups,
+            100.0 * bcache_stats.misses / lookups);
+    fprintf(fp, "  hot tier:  %zu of %zu bytes\n", bcache_hotbytes,
+            bcache_hotmax);
+    fprintf(fp, "  cold tier: %zu of %zu bytes, %zu blocks (%zu zero) "
+            "of %zu bytes, %.1fx\n", bcache_coldbytes, bcache_coldmax,
+            bcache_coldblocks, bcache_coldzero, bcache_coldraw,
+            bcache_coldbytes ? (double)bcache_coldraw / bcache_coldbytes : 0.0);
+    fprintf(fp, "  %llu blocks demoted, %llu dropped\n",
+            (unsigned long long)bcache_stats.demoted,
+            (unsigned long long)bcache_stats.dropped);
+
+    pthread_mutex_unlock(&bcache_lock);
+}
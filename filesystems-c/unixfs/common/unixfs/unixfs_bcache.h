@@ -0,0 +1,37 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_BCACHE_H_
+#define _UNIXFS_BCACHE_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Block cache for the Linux shim's sb_bread and friends, in two tiers.
+ * Recently used blocks are kept as they are (the hot tier). Blocks evicted
+ * from there move to the cold tier compressed: with LZ4 when built with
+ * UNIXFS_BCACHE_LZ4, while an all-zero block is kept as a flag either way
+ * (without LZ4, other blocks are simply dropped). A cold hit is
+ * decompressed and moves back to the hot tier. Each tier is bounded in
+ * bytes, entry overhead included; --block-cache HOT[,COLD] sets the bounds
+ * and a HOT of 0 turns the cache off.
+ *
+ * unixfs_bcache_stats reports the hits of each tier and how well the cold
+ * tier compresses, for sizing the two.
+ */
+
+#define UNIXFS_BCACHE_HOT  (8 * 1024 * 1024)  /* bytes */
+#define UNIXFS_BCACHE_COLD (32 * 1024 * 1024) /* bytes, compressed */
+#define UNIXFS_BCACHE_HASH 4096               /* buckets */
+
+void unixfs_bcache_limit(size_t hot, size_t cold);
+int  unixfs_bcache_bread(int fd, off_t blkno, char* buf, size_t size);
+void unixfs_bcache_fini(void);
+void unixfs_bcache_stats(FILE* fp);
+
+#endif /* _UNIXFS_BCACHE_H_ */
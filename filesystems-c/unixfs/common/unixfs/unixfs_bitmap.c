@@ -0,0 +1,173 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs_bitmap.h"
+
+#include <string.h>
+
+#if (__x86_64__ || __i386__) && __GNUC__
+#define UNIXFS_BITMAP_X86 1
+#include <immintrin.h>
+#endif
+
+#if __ARM_NEON
+#define UNIXFS_BITMAP_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef uint64_t (*bitmap_popcount_t)(const unsigned char*, size_t);
+
+static inline uint64_t
+bitmap_popcount64(uint64_t v)
+{
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (v * 0x0101010101010101ULL) >> 56;
+}
+
+static uint64_t
+bitmap_popcount_portable(const unsigned char* p, size_t n)
+{
+    uint64_t sum = 0, w;
+
+    for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        sum += bitmap_popcount64(w);
+    }
+
+    while (n--)
+        sum += bitmap_popcount64(*p++);
+
+    return sum;
+}
+
+#if UNIXFS_BITMAP_X86
+
+__attribute__((target("popcnt")))
+static uint64_t
+bitmap_popcount_popcnt(const unsigned char* p, size_t n)
+{
+    uint64_t sum = 0, w;
+
+    for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        sum += __builtin_popcountll(w);
+    }
+
+    while (n--)
+        sum += __builtin_popcount(*p++);
+
+    return sum;
+}
+
+/* nibble lookup through vpshufb, summed with vpsadbw (after W. Mula) */
+__attribute__((target("avx2,popcnt")))
+static uint64_t
+bitmap_popcount_avx2(const unsigned char* p, size_t n)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    while (n >= 32) {
+        /* a byte lane gains at most 8 per round, so flush before 32 */
+        size_t rounds = n / 32, i;
+        if (rounds > 31)
+            rounds = 31;
+        __m256i local = zero;
+        for (i = 0; i < rounds; i++, p += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            __m256i lo = _mm256_and_si256(v, nibble);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+            local = _mm256_add_epi8(local,
+                        _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                        _mm256_shuffle_epi8(lookup, hi)));
+        }
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, zero));
+        n -= rounds * 32;
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           bitmap_popcount_popcnt(p, n);
+}
+
+#endif /* UNIXFS_BITMAP_X86 */
+
+#if UNIXFS_BITMAP_NEON
+
+static uint64_t
+bitmap_popcount_neon(const unsigned char* p, size_t n)
+{
+    uint64_t sum = 0;
+
+    while (n >= 16) {
+        /* a 16-bit lane gains at most 16 per round */
+        size_t rounds = n / 16, i;
+        if (rounds > 4095)
+            rounds = 4095;
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (i = 0; i < rounds; i++, p += 16)
+            acc = vpadalq_u8(acc, vcntq_u8(vld1q_u8(p)));
+        uint64x2_t wide = vpaddlq_u32(vpaddlq_u16(acc));
+        sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+        n -= rounds * 16;
+    }
+
+    return sum + bitmap_popcount_portable(p, n);
+}
+
+#endif /* UNIXFS_BITMAP_NEON */
+
+/* Set once; a racing first use just picks the same kernel twice. */
+static bitmap_popcount_t bitmap_popcount = NULL;
+
+static bitmap_popcount_t
+bitmap_select(void)
+{
+#if UNIXFS_BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return bitmap_popcount_avx2;
+    if (__builtin_cpu_supports("popcnt"))
+        return bitmap_popcount_popcnt;
+#endif
+#if UNIXFS_BITMAP_NEON
+    return bitmap_popcount_neon;
+#endif
+    return bitmap_popcount_portable;
+}
+
+uint64_t
+unixfs_bitmap_popcount(const void* map, size_t nbytes)
+{
+    if (!bitmap_popcount)
+        bitmap_popcount = bitmap_select();
+
+    return bitmap_popcount((const unsigned char*)map, nbytes);
+}
+
+uint64_t
+unixfs_bitmap_count_clear(const void* map, size_t nbits)
+{
+    const unsigned char* p = (const unsigned char*)map;
+    size_t nbytes = nbits / 8;
+    unsigned rem = nbits % 8;
+
+    uint64_t set = unixfs_bitmap_popcount(p, nbytes);
+    if (rem)
+        set += bitmap_popcount64(p[nbytes] & ((1U << rem) - 1));
+
+    return nbits - set;
+}
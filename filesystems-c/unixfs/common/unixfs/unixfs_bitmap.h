@@ -0,0 +1,23 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_BITMAP_H_
+#define _UNIXFS_BITMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bit counting over on-disk allocation bitmaps. Bits are numbered from the
+ * least significant bit of the first byte. The widest popcount kernel the
+ * processor supports is picked on first use.
+ */
+
+uint64_t unixfs_bitmap_popcount(const void* map, size_t nbytes);
+uint64_t unixfs_bitmap_count_clear(const void* map, size_t nbits);
+
+#endif /* _UNIXFS_BITMAP_H_ */
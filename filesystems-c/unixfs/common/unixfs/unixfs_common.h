@@ -35,6 +35,14 @@ static int           unixfs_internal_nextdirentry(struct inode* ip,
 static ssize_t       unixfs_internal_pbread(struct inode* ip, char* buf,
                                             size_t nbyte, off_t offset,
                                             int* error);
+#ifdef UNIXFS_INTERNAL_PBREAD_ASYNC
+static int           unixfs_internal_pbread_async(struct inode* ip, char* buf,
+                                                  size_t nbyte, off_t offset,
+                                                  unixfs_pbread_done_t done,
+                                                  void* arg);
+#else
+#define UNIXFS_INTERNAL_PBREAD_ASYNC NULL
+#endif
 static int           unixfs_internal_sanitycheck(void* filsys, off_t disksize);
 static int           unixfs_internal_readlink(ino_t ino,
                                               char path[UNIXFS_MAXPATHLEN]);
@@ -56,6 +64,7 @@ static int           unixfs_internal_statvfs(struct statvfs* svb);
         .namei        = unixfs_internal_namei,        \
         .nextdirentry = unixfs_internal_nextdirentry, \
         .pbread       = unixfs_internal_pbread,       \
+        .pbread_async = UNIXFS_INTERNAL_PBREAD_ASYNC, \
         .readlink     = unixfs_internal_readlink,     \
         .sanitycheck  = unixfs_internal_sanitycheck,  \
         .statvfs      = unixfs_internal_statvfs,      \
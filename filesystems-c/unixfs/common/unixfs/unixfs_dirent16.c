@@ -0,0 +1,178 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs_dirent16.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if (__x86_64__ || __i386__) && __GNUC__
+#define UNIXFS_DIRENT16_X86 1
+#include <immintrin.h>
+#endif
+
+#if __ARM_NEON && __aarch64__
+#define UNIXFS_DIRENT16_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * The key is the name laid out as an entry would hold it, plus a mask of the
+ * bytes that have to agree: the name and, if it is shorter than 14, the NUL
+ * after it. The inode number is never part of the comparison.
+ */
+struct dirent16_key {
+    unsigned char name[UNIXFS_DIRENT16_SIZE];
+    unsigned char care[UNIXFS_DIRENT16_SIZE];
+    uint32_t      bits; /* care, one bit per byte */
+};
+
+typedef int (*dirent16_find_t)(const unsigned char*, size_t,
+                               const struct dirent16_key*);
+
+#define DIRENT16_INUSE(e) ((e)[0] | (e)[1])
+
+static int
+dirent16_find_portable(const unsigned char* p, size_t n,
+                       const struct dirent16_key* key)
+{
+    uint64_t k0, k1, m0, m1, w0, w1;
+    size_t i;
+
+    memcpy(&k0, key->name, 8);
+    memcpy(&k1, key->name + 8, 8);
+    memcpy(&m0, key->care, 8);
+    memcpy(&m1, key->care + 8, 8);
+
+    for (i = 0; i < n; i++, p += UNIXFS_DIRENT16_SIZE) {
+        memcpy(&w0, p, 8);
+        memcpy(&w1, p + 8, 8);
+        if (((((w0 ^ k0) & m0) | ((w1 ^ k1) & m1)) == 0) && DIRENT16_INUSE(p))
+            return (int)i;
+    }
+
+    return -1;
+}
+
+#if UNIXFS_DIRENT16_X86
+
+__attribute__((target("sse2")))
+static int
+dirent16_find_sse2(const unsigned char* p, size_t n,
+                   const struct dirent16_key* key)
+{
+    const __m128i k = _mm_loadu_si128((const __m128i*)key->name);
+    const unsigned bits = key->bits;
+    size_t i;
+
+    for (i = 0; i < n; i++, p += UNIXFS_DIRENT16_SIZE) {
+        __m128i e = _mm_loadu_si128((const __m128i*)p);
+        unsigned eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(e, k));
+        if (((eq & bits) == bits) && DIRENT16_INUSE(p))
+            return (int)i;
+    }
+
+    return -1;
+}
+
+/* four entries per iteration, two to a register */
+__attribute__((target("avx2")))
+static int
+dirent16_find_avx2(const unsigned char* p, size_t n,
+                   const struct dirent16_key* key)
+{
+    const __m128i k1 = _mm_loadu_si128((const __m128i*)key->name);
+    const __m256i k = _mm256_broadcastsi128_si256(k1);
+    const uint32_t bits = key->bits;
+    const uint64_t bits4 = (uint64_t)(bits | (bits << 16)) * 0x100000001ULL;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4, p += 4 * UNIXFS_DIRENT16_SIZE) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+        uint64_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, k)) |
+            ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, k))
+             << 32);
+        uint64_t miss = ~eq & bits4; /* a care byte that differs */
+        int j;
+        for (j = 0; j < 4; j++) {
+            if (!((miss >> (16 * j)) & 0xffff) &&
+                DIRENT16_INUSE(p + j * UNIXFS_DIRENT16_SIZE))
+                return (int)(i + j);
+        }
+    }
+
+    if (i < n) {
+        int r = dirent16_find_sse2(p, n - i, key);
+        if (r >= 0)
+            return (int)i + r;
+    }
+
+    return -1;
+}
+
+#endif /* UNIXFS_DIRENT16_X86 */
+
+#if UNIXFS_DIRENT16_NEON
+
+static int
+dirent16_find_neon(const unsigned char* p, size_t n,
+                   const struct dirent16_key* key)
+{
+    const uint8x16_t k = vld1q_u8(key->name);
+    const uint8x16_t care = vld1q_u8(key->care);
+    size_t i;
+
+    for (i = 0; i < n; i++, p += UNIXFS_DIRENT16_SIZE) {
+        uint8x16_t x = vandq_u8(veorq_u8(vld1q_u8(p), k), care);
+        if ((vmaxvq_u8(x) == 0) && DIRENT16_INUSE(p))
+            return (int)i;
+    }
+
+    return -1;
+}
+
+#endif /* UNIXFS_DIRENT16_NEON */
+
+/* Set once; a racing first use just picks the same kernel twice. */
+static dirent16_find_t dirent16_find = NULL;
+
+static dirent16_find_t
+dirent16_select(void)
+{
+#if UNIXFS_DIRENT16_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return dirent16_find_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return dirent16_find_sse2;
+#endif
+#if UNIXFS_DIRENT16_NEON
+    return dirent16_find_neon;
+#endif
+    return dirent16_find_portable;
+}
+
+int
+unixfs_dirent16_find(const void* block, size_t nentries, const char* name)
+{
+    struct dirent16_key key;
+    size_t len = strnlen(name, UNIXFS_DIRENT16_NAMELEN);
+    size_t ncare = (len < UNIXFS_DIRENT16_NAMELEN) ? len + 1 : len;
+    size_t i;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.name + 2, name, len);
+    for (i = 0; i < ncare; i++)
+        key.care[2 + i] = 0xff;
+    key.bits = ((1U << ncare) - 1) << 2;
+
+    if (!dirent16_find)
+        dirent16_find = dirent16_select();
+
+    return dirent16_find((const unsigned char*)block, nentries, &key);
+}
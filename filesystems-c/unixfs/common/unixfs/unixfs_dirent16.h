@@ -0,0 +1,29 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_DIRENT16_H_
+#define _UNIXFS_DIRENT16_H_
+
+#include <stddef.h>
+
+/*
+ * Name search in directory blocks made of 16-byte entries: a 2-byte inode
+ * number followed by a 14-byte, NUL-padded name, as in V6, V7, 32V, 2.9BSD
+ * and System V. The entries are compared in place, several at a time where
+ * the processor allows. A name matches as strncmp(name, d_name, 14) would
+ * have it, so a name longer than 14 characters matches its first 14.
+ *
+ * Returns the index of the first entry with a nonzero inode number whose
+ * name matches, or -1.
+ */
+
+#define UNIXFS_DIRENT16_SIZE    16
+#define UNIXFS_DIRENT16_NAMELEN 14
+
+int unixfs_dirent16_find(const void* block, size_t nentries, const char* name);
+
+#endif /* _UNIXFS_DIRENT16_H_ */
@@ -0,0 +1,274 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs_exec.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#if __linux__
+#include <darwin/queue.h>
+#else
+#include <sys/queue.h>
+#endif
+
+struct exec_task {
+    TAILQ_ENTRY(exec_task) t_link;
+    unixfs_exec_fn_t       t_fn;
+    void*                  t_arg;
+    int                    t_op;
+    uint64_t               t_queued; /* ns */
+};
+
+TAILQ_HEAD(exec_deque, exec_task);
+
+struct exec_worker {
+    pthread_t         w_thread;
+    pthread_mutex_t   w_lock;
+    struct exec_deque w_deque[UNIXFS_EXEC_NCLASSES];
+    int               w_index;
+};
+
+struct exec_opstats {
+    uint64_t s_count;
+    uint64_t s_total; /* ns */
+    uint64_t s_max;   /* ns */
+};
+
+static struct exec_worker* exec_workers = NULL;
+static int exec_nworkers = 0;
+static unsigned exec_next = 0;
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exec_cond = PTHREAD_COND_INITIALIZER;
+static long exec_pending = 0;
+static int exec_stopping = 0;
+
+static const char* const* exec_opnames = NULL;
+static int exec_nops = 0;
+static struct exec_opstats exec_stats[UNIXFS_EXEC_MAXOPS];
+
+static uint64_t
+exec_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+exec_account(int op, uint64_t delay)
+{
+    if ((op < 0) || (op >= exec_nops))
+        return;
+
+    struct exec_opstats* s = &exec_stats[op];
+    uint64_t max;
+
+    __sync_fetch_and_add(&s->s_count, 1);
+    __sync_fetch_and_add(&s->s_total, delay);
+    while ((max = s->s_max) < delay)
+        if (__sync_bool_compare_and_swap(&s->s_max, max, delay))
+            break;
+}
+
+/*
+ * A worker takes the oldest work from its own deque; a thief takes the
+ * newest from someone else's, which is what the owner would get to last.
+ */
+static struct exec_task*
+exec_take(struct exec_worker* self)
+{
+    struct exec_task* t = NULL;
+    int class, i;
+
+    for (class = 0; class < UNIXFS_EXEC_NCLASSES; class++) {
+        pthread_mutex_lock(&self->w_lock);
+        if ((t = TAILQ_FIRST(&self->w_deque[class])) != NULL)
+            TAILQ_REMOVE(&self->w_deque[class], t, t_link);
+        pthread_mutex_unlock(&self->w_lock);
+        if (t)
+            return t;
+
+        for (i = 1; i < exec_nworkers; i++) {
+            struct exec_worker* victim =
+                &exec_workers[(self->w_index + i) % exec_nworkers];
+            pthread_mutex_lock(&victim->w_lock);
+            if ((t = TAILQ_LAST(&victim->w_deque[class], exec_deque)) != NULL)
+                TAILQ_REMOVE(&victim->w_deque[class], t, t_link);
+            pthread_mutex_unlock(&victim->w_lock);
+            if (t)
+                return t;
+        }
+    }
+
+    return NULL;
+}
+
+static void*
+exec_worker_main(void* arg)
+{
+    struct exec_worker* self = (struct exec_worker*)arg;
+
+    for (;;) {
+        struct exec_task* t = exec_take(self);
+        if (!t) {
+            pthread_mutex_lock(&exec_lock);
+            while ((exec_pending == 0) && !exec_stopping)
+                pthread_cond_wait(&exec_cond, &exec_lock);
+            if ((exec_pending == 0) && exec_stopping) {
+                pthread_mutex_unlock(&exec_lock);
+                break;
+            }
+            pthread_mutex_unlock(&exec_lock);
+            continue;
+        }
+
+        __sync_fetch_and_sub(&exec_pending, 1);
+        exec_account(t->t_op, exec_now() - t->t_queued);
+        t->t_fn(t->t_arg);
+        free(t);
+    }
+
+    return NULL;
+}
+
+int
+unixfs_exec_start(int nworkers, const char* const* opnames, int nops)
+{
+    int i, j, class;
+
+    if (nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    if (nworkers > UNIXFS_EXEC_MAXWORKERS)
+        nworkers = UNIXFS_EXEC_MAXWORKERS;
+    if (nops > UNIXFS_EXEC_MAXOPS)
+        nops = UNIXFS_EXEC_MAXOPS;
+
+    exec_opnames = opnames;
+    exec_nops = nops;
+    memset(exec_stats, 0, sizeof(exec_stats));
+
+    exec_workers = calloc(nworkers, sizeof(struct exec_worker));
+    if (!exec_workers)
+        return ENOMEM;
+
+    for (i = 0; i < nworkers; i++) {
+        struct exec_worker* w = &exec_workers[i];
+        w->w_index = i;
+        (void)pthread_mutex_init(&w->w_lock, (const pthread_mutexattr_t*)0);
+        for (class = 0; class < UNIXFS_EXEC_NCLASSES; class++)
+            TAILQ_INIT(&w->w_deque[class]);
+    }
+
+    exec_stopping = 0;
+    exec_nworkers = nworkers;
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&exec_workers[i].w_thread,
+                           (const pthread_attr_t*)0, exec_worker_main,
+                           &exec_workers[i]) != 0)
+            break;
+    }
+
+    if (i < nworkers) {
+        fprintf(stderr, "*** warning: failed to start request workers\n");
+        pthread_mutex_lock(&exec_lock);
+        exec_stopping = 1;
+        pthread_cond_broadcast(&exec_cond);
+        pthread_mutex_unlock(&exec_lock);
+        for (j = 0; j < i; j++)
+            (void)pthread_join(exec_workers[j].w_thread, NULL);
+        for (j = 0; j < nworkers; j++)
+            (void)pthread_mutex_destroy(&exec_workers[j].w_lock);
+        free(exec_workers);
+        exec_workers = NULL;
+        exec_nworkers = 0;
+        return EAGAIN;
+    }
+
+    return 0;
+}
+
+int
+unixfs_exec_submit(unixfs_exec_class_t class, int op, unixfs_exec_fn_t fn,
+                   void* arg)
+{
+    if (!exec_nworkers)
+        return -1;
+
+    struct exec_task* t = malloc(sizeof(struct exec_task));
+    if (!t)
+        return -1;
+
+    t->t_fn = fn;
+    t->t_arg = arg;
+    t->t_op = op;
+    t->t_queued = exec_now();
+
+    struct exec_worker* w =
+        &exec_workers[__sync_fetch_and_add(&exec_next, 1) % exec_nworkers];
+
+    pthread_mutex_lock(&w->w_lock);
+    TAILQ_INSERT_TAIL(&w->w_deque[class], t, t_link);
+    pthread_mutex_unlock(&w->w_lock);
+
+    pthread_mutex_lock(&exec_lock);
+    exec_pending++;
+    pthread_cond_signal(&exec_cond);
+    pthread_mutex_unlock(&exec_lock);
+
+    return 0;
+}
+
+void
+unixfs_exec_stop(void)
+{
+    int i;
+
+    if (!exec_nworkers)
+        return;
+
+    pthread_mutex_lock(&exec_lock);
+    exec_stopping = 1;
+    pthread_cond_broadcast(&exec_cond);
+    pthread_mutex_unlock(&exec_lock);
+
+    for (i = 0; i < exec_nworkers; i++) {
+        (void)pthread_join(exec_workers[i].w_thread, NULL);
+        (void)pthread_mutex_destroy(&exec_workers[i].w_lock);
+    }
+
+    free(exec_workers);
+    exec_workers = NULL;
+    exec_nworkers = 0;
+}
+
+void
+unixfs_exec_stats(FILE* fp)
+{
+    int op;
+
+    fprintf(fp, "%-10s %10s %12s %12s\n", "op", "requests", "mean wait",
+            "max wait");
+
+    for (op = 0; op < exec_nops; op++) {
+        struct exec_opstats* s = &exec_stats[op];
+        if (s->s_count == 0)
+            continue;
+        fprintf(fp, "%-10s %10llu %10.1fus %10.1fus\n", exec_opnames[op],
+                (unsigned long long)s->s_count,
+                (double)s->s_total / s->s_count / 1000.0,
+                (double)s->s_max / 1000.0);
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_EXEC_H_
+#define _UNIXFS_EXEC_H_
+
+#include <stdio.h>
+
+/*
+ * Request executor. Work is queued on per-worker deques, one pair per
+ * worker: metadata work is always taken before bulk work, first from the
+ * worker's own deque and then by stealing from the others. Each piece of
+ * work carries an op number so that queueing delay can be reported per op.
+ */
+
+#define UNIXFS_EXEC_MAXWORKERS 64
+#define UNIXFS_EXEC_MAXOPS     16
+
+typedef enum {
+    UNIXFS_EXEC_META = 0,
+    UNIXFS_EXEC_BULK = 1,
+    UNIXFS_EXEC_NCLASSES
+} unixfs_exec_class_t;
+
+typedef void (*unixfs_exec_fn_t)(void* arg);
+
+int  unixfs_exec_start(int nworkers, const char* const* opnames, int nops);
+int  unixfs_exec_submit(unixfs_exec_class_t class, int op,
+                        unixfs_exec_fn_t fn, void* arg);
+void unixfs_exec_stop(void);
+void unixfs_exec_stats(FILE* fp);
+
+#endif /* _UNIXFS_EXEC_H_ */
@@ -0,0 +1,480 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs_internal.h"
+#include "unixfs_flat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FLAT_IOSIZE (128 * 1024) /* per pbread while copying file data */
+
+#define FLAT_ROUNDUP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct flat_node {
+    ino_t       n_oino;   /* in the original */
+    uint32_t    n_parent;
+    uint32_t    n_count;  /* directories: entries */
+    uint64_t    n_first;  /* directories: first entry */
+    uint64_t    n_data;   /* image offset */
+    char*       n_link;   /* symlink target */
+    struct stat n_st;
+};
+
+struct flat_map {
+    ino_t    m_oino;
+    uint32_t m_ino; /* 0: free */
+};
+
+struct flat_state {
+    struct unixfs*             fs;
+    struct flat_node*          nodes;
+    size_t                     nnodes;
+    size_t                     maxnodes;
+    struct flat_map*           map;
+    size_t                     mapsize;
+    struct unixfs_flat_dirent* dents;
+    size_t                     ndents;
+    size_t                     maxdents;
+    char*                      strings;
+    size_t                     stringsize;
+    size_t                     maxstrings;
+    uint32_t                   namemax;
+};
+
+static int
+flat_grow(void** p, size_t* max, size_t need, size_t elsize)
+{
+    if (need <= *max)
+        return 0;
+
+    size_t newmax = *max ? *max : 64;
+    while (newmax < need)
+        newmax *= 2;
+
+    void* newp = realloc(*p, newmax * elsize);
+    if (!newp)
+        return ENOMEM;
+
+    *p = newp;
+    *max = newmax;
+
+    return 0;
+}
+
+static struct flat_map*
+flat_mapslot(struct flat_map* map, size_t mapsize, ino_t oino)
+{
+    size_t i = ((uint64_t)oino * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    for (;; i++) {
+        struct flat_map* m = &map[i & (mapsize - 1)];
+        if (!m->m_ino || (m->m_oino == oino))
+            return m;
+    }
+}
+
+static uint32_t
+flat_mapget(struct flat_state* st, ino_t oino)
+{
+    return st->mapsize ? flat_mapslot(st->map, st->mapsize, oino)->m_ino : 0;
+}
+
+static int
+flat_mapput(struct flat_state* st, ino_t oino, uint32_t ino)
+{
+    if (2 * (st->nnodes + 1) > st->mapsize) { /* keep it at most half full */
+        size_t newsize = st->mapsize ? 2 * st->mapsize : 1024;
+        struct flat_map* newmap = calloc(newsize, sizeof(struct flat_map));
+        if (!newmap)
+            return ENOMEM;
+        size_t i;
+        for (i = 0; i < st->mapsize; i++)
+            if (st->map[i].m_ino)
+                *flat_mapslot(newmap, newsize, st->map[i].m_oino) =
+                    st->map[i];
+        free(st->map);
+        st->map = newmap;
+        st->mapsize = newsize;
+    }
+
+    struct flat_map* m = flat_mapslot(st->map, st->mapsize, oino);
+    m->m_oino = oino;
+    m->m_ino = ino;
+
+    return 0;
+}
+
+static int
+flat_addnode(struct flat_state* st, ino_t oino, uint32_t parent,
+             uint32_t* ino)
+{
+    struct stat stbuf;
+    int err;
+
+    if ((err = st->fs->ops->igetattr(oino, &stbuf)) != 0)
+        return err;
+
+    if (st->nnodes >= UINT32_MAX)
+        return EFBIG;
+
+    if ((err = flat_grow((void**)&st->nodes, &st->maxnodes, st->nnodes + 1,
+                         sizeof(struct flat_node))) != 0)
+        return err;
+
+    if ((err = flat_mapput(st, oino, (uint32_t)(st->nnodes + 1))) != 0)
+        return err;
+
+    struct flat_node* n = &st->nodes[st->nnodes++];
+    memset(n, 0, sizeof(*n));
+    n->n_oino = oino;
+    n->n_parent = parent;
+    n->n_st = stbuf;
+
+    *ino = (uint32_t)st->nnodes;
+
+    return 0;
+}
+
+static int
+flat_adddirent(struct flat_state* st, const char* name, uint32_t ino)
+{
+    size_t len = strlen(name);
+    int err;
+
+    if ((err = flat_grow((void**)&st->dents, &st->maxdents, st->ndents + 1,
+                         sizeof(struct unixfs_flat_dirent))) != 0)
+        return err;
+    if ((err = flat_grow((void**)&st->strings, &st->maxstrings,
+                         st->stringsize + len, 1)) != 0)
+        return err;
+
+    if (st->stringsize + len > UINT32_MAX)
+        return EFBIG;
+
+    struct unixfs_flat_dirent* d = &st->dents[st->ndents++];
+    d->d_hash = unixfs_flat_hash(name, len);
+    d->d_ino = ino;
+    d->d_namelen = (uint32_t)len;
+    d->d_name = (uint32_t)st->stringsize;
+
+    memcpy(st->strings + st->stringsize, name, len);
+    st->stringsize += len;
+
+    if (len > st->namemax)
+        st->namemax = (uint32_t)len;
+
+    return 0;
+}
+
+static int
+flat_dirent_cmp(const void* a, const void* b)
+{
+    const struct unixfs_flat_dirent* x = (const struct unixfs_flat_dirent*)a;
+    const struct unixfs_flat_dirent* y = (const struct unixfs_flat_dirent*)b;
+
+    if (x->d_hash != y->d_hash)
+        return (x->d_hash < y->d_hash) ? -1 : 1;
+
+    return (x->d_name < y->d_name) ? -1 : (x->d_name > y->d_name);
+}
+
+/* "." and ".." are taken from the walk, not from the original's numbering */
+static int
+flat_readdir(struct flat_state* st, uint32_t ino)
+{
+    struct unixfs_ops* ops = st->fs->ops;
+    struct inode* dp = ops->iget(st->nodes[ino - 1].n_oino);
+    if (!dp) {
+        fprintf(stderr, "*** warning: cannot read directory inode %llu\n",
+                (unsigned long long)st->nodes[ino - 1].n_oino);
+        return 0;
+    }
+
+    struct unixfs_dirbuf dirbuf;
+    struct unixfs_direntry dent;
+    off_t offset = 0;
+    size_t first = st->ndents;
+    int err = 0;
+
+    dirbuf.flags.initialized = 0;
+
+    while (ops->nextdirentry(dp, &dirbuf, &offset, &dent) == 0) {
+
+        if (dent.ino == 0)
+            continue;
+
+        uint32_t child;
+
+        if (strcmp(dent.name, ".") == 0)
+            child = ino;
+        else if (strcmp(dent.name, "..") == 0)
+            child = st->nodes[ino - 1].n_parent;
+        else if (!(child = flat_mapget(st, dent.ino))) {
+            err = flat_addnode(st, dent.ino, ino, &child);
+            if ((err == ENOMEM) || (err == EFBIG))
+                break;
+            if (err) {
+                fprintf(stderr, "*** warning: skipping %s (inode %llu): %s\n",
+                        dent.name, (unsigned long long)dent.ino,
+                        strerror(err));
+                err = 0;
+                continue;
+            }
+        }
+
+        if ((err = flat_adddirent(st, dent.name, child)) != 0)
+            break;
+    }
+
+    ops->iput(dp);
+
+    if (err)
+        return err;
+
+    qsort(st->dents + first, st->ndents - first,
+          sizeof(struct unixfs_flat_dirent), flat_dirent_cmp);
+
+    st->nodes[ino - 1].n_first = first;
+    st->nodes[ino - 1].n_count = (uint32_t)(st->ndents - first);
+
+    return 0;
+}
+
+static int
+flat_write(FILE* fp, const void* buf, size_t len, uint64_t* pos)
+{
+    if (len && (fwrite(buf, 1, len, fp) != len))
+        return errno ? errno : EIO;
+
+    *pos += len;
+
+    return 0;
+}
+
+static int
+flat_pad(FILE* fp, uint64_t to, uint64_t* pos)
+{
+    static const char zeros[UNIXFS_FLAT_ALIGN];
+    int err = 0;
+
+    while (!err && (*pos < to))
+        err = flat_write(fp, zeros, (size_t)min(to - *pos, sizeof(zeros)),
+                         pos);
+
+    return err;
+}
+
+/* an unreadable stretch of a file is written as zeros */
+static int
+flat_copy(struct flat_state* st, FILE* fp, struct flat_node* n, char* buf,
+          uint64_t* pos)
+{
+    struct unixfs_ops* ops = st->fs->ops;
+    struct inode* ip = ops->iget(n->n_oino);
+    off_t size = n->n_st.st_size, offset = 0;
+    int err = 0, failed = !ip;
+
+    while (!err && (offset < size)) {
+        size_t count = (size_t)min((off_t)FLAT_IOSIZE, size - offset);
+        ssize_t ret = 0;
+        int error = 0;
+
+        if (!failed) {
+            ret = ops->pbread(ip, buf, count, offset, &error);
+            if (ret <= 0)
+                failed = 1;
+        }
+        if (failed) {
+            memset(buf, 0, count);
+            ret = (ssize_t)count;
+        }
+
+        err = flat_write(fp, buf, (size_t)ret, pos);
+        offset += ret;
+    }
+
+    if (failed)
+        fprintf(stderr, "*** warning: inode %llu could not be read in "
+                "full; the rest is zero-filled\n",
+                (unsigned long long)n->n_oino);
+
+    if (ip)
+        ops->iput(ip);
+
+    return err;
+}
+
+int
+unixfs_flatten(struct unixfs* fs, const char* path)
+{
+    struct flat_state st;
+    struct unixfs_flat_super super;
+    char tmp[UNIXFS_MAXPATHLEN];
+    char* buf = NULL;
+    FILE* fp = NULL;
+    uint64_t pos = 0, cursor;
+    uint32_t root;
+    size_t i;
+    int err;
+
+    memset(&st, 0, sizeof(st));
+    st.fs = fs;
+    tmp[0] = '\0';
+
+    if ((err = flat_addnode(&st, (ino_t)OSXFUSE_ROOTINO, 1, &root)) != 0)
+        goto out;
+
+    if (!S_ISDIR(st.nodes[0].n_st.st_mode)) {
+        err = ENOTDIR;
+        goto out;
+    }
+
+    /* breadth-first: the node array is the queue */
+    for (i = 0; i < st.nnodes; i++) {
+        struct flat_node* n = &st.nodes[i];
+        if (S_ISDIR(n->n_st.st_mode)) {
+            if ((err = flat_readdir(&st, (uint32_t)(i + 1))) != 0)
+                goto out;
+        } else if (S_ISLNK(n->n_st.st_mode)) {
+            char link[UNIXFS_MAXPATHLEN];
+            if (fs->ops->readlink(n->n_oino, link) == 0)
+                n->n_link = strdup(link);
+            if (!n->n_link)
+                fprintf(stderr, "*** warning: cannot read symlink inode "
+                        "%llu\n", (unsigned long long)n->n_oino);
+            n->n_st.st_size = n->n_link ? strlen(n->n_link) : 0;
+        }
+    }
+
+    memset(&super, 0, sizeof(super));
+    memcpy(super.f_magic, UNIXFS_FLAT_MAGIC, sizeof(super.f_magic));
+    super.f_byteorder = UNIXFS_FLAT_BYTEORDER;
+    super.f_namemax = st.namemax;
+    super.f_ninodes = st.nnodes;
+    super.f_inodes = UNIXFS_FLAT_SUPERSIZE;
+    super.f_ndirents = st.ndents;
+    super.f_dirents = super.f_inodes +
+                      st.nnodes * sizeof(struct unixfs_flat_inode);
+    super.f_strings = super.f_dirents +
+                      st.ndents * sizeof(struct unixfs_flat_dirent);
+    super.f_stringsize = st.stringsize;
+    super.f_data = FLAT_ROUNDUP(super.f_strings + st.stringsize,
+                                UNIXFS_FLAT_ALIGN);
+    snprintf(super.f_fsname, sizeof(super.f_fsname), "%s",
+             fs->fsname ? fs->fsname : "");
+    snprintf(super.f_volname, sizeof(super.f_volname), "%s",
+             fs->volname ? fs->volname : "");
+
+    for (cursor = super.f_data, i = 0; i < st.nnodes; i++) {
+        struct flat_node* n = &st.nodes[i];
+        if (!S_ISREG(n->n_st.st_mode) && !S_ISLNK(n->n_st.st_mode))
+            continue;
+        if (n->n_st.st_size >= UNIXFS_FLAT_ALIGN)
+            cursor = FLAT_ROUNDUP(cursor, UNIXFS_FLAT_ALIGN);
+        n->n_data = cursor;
+        cursor += n->n_st.st_size;
+    }
+    super.f_datasize = cursor - super.f_data;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if (!(fp = fopen(tmp, "w"))) {
+        err = errno;
+        goto out;
+    }
+
+    if ((err = flat_write(fp, &super, sizeof(super), &pos)) ||
+        (err = flat_pad(fp, super.f_inodes, &pos)))
+        goto out;
+
+    for (i = 0; i < st.nnodes; i++) {
+        struct flat_node* n = &st.nodes[i];
+        struct unixfs_flat_inode rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.i_mode = n->n_st.st_mode;
+        rec.i_nlink = n->n_st.st_nlink;
+        rec.i_uid = n->n_st.st_uid;
+        rec.i_gid = n->n_st.st_gid;
+        rec.i_rdev = (uint32_t)n->n_st.st_rdev;
+        rec.i_atime = n->n_st.st_atime;
+        rec.i_mtime = n->n_st.st_mtime;
+        rec.i_ctime = n->n_st.st_ctime;
+        if (S_ISDIR(n->n_st.st_mode)) {
+            rec.i_size = n->n_count;
+            rec.i_nentries = n->n_count;
+            rec.i_data = n->n_first;
+        } else if (S_ISREG(n->n_st.st_mode) || S_ISLNK(n->n_st.st_mode)) {
+            rec.i_size = n->n_st.st_size;
+            rec.i_data = n->n_data;
+        }
+        if ((err = flat_write(fp, &rec, sizeof(rec), &pos)) != 0)
+            goto out;
+    }
+
+    if ((err = flat_write(fp, st.dents,
+                          st.ndents * sizeof(struct unixfs_flat_dirent),
+                          &pos)) ||
+        (err = flat_write(fp, st.strings, st.stringsize, &pos)))
+        goto out;
+
+    if (posix_memalign((void**)&buf, UNIXFS_IMAGE_ALIGN, FLAT_IOSIZE) != 0) {
+        buf = NULL;
+        err = ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < st.nnodes; i++) {
+        struct flat_node* n = &st.nodes[i];
+        if (S_ISREG(n->n_st.st_mode)) {
+            if ((err = flat_pad(fp, n->n_data, &pos)) ||
+                (err = flat_copy(&st, fp, n, buf, &pos)))
+                goto out;
+        } else if (S_ISLNK(n->n_st.st_mode) && n->n_link) {
+            if ((err = flat_pad(fp, n->n_data, &pos)) ||
+                (err = flat_write(fp, n->n_link, strlen(n->n_link), &pos)))
+                goto out;
+        }
+    }
+
+    if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+        err = errno;
+        goto out;
+    }
+
+    err = fclose(fp) ? errno : 0;
+    fp = NULL;
+    if (!err && (rename(tmp, path) != 0))
+        err = errno;
+
+    if (!err)
+        fprintf(stderr, "%s: %llu inodes, %llu directory entries, "
+                "%llu bytes of data\n", path,
+                (unsigned long long)super.f_ninodes,
+                (unsigned long long)super.f_ndirents,
+                (unsigned long long)super.f_datasize);
+
+out:
+    if (fp)
+        fclose(fp);
+    if (err && tmp[0])
+        (void)unlink(tmp);
+
+    for (i = 0; i < st.nnodes; i++)
+        free(st.nodes[i].n_link);
+    free(st.nodes);
+    free(st.map);
+    free(st.dents);
+    free(st.strings);
+    free(buf);
+
+    return err;
+}
@@ -0,0 +1,89 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_FLAT_H_
+#define _UNIXFS_FLAT_H_
+
+#include "unixfs.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Flattened images. --flatten OUT walks whatever file system was given
+ * through its unixfs_ops and writes it out once in a form that is cheap to
+ * serve: ancientfs mounts the result (type "flat") straight from an mmap of
+ * the file, with no block maps, byte swapping or directory scans.
+ *
+ *   super    at offset 0, UNIXFS_FLAT_SUPERSIZE bytes
+ *   inodes   one record per inode, inode n at index n - 1; 1 is the root
+ *   dirents  each directory's entries in one run, sorted by name hash
+ *   strings  the entry names, not terminated
+ *   data     each file's (or symlink's) contents in one extent; extents
+ *            of UNIXFS_FLAT_ALIGN bytes or more start on such a boundary
+ *
+ * Numbers are in the byte order of the host that wrote the image; the other
+ * byte order is refused rather than swapped.
+ */
+
+#define UNIXFS_FLAT_MAGIC     "UFSFLAT1"
+#define UNIXFS_FLAT_BYTEORDER 0x01020304U
+#define UNIXFS_FLAT_SUPERSIZE 512
+#define UNIXFS_FLAT_ALIGN     4096
+
+struct unixfs_flat_super {
+    char     f_magic[8];
+    uint32_t f_byteorder;
+    uint32_t f_namemax;
+    uint64_t f_ninodes;
+    uint64_t f_inodes;     /* image offsets, these and below */
+    uint64_t f_ndirents;
+    uint64_t f_dirents;
+    uint64_t f_strings;
+    uint64_t f_stringsize;
+    uint64_t f_data;
+    uint64_t f_datasize;
+    char     f_fsname[UNIXFS_MNAMELEN];    /* of the original */
+    char     f_volname[UNIXFS_MAXNAMLEN];
+};
+
+struct unixfs_flat_inode {
+    uint32_t i_mode;
+    uint32_t i_nlink;
+    uint32_t i_uid;
+    uint32_t i_gid;
+    uint32_t i_rdev;
+    uint32_t i_nentries; /* directories */
+    uint64_t i_size;
+    uint64_t i_data;     /* image offset; directories: first entry */
+    int64_t  i_atime;
+    int64_t  i_mtime;
+    int64_t  i_ctime;
+};
+
+struct unixfs_flat_dirent {
+    uint32_t d_hash;
+    uint32_t d_ino;
+    uint32_t d_namelen;
+    uint32_t d_name;     /* string table offset */
+};
+
+/* FNV-1a */
+static inline uint32_t
+unixfs_flat_hash(const char* name, size_t len)
+{
+    uint32_t h = 0x811c9dc5U;
+
+    while (len--)
+        h = (h ^ (unsigned char)*name++) * 0x01000193U;
+
+    return h;
+}
+
+int unixfs_flatten(struct unixfs* fs, const char* path);
+
+#endif /* _UNIXFS_FLAT_H_ */
@@ -0,0 +1,940 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#if __linux__
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+
+#include "unixfs.h"
+#include "unixfs_image.h"
+#include "unixfs_pcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if __linux__
+#include <darwin/queue.h>
+#else
+#include <sys/queue.h>
+#endif
+
+#if UNIXFS_IMAGE_ZSTD
+#include <zstd.h>
+#endif
+#if UNIXFS_IMAGE_XZ
+#include <lzma.h>
+#endif
+#if UNIXFS_IMAGE_URING
+#include <liburing.h>
+#endif
+
+#define IMAGE_RAW  0
+#define IMAGE_ZSTD 1
+#define IMAGE_XZ   2
+
+#define ZSTD_SEEKTABLE_MAGIC 0x184D2A5EU /* skippable frame holding the table */
+#define ZSTD_SEEKABLE_MAGIC  0x8F92EAB1U
+
+struct image_frame {
+    off_t    cofs; /* compressed offset */
+    off_t    uofs; /* decompressed offset */
+    uint32_t csize;
+    uint32_t usize;
+};
+
+struct image_cached {
+    int            frame; /* -1 if the slot is free */
+    uint64_t       lastuse;
+    unsigned char* data;
+};
+
+struct unixfs_image {
+    int                 fd;
+    int                 format;
+    off_t               size; /* decompressed */
+    uint32_t            nframes;
+    struct image_frame* frames;
+    int                 check; /* xz integrity check type */
+    pthread_mutex_t     lock;
+    uint64_t            clock;
+    struct image_cached cache[UNIXFS_IMAGE_NCACHE];
+};
+
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct unixfs_image* images[UNIXFS_IMAGE_MAX];
+static int nimages = 0;
+
+static int image_direct = 0;
+static int direct_fds[UNIXFS_IMAGE_MAX]; /* plain images read with O_DIRECT */
+static int ndirect = 0;
+
+static inline uint32_t
+image_le32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static struct unixfs_image*
+image_lookup(int fd)
+{
+    int i;
+
+    if (!nimages)
+        return NULL;
+
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++)
+        if (images[i] && (images[i]->fd == fd))
+            return images[i];
+
+    return NULL;
+}
+
+static int
+image_isdirect(int fd)
+{
+    int i;
+
+    if (!ndirect)
+        return 0;
+
+    for (i = 0; i < ndirect; i++)
+        if (direct_fds[i] == fd)
+            return 1;
+
+    return 0;
+}
+
+static void
+image_setdirect(int fd)
+{
+#if __APPLE__
+    if (fcntl(fd, F_NOCACHE, 1) == -1)
+        fprintf(stderr, "*** warning: image will go through the buffer cache\n");
+#elif defined(O_DIRECT)
+    int fl = fcntl(fd, F_GETFL);
+    if ((fl == -1) || (fcntl(fd, F_SETFL, fl | O_DIRECT) == -1)) {
+        fprintf(stderr, "*** warning: image will go through the buffer cache\n");
+        return;
+    }
+    pthread_mutex_lock(&images_lock);
+    direct_fds[ndirect++] = fd; /* one per open image at most */
+    pthread_mutex_unlock(&images_lock);
+#else
+    fprintf(stderr, "*** warning: image will go through the buffer cache\n");
+#endif
+}
+
+static ssize_t
+image_pread_direct(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    const size_t align = UNIXFS_IMAGE_ALIGN;
+
+    if ((((uintptr_t)buf | (uintptr_t)nbyte | (uintptr_t)offset) &
+         (align - 1)) == 0)
+        return pread(fd, buf, nbyte, offset);
+
+    off_t start = offset & ~(off_t)(align - 1);
+    size_t head = (size_t)(offset - start);
+    size_t span = (head + nbyte + align - 1) & ~(align - 1);
+    void* bounce;
+
+    if (posix_memalign(&bounce, align, span) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t ret = pread(fd, bounce, span, start);
+    if (ret > (ssize_t)head) {
+        ret = min((size_t)ret - head, nbyte);
+        memcpy(buf, (char*)bounce + head, ret);
+    } else if (ret > 0) {
+        ret = 0;
+    }
+
+    free(bounce);
+
+    return ret;
+}
+
+#if UNIXFS_IMAGE_ZSTD || UNIXFS_IMAGE_XZ
+
+static int
+image_addframe(struct unixfs_image* img, uint32_t* maxframes, off_t cofs,
+               uint64_t csize, uint64_t usize)
+{
+    if ((csize > UNIXFS_IMAGE_MAXFRAME) || (usize > UNIXFS_IMAGE_MAXFRAME)) {
+        fprintf(stderr, "*** error: compressed frame too large (%llu bytes)\n",
+                (unsigned long long)max(csize, usize));
+        return EFBIG;
+    }
+
+    if (!usize) /* nothing to find in here */
+        return 0;
+
+    if (img->nframes == *maxframes) {
+        uint32_t newmax = *maxframes ? *maxframes * 2 : 256;
+        struct image_frame* newframes =
+            realloc(img->frames, newmax * sizeof(struct image_frame));
+        if (!newframes)
+            return ENOMEM;
+        img->frames = newframes;
+        *maxframes = newmax;
+    }
+
+    struct image_frame* f = &img->frames[img->nframes++];
+    f->cofs = cofs;
+    f->uofs = img->size;
+    f->csize = (uint32_t)csize;
+    f->usize = (uint32_t)usize;
+
+    img->size += usize;
+
+    return 0;
+}
+
+#endif /* UNIXFS_IMAGE_ZSTD || UNIXFS_IMAGE_XZ */
+
+#if UNIXFS_IMAGE_ZSTD
+
+static int
+image_zstd_open(struct unixfs_image* img, off_t fsize)
+{
+    unsigned char foot[9];
+
+    if ((fsize < 17) || (pread(img->fd, foot, 9, fsize - 9) != 9) ||
+        (image_le32(foot + 5) != ZSTD_SEEKABLE_MAGIC) || (foot[4] & 0x7c)) {
+        fprintf(stderr, "*** error: zstd image has no seek table; "
+                "recompress it in the seekable format\n");
+        return EINVAL;
+    }
+
+    uint32_t n = image_le32(foot);
+    size_t esize = (foot[4] & 0x80) ? 12 : 8;
+    off_t tablesize = (off_t)n * esize;
+    off_t tableofs = fsize - 9 - tablesize;
+
+    if (tableofs < 8)
+        return EINVAL;
+
+    unsigned char* table = malloc(tablesize + 8);
+    if (!table)
+        return ENOMEM;
+
+    int err = EINVAL;
+
+    if ((pread(img->fd, table, tablesize + 8, tableofs - 8) != tablesize + 8) ||
+        (image_le32(table) != ZSTD_SEEKTABLE_MAGIC) ||
+        (image_le32(table + 4) != tablesize + 9))
+        goto out;
+
+    uint32_t i, maxframes = 0;
+    off_t cofs = 0;
+
+    for (i = 0; i < n; i++) {
+        unsigned char* e = table + 8 + i * esize;
+        uint32_t csize = image_le32(e);
+        if ((err = image_addframe(img, &maxframes, cofs, csize,
+                                  image_le32(e + 4))) != 0)
+            goto out;
+        cofs += csize;
+    }
+
+    err = (cofs == tableofs - 8) ? 0 : EINVAL;
+
+out:
+    free(table);
+
+    return err;
+}
+
+static int
+image_zstd_decode(struct unixfs_image* img, struct image_frame* f,
+                  const unsigned char* in, unsigned char* out)
+{
+    size_t ret = ZSTD_decompress(out, f->usize, in, f->csize);
+
+    if (ZSTD_isError(ret) || (ret != f->usize))
+        return EIO;
+
+    return 0;
+}
+
+#endif /* UNIXFS_IMAGE_ZSTD */
+
+#if UNIXFS_IMAGE_XZ
+
+static int
+image_xz_open(struct unixfs_image* img, off_t fsize)
+{
+    unsigned char foot[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags flags;
+    off_t end = fsize;
+
+    /* skip stream padding */
+    for (;;) {
+        if ((end < 2 * LZMA_STREAM_HEADER_SIZE) ||
+            (pread(img->fd, foot, 4, end - 4) != 4))
+            return EINVAL;
+        if (image_le32(foot))
+            break;
+        end -= 4;
+    }
+
+    if ((pread(img->fd, foot, LZMA_STREAM_HEADER_SIZE,
+               end - LZMA_STREAM_HEADER_SIZE) != LZMA_STREAM_HEADER_SIZE) ||
+        (lzma_stream_footer_decode(&flags, foot) != LZMA_OK))
+        return EINVAL;
+
+    off_t indexofs = end - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
+    if (indexofs < LZMA_STREAM_HEADER_SIZE)
+        return EINVAL;
+
+    unsigned char* buf = malloc(flags.backward_size);
+    if (!buf)
+        return ENOMEM;
+
+    int err = EINVAL;
+    lzma_index* idx = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t inpos = 0;
+
+    if ((pread(img->fd, buf, flags.backward_size, indexofs) !=
+         (ssize_t)flags.backward_size) ||
+        (lzma_index_buffer_decode(&idx, &memlimit, NULL, buf, &inpos,
+                                  flags.backward_size) != LZMA_OK))
+        goto out;
+
+    if (lzma_index_file_size(idx) != (lzma_vli)end) {
+        fprintf(stderr, "*** error: multi-stream xz images are not "
+                "supported\n");
+        goto out;
+    }
+
+    img->check = flags.check;
+
+    lzma_index_iter iter;
+    uint32_t maxframes = 0;
+
+    lzma_index_iter_init(&iter, idx);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        if ((err = image_addframe(img, &maxframes,
+                                  iter.block.compressed_file_offset,
+                                  iter.block.total_size,
+                                  iter.block.uncompressed_size)) != 0)
+            goto out;
+    }
+
+    err = 0;
+
+out:
+    if (idx)
+        lzma_index_end(idx, NULL);
+    free(buf);
+
+    return err;
+}
+
+static int
+image_xz_decode(struct unixfs_image* img, struct image_frame* f,
+                const unsigned char* in, unsigned char* out)
+{
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+
+    memset(&block, 0, sizeof(block));
+    block.version = 0;
+    block.check = img->check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(in[0]);
+
+    if ((block.header_size > f->csize) ||
+        (lzma_block_header_decode(&block, NULL, in) != LZMA_OK))
+        return EIO;
+
+    size_t inpos = block.header_size, outpos = 0;
+    lzma_ret ret = lzma_block_buffer_decode(&block, NULL, in, &inpos, f->csize,
+                                            out, &outpos, f->usize);
+
+    int i;
+    for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(filters[i].options);
+
+    if ((ret != LZMA_OK) || (outpos != f->usize))
+        return EIO;
+
+    return 0;
+}
+
+#endif /* UNIXFS_IMAGE_XZ */
+
+static void
+image_free(struct unixfs_image* img)
+{
+    int i;
+
+    for (i = 0; i < UNIXFS_IMAGE_NCACHE; i++)
+        free(img->cache[i].data);
+
+    (void)pthread_mutex_destroy(&img->lock);
+    free(img->frames);
+    free(img);
+}
+
+static int
+image_findframe(struct unixfs_image* img, off_t offset)
+{
+    int lo = 0, hi = (int)img->nframes - 1;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (img->frames[mid].uofs <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+static int
+image_copyframe(struct unixfs_image* img, int frame, size_t offset, char* buf,
+                size_t nbyte)
+{
+    struct image_frame* f = &img->frames[frame];
+    struct image_cached* slot;
+    int i;
+
+    pthread_mutex_lock(&img->lock);
+    for (i = 0; i < UNIXFS_IMAGE_NCACHE; i++) {
+        slot = &img->cache[i];
+        if (slot->frame == frame) {
+            memcpy(buf, slot->data + offset, nbyte);
+            slot->lastuse = ++img->clock;
+            pthread_mutex_unlock(&img->lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&img->lock);
+
+    unsigned char* in = malloc(f->csize);
+    unsigned char* out = malloc(f->usize);
+    int err = ENOMEM;
+
+    if (!in || !out)
+        goto out;
+
+    err = EIO;
+    if (pread(img->fd, in, f->csize, f->cofs) != f->csize)
+        goto out;
+
+    switch (img->format) {
+#if UNIXFS_IMAGE_ZSTD
+    case IMAGE_ZSTD:
+        err = image_zstd_decode(img, f, in, out);
+        break;
+#endif
+#if UNIXFS_IMAGE_XZ
+    case IMAGE_XZ:
+        err = image_xz_decode(img, f, in, out);
+        break;
+#endif
+    }
+
+    if (err) {
+        fprintf(stderr, "*** warning: failed to decompress frame at %llu\n",
+                (unsigned long long)f->cofs);
+        goto out;
+    }
+
+    memcpy(buf, out + offset, nbyte);
+
+    /* keep it, evicting the least recently used frame */
+    pthread_mutex_lock(&img->lock);
+    struct image_cached* victim = &img->cache[0];
+    for (i = 0; i < UNIXFS_IMAGE_NCACHE; i++) {
+        slot = &img->cache[i];
+        if (slot->frame == frame) { /* someone beat us to it */
+            victim = NULL;
+            break;
+        }
+        if (slot->lastuse < victim->lastuse)
+            victim = slot;
+    }
+    if (victim) {
+        free(victim->data);
+        victim->data = out;
+        victim->frame = frame;
+        victim->lastuse = ++img->clock;
+        out = NULL;
+    }
+    pthread_mutex_unlock(&img->lock);
+
+out:
+    free(in);
+    free(out);
+
+    return err;
+}
+
+static ssize_t image_pread(int fd, void* buf, size_t nbyte, off_t offset);
+
+/* a failure only means going without the disk cache */
+static void
+image_attachcache(int fd, const char* path)
+{
+    struct stat stbuf;
+
+    if (unixfs_image_fstat(fd, &stbuf) == 0)
+        (void)unixfs_pcache_attach(fd, path, stbuf.st_size, image_pread);
+}
+
+void
+unixfs_image_direct(int on)
+{
+    image_direct = on;
+}
+
+int
+unixfs_image_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    unsigned char magic[6];
+    int format = IMAGE_RAW;
+
+    if (pread(fd, magic, 6, (off_t)0) == 6) {
+        if ((image_le32(magic) == 0xFD2FB528U) ||
+            ((image_le32(magic) & 0xFFFFFFF0U) == 0x184D2A50U))
+            format = IMAGE_ZSTD;
+        else if (memcmp(magic, "\xFD" "7zXZ\0", 6) == 0)
+            format = IMAGE_XZ;
+    }
+
+    if (format == IMAGE_RAW) {
+        if (image_direct)
+            image_setdirect(fd);
+        image_attachcache(fd, path);
+        return fd;
+    }
+
+    struct stat stbuf;
+    struct unixfs_image* img = NULL;
+    int err = 0, i;
+
+    if (fstat(fd, &stbuf) != 0) {
+        err = errno;
+        goto out;
+    }
+
+    img = calloc(1, sizeof(struct unixfs_image));
+    if (!img) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    img->fd = fd;
+    img->format = format;
+    for (i = 0; i < UNIXFS_IMAGE_NCACHE; i++)
+        img->cache[i].frame = -1;
+    (void)pthread_mutex_init(&img->lock, (const pthread_mutexattr_t*)0);
+
+    switch (format) {
+    case IMAGE_ZSTD:
+#if UNIXFS_IMAGE_ZSTD
+        err = image_zstd_open(img, stbuf.st_size);
+#else
+        fprintf(stderr, "*** error: zstd image support not compiled in\n");
+        err = ENOTSUP;
+#endif
+        break;
+    case IMAGE_XZ:
+#if UNIXFS_IMAGE_XZ
+        err = image_xz_open(img, stbuf.st_size);
+#else
+        fprintf(stderr, "*** error: xz image support not compiled in\n");
+        err = ENOTSUP;
+#endif
+        break;
+    }
+
+    if (err)
+        goto out;
+
+    if (!img->nframes) {
+        fprintf(stderr, "*** error: compressed image is empty\n");
+        err = EINVAL;
+        goto out;
+    }
+
+    pthread_mutex_lock(&images_lock);
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++) {
+        if (!images[i]) {
+            images[i] = img;
+            nimages++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&images_lock);
+
+    if (i == UNIXFS_IMAGE_MAX)
+        err = EMFILE;
+
+out:
+    if (err) {
+        if (img)
+            image_free(img);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    image_attachcache(fd, path);
+
+    return fd;
+}
+
+int
+unixfs_image_close(int fd)
+{
+    int i;
+
+    unixfs_pcache_detach(fd);
+
+    pthread_mutex_lock(&images_lock);
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++) {
+        if (images[i] && (images[i]->fd == fd)) {
+            image_free(images[i]);
+            images[i] = NULL;
+            nimages--;
+            break;
+        }
+    }
+    for (i = 0; i < ndirect; i++) {
+        if (direct_fds[i] == fd) {
+            direct_fds[i] = direct_fds[--ndirect];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&images_lock);
+
+    return close(fd);
+}
+
+int
+unixfs_image_fstat(int fd, struct stat* stbuf)
+{
+    int ret = fstat(fd, stbuf);
+
+    if (ret == 0) {
+        struct unixfs_image* img = image_lookup(fd);
+        if (img)
+            stbuf->st_size = img->size;
+    }
+
+    return ret;
+}
+
+static ssize_t
+image_pread(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    struct unixfs_image* img = image_lookup(fd);
+
+    if (!img)
+        return image_isdirect(fd) ? image_pread_direct(fd, buf, nbyte, offset)
+                                  : pread(fd, buf, nbyte, offset);
+
+    if (offset >= img->size)
+        return 0;
+
+    if (nbyte > (size_t)(img->size - offset))
+        nbyte = (size_t)(img->size - offset);
+
+    size_t done = 0;
+
+    while (done < nbyte) {
+        off_t here = offset + done;
+        int frame = image_findframe(img, here);
+        struct image_frame* f = &img->frames[frame];
+        size_t fofs = (size_t)(here - f->uofs);
+        size_t tomove = min(f->usize - fofs, nbyte - done);
+        int err = image_copyframe(img, frame, fofs, (char*)buf + done, tomove);
+        if (err) {
+            if (done)
+                break;
+            errno = err;
+            return -1;
+        }
+        done += tomove;
+    }
+
+    return (ssize_t)done;
+}
+
+ssize_t
+unixfs_image_pread(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    if (unixfs_pcache_attached(fd))
+        return unixfs_pcache_pread(fd, buf, nbyte, offset);
+
+    return image_pread(fd, buf, nbyte, offset);
+}
+
+/*
+ * Asynchronous reads.
+ */
+
+struct image_aio {
+    TAILQ_ENTRY(image_aio) a_link;
+    int                    a_fd;
+    void*                  a_buf;
+    size_t                 a_nbyte;
+    off_t                  a_offset;
+    unixfs_image_done_t    a_done;
+    void*                  a_arg;
+};
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_idle = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, image_aio) aio_queue = TAILQ_HEAD_INITIALIZER(aio_queue);
+static pthread_t aio_threads[UNIXFS_IMAGE_IOTHREADS];
+static int aio_nthreads = 0;
+static int aio_started = 0;
+static int aio_stopping = 0;
+static long aio_inflight = 0;
+
+#if UNIXFS_IMAGE_URING
+static struct io_uring aio_ring;
+static pthread_t aio_reaper;
+static int aio_ring_up = 0;
+static long aio_ringload = 0;
+#endif
+
+static void
+image_aio_complete(struct image_aio* a, ssize_t ret, int error)
+{
+    a->a_done(a->a_arg, ret, error);
+    free(a);
+
+    pthread_mutex_lock(&aio_lock);
+    if (--aio_inflight == 0)
+        pthread_cond_broadcast(&aio_idle);
+    pthread_mutex_unlock(&aio_lock);
+}
+
+static void*
+image_aio_worker(void* arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&aio_lock);
+        while (TAILQ_EMPTY(&aio_queue) && !aio_stopping)
+            pthread_cond_wait(&aio_cond, &aio_lock);
+        struct image_aio* a = TAILQ_FIRST(&aio_queue);
+        if (a)
+            TAILQ_REMOVE(&aio_queue, a, a_link);
+        pthread_mutex_unlock(&aio_lock);
+
+        if (!a)
+            break;
+
+        ssize_t ret = unixfs_image_pread(a->a_fd, a->a_buf, a->a_nbyte,
+                                         a->a_offset);
+        image_aio_complete(a, ret, (ret < 0) ? errno : 0);
+    }
+
+    return NULL;
+}
+
+#if UNIXFS_IMAGE_URING
+
+static void*
+image_aio_reaper(void* arg)
+{
+    for (;;) {
+        struct io_uring_cqe* cqe;
+
+        if (io_uring_wait_cqe(&aio_ring, &cqe) != 0)
+            continue;
+
+        struct image_aio* a = (struct image_aio*)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&aio_ring, cqe);
+
+        if (!a) /* unixfs_image_async_fini */
+            break;
+
+        pthread_mutex_lock(&aio_lock);
+        aio_ringload--;
+        pthread_mutex_unlock(&aio_lock);
+
+        if (res < 0) {
+            image_aio_complete(a, -1, -res);
+            continue;
+        }
+
+        ssize_t ret = res;
+        if ((ret > 0) && ((size_t)ret < a->a_nbyte)) { /* finish it here */
+            ssize_t more = pread(a->a_fd, (char*)a->a_buf + ret,
+                                 a->a_nbyte - ret, a->a_offset + ret);
+            if (more > 0)
+                ret += more;
+        }
+        image_aio_complete(a, ret, 0);
+    }
+
+    return NULL;
+}
+
+#endif /* UNIXFS_IMAGE_URING */
+
+/* call with aio_lock held */
+static int
+image_aio_start(void)
+{
+    int i;
+
+    if (aio_started)
+        return aio_nthreads ? 0 : EAGAIN;
+
+    aio_started = 1;
+    aio_stopping = 0;
+
+    for (i = 0; i < UNIXFS_IMAGE_IOTHREADS; i++) {
+        if (pthread_create(&aio_threads[i], (const pthread_attr_t*)0,
+                           image_aio_worker, NULL) != 0)
+            break;
+        aio_nthreads++;
+    }
+
+#if UNIXFS_IMAGE_URING
+    if (io_uring_queue_init(UNIXFS_IMAGE_QDEPTH, &aio_ring, 0) == 0) {
+        if (pthread_create(&aio_reaper, (const pthread_attr_t*)0,
+                           image_aio_reaper, NULL) == 0)
+            aio_ring_up = 1;
+        else
+            io_uring_queue_exit(&aio_ring);
+    }
+#endif
+
+    if (!aio_nthreads) {
+        fprintf(stderr, "*** warning: failed to start image I/O threads\n");
+        return EAGAIN;
+    }
+
+    return 0;
+}
+
+int
+unixfs_image_pread_async(int fd, void* buf, size_t nbyte, off_t offset,
+                         unixfs_image_done_t done, void* arg)
+{
+    struct image_aio* a = malloc(sizeof(struct image_aio));
+    if (!a)
+        return ENOMEM;
+
+    a->a_fd = fd;
+    a->a_buf = buf;
+    a->a_nbyte = nbyte;
+    a->a_offset = offset;
+    a->a_done = done;
+    a->a_arg = arg;
+
+    pthread_mutex_lock(&aio_lock);
+
+    int err = aio_stopping ? ESHUTDOWN : image_aio_start();
+    if (err) {
+        pthread_mutex_unlock(&aio_lock);
+        free(a);
+        return err;
+    }
+
+    aio_inflight++;
+
+#if UNIXFS_IMAGE_URING
+    /*
+     * Compressed images need the frame cache, uncached images may need a
+     * bounce buffer, and disk-cached images need the disk cache, so those go
+     * to the threads.
+     */
+    if (aio_ring_up && (aio_ringload < UNIXFS_IMAGE_QDEPTH) &&
+        !image_lookup(fd) && !image_isdirect(fd) &&
+        !unixfs_pcache_attached(fd)) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&aio_ring);
+        if (sqe) {
+            io_uring_prep_read(sqe, fd, buf, nbyte, offset);
+            io_uring_sqe_set_data(sqe, a);
+            if (io_uring_submit(&aio_ring) == 1) {
+                aio_ringload++;
+                pthread_mutex_unlock(&aio_lock);
+                return 0;
+            }
+        }
+    }
+#endif
+
+    TAILQ_INSERT_TAIL(&aio_queue, a, a_link);
+    pthread_cond_signal(&aio_cond);
+
+    pthread_mutex_unlock(&aio_lock);
+
+    return 0;
+}
+
+void
+unixfs_image_async_fini(void)
+{
+    int i;
+
+    pthread_mutex_lock(&aio_lock);
+
+    if (!aio_started) {
+        pthread_mutex_unlock(&aio_lock);
+        return;
+    }
+
+    while (aio_inflight)
+        pthread_cond_wait(&aio_idle, &aio_lock);
+
+    aio_stopping = 1;
+    pthread_cond_broadcast(&aio_cond);
+
+#if UNIXFS_IMAGE_URING
+    if (aio_ring_up) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&aio_ring);
+        if (sqe) {
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, NULL);
+            (void)io_uring_submit(&aio_ring);
+        }
+    }
+#endif
+
+    pthread_mutex_unlock(&aio_lock);
+
+    for (i = 0; i < aio_nthreads; i++)
+        (void)pthread_join(aio_threads[i], NULL);
+
+#if UNIXFS_IMAGE_URING
+    if (aio_ring_up) {
+        (void)pthread_join(aio_reaper, NULL);
+        io_uring_queue_exit(&aio_ring);
+        aio_ring_up = 0;
+    }
+#endif
+
+    pthread_mutex_lock(&aio_lock);
+    aio_nthreads = 0;
+    aio_started = 0;
+    pthread_mutex_unlock(&aio_lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_IMAGE_H_
+#define _UNIXFS_IMAGE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Image sources.
+ *
+ * Disk image backends read their image through these instead of calling
+ * open/fstat/pread/close directly. A plain image goes straight to the file.
+ * A compressed image is accepted if it is made of independently
+ * decompressible frames: seekable zstd (a seek table in a trailing skippable
+ * frame) or xz with multiple blocks. Only the frames covering a request are
+ * decompressed, and a few recently used frames are kept around.
+ *
+ * Compressed formats are compiled in with UNIXFS_IMAGE_ZSTD and
+ * UNIXFS_IMAGE_XZ.
+ *
+ * unixfs_image_pread_async queues a read and returns at once; done is called
+ * from an I/O thread with what pread would have returned (and errno) when
+ * the read finishes. Reads are carried out by a few I/O threads, or, when
+ * built with UNIXFS_IMAGE_URING on Linux, plain images are read through an
+ * io_uring so that many reads can be outstanding at the same time. A nonzero
+ * return means nothing was queued and done will not be called.
+ * unixfs_image_async_fini waits for outstanding reads and stops the threads.
+ *
+ * After unixfs_image_direct(1), plain images are opened so that they bypass
+ * the host's buffer cache (O_DIRECT; F_NOCACHE on Mac OS X). Their data is
+ * then cached only once, in the page cache of the mount. Where O_DIRECT
+ * needs it, a read whose buffer, size or offset is not a multiple of
+ * UNIXFS_IMAGE_ALIGN goes through an aligned bounce buffer.
+ */
+
+#define UNIXFS_IMAGE_MAX      8                  /* open images */
+#define UNIXFS_IMAGE_NCACHE   8                  /* decompressed frames kept */
+#define UNIXFS_IMAGE_MAXFRAME (64 * 1024 * 1024) /* largest frame accepted */
+#define UNIXFS_IMAGE_IOTHREADS 4                 /* async read threads */
+#define UNIXFS_IMAGE_QDEPTH    256               /* io_uring entries */
+#define UNIXFS_IMAGE_ALIGN     4096              /* for uncached images */
+
+typedef void (*unixfs_image_done_t)(void* arg, ssize_t ret, int error);
+
+void    unixfs_image_direct(int on);
+int     unixfs_image_open(const char* path);
+int     unixfs_image_close(int fd);
+int     unixfs_image_fstat(int fd, struct stat* stbuf); /* decompressed size */
+ssize_t unixfs_image_pread(int fd, void* buf, size_t nbyte, off_t offset);
+int     unixfs_image_pread_async(int fd, void* buf, size_t nbyte, off_t offset,
+                                 unixfs_image_done_t done, void* arg);
+void    unixfs_image_async_fini(void);
+
+#endif /* _UNIXFS_IMAGE_H_ */
@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 
 static int desirednodes = 65536;
 static pthread_mutex_t ihash_lock;
@@ -27,6 +29,8 @@ static size_t iprivsize = 0;
 
 static u_long ihash_mask;
 
+static void unixfs_inodelayer_iblockfini(void);
+
 static ihash_head*
 unixfs_inodelayer_firstfromhash(ino_t ino)
 {
@@ -74,6 +78,8 @@ unixfs_inodelayer_init(size_t privsize)
 void
 unixfs_inodelayer_fini(void)
 {
+    unixfs_inodelayer_iblockfini();
+
     if (!UNIXFS_ENABLE_INODEHASH)
         return;
 
@@ -282,3 +288,617 @@ unixfs_inodelayer_dump(unixfs_inodelayer_iterator_t it)
 out:
     pthread_mutex_unlock(&ihash_lock);
 }
+
+static pthread_mutex_t iblock_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iblock {
+    off_t    blkno;
+    size_t   size;
+    uint64_t lastuse;
+    char*    data;
+} iblock_cache[UNIXFS_IBLOCK_NCACHE];
+static uint64_t iblock_clock = 0;
+
+int
+unixfs_inodelayer_ibread(off_t blkno, char* blkbuf, size_t size,
+                         unixfs_inodelayer_bread_t bread)
+{
+    int i, victim = 0;
+
+    pthread_mutex_lock(&iblock_lock);
+    for (i = 0; i < UNIXFS_IBLOCK_NCACHE; i++) {
+        struct iblock* ib = &iblock_cache[i];
+        if (ib->data && ib->blkno == blkno && ib->size == size) {
+            ib->lastuse = ++iblock_clock;
+            memcpy(blkbuf, ib->data, size);
+            pthread_mutex_unlock(&iblock_lock);
+            return 0;
+        }
+        if (ib->lastuse < iblock_cache[victim].lastuse)
+            victim = i;
+    }
+    pthread_mutex_unlock(&iblock_lock);
+
+    int ret = bread(blkno, blkbuf);
+    if (ret != 0)
+        return ret;
+
+    pthread_mutex_lock(&iblock_lock);
+    struct iblock* ib = &iblock_cache[victim];
+    if (ib->size != size) {
+        free(ib->data);
+        ib->data = malloc(size);
+        ib->size = size;
+    }
+    if (ib->data) {
+        memcpy(ib->data, blkbuf, size);
+        ib->blkno = blkno;
+        ib->lastuse = ++iblock_clock;
+    } else
+        ib->size = 0;
+    pthread_mutex_unlock(&iblock_lock);
+
+    return 0;
+}
+
+static void
+unixfs_inodelayer_iblockfini(void)
+{
+    int i;
+
+    pthread_mutex_lock(&iblock_lock);
+    for (i = 0; i < UNIXFS_IBLOCK_NCACHE; i++) {
+        free(iblock_cache[i].data);
+        iblock_cache[i].data = NULL;
+        iblock_cache[i].size = 0;
+        iblock_cache[i].lastuse = 0;
+    }
+    iblock_clock = 0;
+    pthread_mutex_unlock(&iblock_lock);
+}
+
+ssize_t
+unixfs_blocks_pread(struct super_block* sb, struct inode* ip, char* buf,
+                    size_t nbyte, off_t offset, unixfs_bmap_t bmap, int* error)
+{
+    size_t bsize = sb->s_blocksize;
+    size_t nblocks = nbyte / bsize;
+    off_t lbn = offset / bsize;
+    off_t pbn = -1;
+    ssize_t done = 0;
+    size_t i = 0;
+
+    *error = 0;
+
+    while (i < nblocks) {
+        size_t run = 1;
+        off_t next = -1;
+
+        if (pbn < 0) {
+            pbn = bmap(ip, lbn + i, error);
+            if (*error)
+                break;
+        }
+
+        if (pbn == 0) { /* hole */
+            memset(buf + done, 0, bsize);
+        } else {
+            /* extend the run while the next block follows on disk */
+            while (i + run < nblocks) {
+                int err = 0;
+                next = bmap(ip, lbn + i + run, &err);
+                if (err)
+                    next = -1;
+                if (next != pbn + (off_t)run)
+                    break;
+                next = -1;
+                run++;
+            }
+            ssize_t len = run * bsize;
+            if (unixfs_image_pread(sb->s_bdev, buf + done, len,
+                                   pbn * (off_t)bsize) != len) {
+                *error = EIO;
+                break;
+            }
+        }
+
+        done += run * bsize;
+        i += run;
+        pbn = next;
+    }
+
+    if ((done == 0) && *error)
+        return -1;
+
+    return done;
+}
+
+struct blocks_aio {
+    pthread_mutex_t      b_lock;
+    int                  b_pending;
+    size_t               b_good;  /* bytes of the buffer known to be good */
+    int                  b_error;
+    unixfs_pbread_done_t b_done;
+    void*                b_arg;
+};
+
+struct blocks_aio_run {
+    struct blocks_aio* r_aio;
+    char*              r_buf;
+    size_t             r_off;    /* where this run starts in the request */
+    size_t             r_len;
+    char*              r_bounce; /* whole block, for a short last block */
+};
+
+static void
+blocks_aio_settle(struct blocks_aio* b, size_t off, size_t got, size_t len,
+                  int error)
+{
+    pthread_mutex_lock(&b->b_lock);
+    if ((got < len) && (off + got < b->b_good)) {
+        b->b_good = off + got;
+        b->b_error = error;
+    }
+    int last = (--b->b_pending == 0);
+    pthread_mutex_unlock(&b->b_lock);
+
+    if (!last)
+        return;
+
+    ssize_t nread = b->b_good;
+    if ((nread == 0) && b->b_error)
+        nread = -1;
+
+    b->b_done(b->b_arg, nread, b->b_error);
+
+    (void)pthread_mutex_destroy(&b->b_lock);
+    free(b);
+}
+
+static void
+blocks_aio_done(void* arg, ssize_t ret, int error)
+{
+    struct blocks_aio_run* r = (struct blocks_aio_run*)arg;
+    size_t got = (ret > 0) ? min((size_t)ret, r->r_len) : 0;
+
+    if (r->r_bounce) {
+        memcpy(r->r_buf, r->r_bounce, got);
+        free(r->r_bounce);
+    }
+
+    if ((got < r->r_len) && !error)
+        error = (ret < 0) ? EIO : 0; /* a short read is end of image */
+
+    blocks_aio_settle(r->r_aio, r->r_off, got, r->r_len, error);
+
+    free(r);
+}
+
+static void
+blocks_aio_submit(struct super_block* sb, struct blocks_aio* b, char* buf,
+                  size_t off, size_t len, off_t pbn)
+{
+    size_t bsize = sb->s_blocksize;
+    struct blocks_aio_run* r = malloc(sizeof(struct blocks_aio_run));
+
+    pthread_mutex_lock(&b->b_lock);
+    b->b_pending++;
+    pthread_mutex_unlock(&b->b_lock);
+
+    if (r) {
+        r->r_aio = b;
+        r->r_buf = buf;
+        r->r_off = off;
+        r->r_len = len;
+        r->r_bounce = (len < bsize) ? malloc(bsize) : NULL;
+    }
+
+    if (!r || ((len < bsize) && !r->r_bounce)) {
+        free(r);
+        blocks_aio_settle(b, off, 0, len, ENOMEM);
+        return;
+    }
+
+    char* dst = r->r_bounce ? r->r_bounce : buf;
+    size_t want = r->r_bounce ? bsize : len;
+
+    if (unixfs_image_pread_async(sb->s_bdev, dst, want, pbn * (off_t)bsize,
+                                 blocks_aio_done, r) != 0) {
+        ssize_t ret = unixfs_image_pread(sb->s_bdev, dst, want,
+                                         pbn * (off_t)bsize);
+        blocks_aio_done(r, ret, (ret < 0) ? errno : 0);
+    }
+}
+
+int
+unixfs_blocks_pread_async(struct super_block* sb, struct inode* ip, char* buf,
+                          size_t nbyte, off_t offset, unixfs_bmap_t bmap,
+                          unixfs_pbread_done_t done, void* arg)
+{
+    size_t bsize = sb->s_blocksize;
+    size_t nwhole = nbyte / bsize;
+    size_t nblocks = (nbyte + bsize - 1) / bsize;
+    off_t lbn = offset / bsize;
+    off_t pbn = -1;
+    size_t i = 0;
+
+    if (((offset % bsize) != 0) || (nbyte == 0))
+        return EINVAL;
+
+    struct blocks_aio* b = calloc(1, sizeof(struct blocks_aio));
+    if (!b)
+        return ENOMEM;
+
+    (void)pthread_mutex_init(&b->b_lock, (const pthread_mutexattr_t*)0);
+    b->b_pending = 1; /* ours, until everything is queued */
+    b->b_good = nbyte;
+    b->b_done = done;
+    b->b_arg = arg;
+
+    while (i < nblocks) {
+        size_t off = i * bsize;
+        size_t run = 1;
+        off_t next = -1;
+        int error = 0;
+
+        if (pbn < 0) {
+            pbn = bmap(ip, lbn + i, &error);
+            if (error) {
+                pthread_mutex_lock(&b->b_lock);
+                b->b_good = off;
+                b->b_error = error;
+                pthread_mutex_unlock(&b->b_lock);
+                break;
+            }
+        }
+
+        if (pbn == 0) { /* hole */
+            memset(buf + off, 0, min(bsize, nbyte - off));
+        } else {
+            /* a short last block always gets a run of its own */
+            while (i + run < nwhole) {
+                int err = 0;
+                next = bmap(ip, lbn + i + run, &err);
+                if (err)
+                    next = -1;
+                if (next != pbn + (off_t)run)
+                    break;
+                next = -1;
+                run++;
+            }
+            blocks_aio_submit(sb, b, buf + off, off,
+                              min(run * bsize, nbyte - off), pbn);
+        }
+
+        i += run;
+        pbn = next;
+    }
+
+    blocks_aio_settle(b, 0, 0, 0, 0);
+
+    return 0;
+}
+
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    unixfs_background_t fn;
+    void*               arg;
+    pthread_t           thread;
+    int                 state; /* 0 free, 1 queued, 2 running, 3 done inline */
+} background[UNIXFS_BACKGROUND_MAX];
+static int background_started = 0;
+
+static int
+unixfs_background_run(int slot)
+{
+    if (pthread_create(&background[slot].thread, (const pthread_attr_t*)0,
+                       background[slot].fn, background[slot].arg) == 0) {
+        background[slot].state = 2;
+        return 0;
+    }
+
+    fprintf(stderr, "*** warning: running background work synchronously\n");
+    background[slot].state = 3;
+    (void)background[slot].fn(background[slot].arg);
+
+    return -1;
+}
+
+int
+unixfs_background(unixfs_background_t fn, void* arg)
+{
+    int slot;
+
+    pthread_mutex_lock(&background_lock);
+
+    for (slot = 0; slot < UNIXFS_BACKGROUND_MAX; slot++)
+        if (background[slot].state == 0)
+            break;
+
+    if (slot == UNIXFS_BACKGROUND_MAX) {
+        pthread_mutex_unlock(&background_lock);
+        return -1;
+    }
+
+    background[slot].fn = fn;
+    background[slot].arg = arg;
+    background[slot].state = 1;
+
+    if (background_started)
+        (void)unixfs_background_run(slot);
+
+    pthread_mutex_unlock(&background_lock);
+
+    return slot;
+}
+
+void
+unixfs_background_start(void)
+{
+    int slot;
+
+    pthread_mutex_lock(&background_lock);
+    background_started = 1;
+    for (slot = 0; slot < UNIXFS_BACKGROUND_MAX; slot++)
+        if (background[slot].state == 1)
+            (void)unixfs_background_run(slot);
+    pthread_mutex_unlock(&background_lock);
+}
+
+int
+unixfs_background_join(int slot)
+{
+    if ((slot < 0) || (slot >= UNIXFS_BACKGROUND_MAX))
+        return 0;
+
+    pthread_mutex_lock(&background_lock);
+    int state = background[slot].state;
+    background[slot].state = 0;
+    pthread_mutex_unlock(&background_lock);
+
+    if (state == 2)
+        (void)pthread_join(background[slot].thread, NULL);
+
+    return (state >= 2);
+}
+
+static pthread_mutex_t statvfs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t statvfs_thread;
+static int statvfs_state = 0; /* 0 idle, 1 deferred, 2 running */
+static struct super_block* statvfs_sb = NULL;
+static unixfs_statvfs_counter_t statvfs_counter = NULL;
+
+static void*
+unixfs_statvfs_worker(void* arg)
+{
+    struct statvfs svb;
+
+    pthread_mutex_lock(&statvfs_lock);
+    memcpy(&svb, &statvfs_sb->s_statvfs, sizeof(struct statvfs));
+    pthread_mutex_unlock(&statvfs_lock);
+
+    statvfs_counter(statvfs_sb, &svb);
+
+    pthread_mutex_lock(&statvfs_lock);
+    memcpy(&statvfs_sb->s_statvfs, &svb, sizeof(struct statvfs));
+    pthread_mutex_unlock(&statvfs_lock);
+
+    return NULL;
+}
+
+int
+unixfs_statvfs_defer(struct super_block* sb, unixfs_statvfs_counter_t counter)
+{
+    statvfs_sb = sb;
+    statvfs_counter = counter;
+    statvfs_state = 1;
+
+    return 0;
+}
+
+void
+unixfs_statvfs_start(void)
+{
+    if (statvfs_state != 1)
+        return;
+
+    if (pthread_create(&statvfs_thread, (const pthread_attr_t*)0,
+                       unixfs_statvfs_worker, NULL) == 0) {
+        statvfs_state = 2;
+        return;
+    }
+
+    fprintf(stderr, "*** warning: counting free space synchronously\n");
+    statvfs_state = 0;
+    (void)unixfs_statvfs_worker(NULL);
+}
+
+void
+unixfs_statvfs_get(struct super_block* sb, struct statvfs* svb)
+{
+    pthread_mutex_lock(&statvfs_lock);
+    memcpy(svb, &sb->s_statvfs, sizeof(struct statvfs));
+    pthread_mutex_unlock(&statvfs_lock);
+}
+
+void
+unixfs_statvfs_wait(void)
+{
+    if (statvfs_state == 2)
+        (void)pthread_join(statvfs_thread, NULL);
+    statvfs_state = 0;
+}
+
+struct metaprefetch {
+    struct super_block*   p_sb;
+    struct unixfs_extent* p_ext;
+    int                   p_n;
+};
+
+static int metaprefetch_slot = -1;
+static struct metaprefetch* metaprefetch_arg = NULL;
+static int metaprefetch_stopping = 0; /* relaxed atomic */
+
+static int
+unixfs_metaprefetch_cmp(const void* a, const void* b)
+{
+    off_t x = ((const struct unixfs_extent*)a)->e_offset;
+    off_t y = ((const struct unixfs_extent*)b)->e_offset;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static void*
+unixfs_metaprefetch_worker(void* arg)
+{
+    struct metaprefetch* p = (struct metaprefetch*)arg;
+    char* buf = malloc(UNIXFS_PREFETCH_CHUNK);
+    int i;
+
+    /* in disk order, so the reads are as sequential as the layout allows */
+    qsort(p->p_ext, p->p_n, sizeof(struct unixfs_extent),
+          unixfs_metaprefetch_cmp);
+
+    for (i = 0; buf && (i < p->p_n) &&
+         !__atomic_load_n(&metaprefetch_stopping, __ATOMIC_RELAXED); i++) {
+        off_t offset = p->p_ext[i].e_offset;
+        off_t end = offset + p->p_ext[i].e_length;
+        if ((i > 0) && (offset < p->p_ext[i - 1].e_offset +
+                                 p->p_ext[i - 1].e_length))
+            offset = p->p_ext[i - 1].e_offset + p->p_ext[i - 1].e_length;
+        while ((offset < end) &&
+               !__atomic_load_n(&metaprefetch_stopping, __ATOMIC_RELAXED)) {
+            size_t len = (size_t)min(end - offset, UNIXFS_PREFETCH_CHUNK);
+            if (unixfs_image_pread(p->p_sb->s_bdev, buf, len, offset) <= 0)
+                break;
+            offset += len;
+        }
+    }
+
+    free(buf);
+    free(p->p_ext);
+    free(p);
+
+    return NULL;
+}
+
+int
+unixfs_metaprefetch(struct super_block* sb, struct unixfs_extent* ext, int n)
+{
+    struct metaprefetch* p = malloc(sizeof(struct metaprefetch));
+    if (!p) {
+        free(ext);
+        return ENOMEM;
+    }
+
+    p->p_sb = sb;
+    p->p_ext = ext;
+    p->p_n = n;
+
+    __atomic_store_n(&metaprefetch_stopping, 0, __ATOMIC_RELAXED);
+
+    if ((metaprefetch_slot =
+             unixfs_background(unixfs_metaprefetch_worker, p)) < 0) {
+        free(ext);
+        free(p);
+        return EAGAIN;
+    }
+
+    metaprefetch_arg = p;
+
+    return 0;
+}
+
+void
+unixfs_metaprefetch_stop(void)
+{
+    __atomic_store_n(&metaprefetch_stopping, 1, __ATOMIC_RELAXED);
+    if (!unixfs_background_join(metaprefetch_slot) && metaprefetch_arg) {
+        free(metaprefetch_arg->p_ext); /* never got to run */
+        free(metaprefetch_arg);
+    }
+    metaprefetch_slot = -1;
+    metaprefetch_arg = NULL;
+}
+
+static off_t inline_max = UNIXFS_INLINE_MAX;
+static off_t inline_used = 0;
+
+void
+unixfs_inline_limit(size_t max)
+{
+    inline_max = (off_t)max;
+}
+
+char*
+unixfs_inline_alloc(off_t size)
+{
+    if ((size <= 0) || (size > inline_max) ||
+        (inline_used + size > UNIXFS_INLINE_BUDGET))
+        return NULL;
+
+    char* data = malloc((size_t)size);
+    if (data)
+        inline_used += size;
+
+    return data;
+}
+
+void
+unixfs_inline_free(char* data, off_t size)
+{
+    if (data) {
+        free(data);
+        inline_used -= size;
+    }
+}
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static off_t ra_last = -1;  /* start of the previous member */
+static off_t ra_limit = 0;  /* end of that member or of the window */
+static off_t ra_advised = 0;
+static int   ra_hits = 0;
+
+static void
+unixfs_archive_advise(int fd, off_t offset, off_t length)
+{
+#if __APPLE__
+    struct radvisory ra;
+    ra.ra_offset = offset;
+    ra.ra_count = (int)length;
+    (void)fcntl(fd, F_RDADVISE, &ra);
+#else
+    (void)posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void
+unixfs_archive_readahead(int fd, off_t start, off_t length)
+{
+    off_t end = start + length, from = 0, to = 0;
+
+    if (length <= 0)
+        return;
+
+    pthread_mutex_lock(&ra_lock);
+
+    if ((start >= ra_last) && (start <= ra_limit + UNIXFS_READAHEAD_GAP)) {
+        /* two in a row before anything is advised */
+        if ((++ra_hits >= 2) &&
+            (ra_advised - end < UNIXFS_READAHEAD_WINDOW / 2)) {
+            from = max(ra_advised, end);
+            to = end + UNIXFS_READAHEAD_WINDOW;
+            ra_advised = to;
+        }
+    } else {
+        ra_hits = 0;
+        ra_advised = 0;
+    }
+
+    ra_last = start;
+    ra_limit = max(end, ra_advised);
+
+    pthread_mutex_unlock(&ra_lock);
+
+    if (to > from)
+        unixfs_archive_advise(fd, from, to - from);
+}
@@ -22,6 +22,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <string.h>
+
+#include "unixfs_image.h"
 
 #if __APPLE__
 
@@ -183,6 +186,128 @@ void          unixfs_inodelayer_isucceeded(struct inode* ip);
 void          unixfs_inodelayer_ifailed(struct inode* ip);
 void          unixfs_inodelayer_dump(unixfs_inodelayer_iterator_t);
 
+/*
+ * Inode block cache. On-disk inodes are packed several to a block and a
+ * directory's entries tend to be allocated next to each other, so an iget
+ * that misses the inode hash reads the inode block through here; the next
+ * few siblings then come from memory instead of another read.
+ */
+
+#define UNIXFS_IBLOCK_NCACHE 32
+
+typedef int (*unixfs_inodelayer_bread_t)(off_t blkno, char* blkbuf);
+
+int           unixfs_inodelayer_ibread(off_t blkno, char* blkbuf, size_t size,
+                                       unixfs_inodelayer_bread_t bread);
+
+/*
+ * Whole-block reads. Starting at a block-aligned offset, reads as many whole
+ * blocks as fit in nbyte straight into buf, one image read per physically
+ * contiguous run. A block that bmap maps to 0 is a hole and reads as zeros.
+ * Returns the number of bytes read, or -1 if nothing could be read. Partial
+ * blocks at either end are left to the caller.
+ */
+
+typedef off_t (*unixfs_bmap_t)(struct inode* ip, off_t lblkno, int* error);
+
+ssize_t unixfs_blocks_pread(struct super_block* sb, struct inode* ip,
+                            char* buf, size_t nbyte, off_t offset,
+                            unixfs_bmap_t bmap, int* error);
+
+/*
+ * The same, but the image reads are queued with unixfs_image_pread_async and
+ * done is called once the last of them completes. Only the block map is
+ * walked by the caller. A short last block is read whole into a bounce
+ * buffer. Returns nonzero, without calling done, if offset is not
+ * block-aligned.
+ */
+
+int     unixfs_blocks_pread_async(struct super_block* sb, struct inode* ip,
+                                  char* buf, size_t nbyte, off_t offset,
+                                  unixfs_bmap_t bmap,
+                                  unixfs_pbread_done_t done, void* arg);
+
+/*
+ * Background work. Threads created before the daemon forks would not make it
+ * into the child, so backends queue their background work here during init
+ * and unixfs_background_start runs it once the file system is mounted. If a
+ * thread cannot be created, the work runs synchronously instead.
+ * unixfs_background_join returns nonzero if the work ran at all.
+ */
+
+#define UNIXFS_BACKGROUND_MAX 4
+
+typedef void* (*unixfs_background_t)(void*);
+
+int  unixfs_background(unixfs_background_t fn, void* arg);
+int  unixfs_background_join(int slot);
+
+/*
+ * Metadata prefetch (--prefetch-meta). A backend lists the image regions
+ * that hold its metadata (inode tables, maps); once mounted, they are read
+ * through sequentially in large chunks so that the host's buffer cache has
+ * them before the first tree walk asks for them one block at a time. The
+ * extent array must be malloc'd and is freed when the reader is done.
+ */
+
+#define UNIXFS_PREFETCH_CHUNK (1024 * 1024)
+
+struct unixfs_extent {
+    off_t e_offset; /* bytes into the image */
+    off_t e_length;
+};
+
+int  unixfs_metaprefetch(struct super_block* sb, struct unixfs_extent* ext,
+                         int n);
+void unixfs_metaprefetch_stop(void);
+
+/*
+ * Inline member data. While an archive backend (tar, cpio) indexes the
+ * archive, it keeps the contents of members no larger than the inline limit
+ * (--inline-max) in memory, up to UNIXFS_INLINE_BUDGET bytes in all, so that
+ * reading them later costs no image I/O. unixfs_inline_alloc returns NULL if
+ * a member of the given size is not to be inlined.
+ */
+
+#define UNIXFS_INLINE_MAX    2048
+#define UNIXFS_INLINE_BUDGET (64 * 1024 * 1024)
+
+char* unixfs_inline_alloc(off_t size);
+void  unixfs_inline_free(char* data, off_t size);
+
+/*
+ * Archive-order readahead. The members of a tape or archive are stored one
+ * after another, and tools that walk the tree (tar c, rsync, grep -r) read
+ * them in nearly that order. A backend reports each member's byte range in
+ * the image as a read of it begins. While members keep starting after the
+ * previous one, no more than UNIXFS_READAHEAD_GAP past its end (headers,
+ * members nobody read) or inside the range already advised, the advised
+ * window is pushed UNIXFS_READAHEAD_WINDOW bytes past the current member,
+ * so the host streams the next members in with large reads. A member that
+ * starts anywhere else resets the window, and nothing more is advised
+ * until the archive order shows up again.
+ */
+
+#define UNIXFS_READAHEAD_WINDOW (4 * 1024 * 1024)
+#define UNIXFS_READAHEAD_GAP    (64 * 1024)
+
+void unixfs_archive_readahead(int fd, off_t start, off_t length);
+
+/*
+ * Deferred statvfs. Counting free blocks and inodes can mean walking a free
+ * list or the whole i-list, so a backend can have the counter run in the
+ * background. Until it is done, statvfs returns whatever the backend put in
+ * s_statvfs up front (typically the super block's summary fields). The
+ * counter only starts when unixfs_statvfs_start is called after the daemon
+ * has forked; a thread created during init would not survive the fork.
+ */
+
+typedef void (*unixfs_statvfs_counter_t)(struct super_block*, struct statvfs*);
+
+int  unixfs_statvfs_defer(struct super_block* sb, unixfs_statvfs_counter_t);
+void unixfs_statvfs_get(struct super_block* sb, struct statvfs* svb);
+void unixfs_statvfs_wait(void);
+
 /* Byte Swappers */
 
 #define cpu_to_le32(x) OSSwapHostToLittleInt32(x)
@@ -206,9 +331,9 @@ static inline uint64_t
 fs64_to_host(fs_endian_t e, uint64_t x)
 {
     if (e == UNIXFS_FS_BIG)
-        return OSSwapLittleToHostInt64(x);
-    else
         return OSSwapBigToHostInt64(x);
+    else
+        return OSSwapLittleToHostInt64(x);
 }
 
 static inline uint32_t
@@ -231,4 +356,76 @@ fs16_to_host(fs_endian_t e, uint16_t x)
         return OSSwapBigToHostInt16(x);
 }
 
+/*
+ * Bulk swappers for on-disk arrays (free lists, block address lists,
+ * indirect blocks). One variant is generated per byte order, so the
+ * endianness test happens once per array rather than once per element and
+ * the per-order loops are plain enough for the compiler to vectorize. The
+ * source need not be aligned (most on-disk structures here are packed), and
+ * it may be the same as the destination.
+ */
+
+#define UNIXFS_FS_ARRAY(bits, order, swap)                                   \
+static inline void                                                           \
+fs##bits##_to_host_array_##order(void* dst, const void* src, size_t n)       \
+{                                                                            \
+    const uint8_t* s = (const uint8_t*)src;                                  \
+    uint8_t* d = (uint8_t*)dst;                                              \
+    size_t i;                                                                \
+    for (i = 0; i < n; i++) {                                                \
+        uint##bits##_t x;                                                    \
+        memcpy(&x, s + i * sizeof(x), sizeof(x));                            \
+        x = swap(x);                                                         \
+        memcpy(d + i * sizeof(x), &x, sizeof(x));                            \
+    }                                                                        \
+}
+
+UNIXFS_FS_ARRAY(16, le,  OSSwapLittleToHostInt16)
+UNIXFS_FS_ARRAY(16, be,  OSSwapBigToHostInt16)
+UNIXFS_FS_ARRAY(32, le,  OSSwapLittleToHostInt32)
+UNIXFS_FS_ARRAY(32, be,  OSSwapBigToHostInt32)
+UNIXFS_FS_ARRAY(32, pdp, pdp11_to_host)
+
+#undef UNIXFS_FS_ARRAY
+
+static inline void
+fs32_to_host_array(fs_endian_t e, void* dst, const void* src, size_t n)
+{
+    if (e == UNIXFS_FS_PDP)
+        fs32_to_host_array_pdp(dst, src, n);
+    else if (e == UNIXFS_FS_LITTLE)
+        fs32_to_host_array_le(dst, src, n);
+    else
+        fs32_to_host_array_be(dst, src, n);
+}
+
+static inline void
+fs16_to_host_array(fs_endian_t e, void* dst, const void* src, size_t n)
+{
+    if (e != UNIXFS_FS_BIG)
+        fs16_to_host_array_le(dst, src, n);
+    else
+        fs16_to_host_array_be(dst, src, n);
+}
+
+/*
+ * Per-byte-order decoders for whole on-disk structures (dinodes, directory
+ * entries). A backend writes its decoder once, as a macro of (order, e), and
+ * expands it through UNIXFS_FS_VARIANTS. The byte order is a constant in each
+ * expansion, so the tests in fs*_to_host fold away and each variant is
+ * straight-line loads and swaps. UNIXFS_FS_PICK chooses the variant for the
+ * mount's byte order; backends do that once, in init, and call through the
+ * pointer from then on.
+ */
+
+#define UNIXFS_FS_VARIANTS(decoder) \
+    decoder(pdp, UNIXFS_FS_PDP)     \
+    decoder(le,  UNIXFS_FS_LITTLE)  \
+    decoder(be,  UNIXFS_FS_BIG)
+
+#define UNIXFS_FS_PICK(e, name)                \
+    (((e) == UNIXFS_FS_PDP)    ? name##_pdp :  \
+     ((e) == UNIXFS_FS_LITTLE) ? name##_le  :  \
+                                 name##_be)
+
 #endif /* _UNIXFS_INTERNAL_H_ */
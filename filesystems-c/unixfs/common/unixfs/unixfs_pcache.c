@@ -0,0 +1,623 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#include "unixfs.h"
+#include "unixfs_image.h"
+#include "unixfs_pcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define PCACHE_MAGIC   "UFSPC001"
+#define PCACHE_RUN     32 /* blocks read from the image at once on a miss */
+#define PCACHE_NAMEMAX 16 /* room for "/index.tmp" after the directory */
+
+struct pcache_slot {
+    off_t    s_blkno; /* -1: free */
+    int32_t  s_hnext; /* hash chain */
+    int32_t  s_prev;  /* toward the MRU end */
+    int32_t  s_next;  /* toward the LRU end */
+    uint32_t s_gen;   /* bumped whenever the slot is emptied */
+};
+
+struct pcache {
+    int                  p_fd;   /* the image */
+    int                  p_cfd;  /* blocks */
+    int                  p_dfd;  /* the directory, locked */
+    char                 p_dir[UNIXFS_MAXPATHLEN - PCACHE_NAMEMAX];
+    off_t                p_size;
+    unixfs_pcache_fill_t p_fill;
+    pthread_mutex_t      p_lock;
+    uint32_t             p_nslots;
+    uint32_t             p_hmask;
+    int32_t*             p_hash;
+    struct pcache_slot*  p_slot;
+    int32_t              p_mru;
+    int32_t              p_lru;
+    uint64_t             p_hits;
+    uint64_t             p_misses;
+};
+
+struct pcache_ihdr {
+    char     i_magic[8];
+    uint32_t i_count;
+    uint32_t i_blocksize;
+};
+
+struct pcache_ient {
+    int64_t  i_blkno;
+    uint32_t i_slot;
+    uint32_t i_pad;
+};
+
+static char* pcache_dir = NULL;
+static off_t pcache_limit = UNIXFS_PCACHE_SIZE;
+
+static pthread_mutex_t pcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pcache* pcaches[UNIXFS_IMAGE_MAX];
+static int npcaches = 0;
+
+static uint64_t
+pcache_fnv(uint64_t h, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)data;
+
+    while (len--)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+
+    return h;
+}
+
+static struct pcache*
+pcache_lookup(int fd)
+{
+    int i;
+
+    if (!npcaches)
+        return NULL;
+
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++)
+        if (pcaches[i] && (pcaches[i]->p_fd == fd))
+            return pcaches[i];
+
+    return NULL;
+}
+
+static void
+pcache_path(struct pcache* p, const char* name, char* path)
+{
+    snprintf(path, UNIXFS_MAXPATHLEN, "%s/%s", p->p_dir, name);
+}
+
+/* LRU list and hash; called with p_lock held */
+
+static void
+pcache_unlink(struct pcache* p, int32_t s)
+{
+    struct pcache_slot* sp = &p->p_slot[s];
+
+    if (sp->s_prev >= 0)
+        p->p_slot[sp->s_prev].s_next = sp->s_next;
+    else
+        p->p_mru = sp->s_next;
+    if (sp->s_next >= 0)
+        p->p_slot[sp->s_next].s_prev = sp->s_prev;
+    else
+        p->p_lru = sp->s_prev;
+}
+
+static void
+pcache_pushmru(struct pcache* p, int32_t s)
+{
+    struct pcache_slot* sp = &p->p_slot[s];
+
+    sp->s_prev = -1;
+    sp->s_next = p->p_mru;
+    if (p->p_mru >= 0)
+        p->p_slot[p->p_mru].s_prev = s;
+    else
+        p->p_lru = s;
+    p->p_mru = s;
+}
+
+static void
+pcache_pushlru(struct pcache* p, int32_t s)
+{
+    struct pcache_slot* sp = &p->p_slot[s];
+
+    sp->s_next = -1;
+    sp->s_prev = p->p_lru;
+    if (p->p_lru >= 0)
+        p->p_slot[p->p_lru].s_next = s;
+    else
+        p->p_mru = s;
+    p->p_lru = s;
+}
+
+static int32_t*
+pcache_bucket(struct pcache* p, off_t blkno)
+{
+    uint64_t h = (uint64_t)blkno * 0x9e3779b97f4a7c15ULL;
+    return &p->p_hash[(h >> 32) & p->p_hmask];
+}
+
+static int32_t
+pcache_find(struct pcache* p, off_t blkno)
+{
+    int32_t s = *pcache_bucket(p, blkno);
+
+    while ((s >= 0) && (p->p_slot[s].s_blkno != blkno))
+        s = p->p_slot[s].s_hnext;
+
+    return s;
+}
+
+static void
+pcache_hremove(struct pcache* p, int32_t s)
+{
+    int32_t* sp = pcache_bucket(p, p->p_slot[s].s_blkno);
+
+    while (*sp != s)
+        sp = &p->p_slot[*sp].s_hnext;
+    *sp = p->p_slot[s].s_hnext;
+}
+
+static void
+pcache_assign(struct pcache* p, int32_t s, off_t blkno)
+{
+    int32_t* bp = pcache_bucket(p, blkno);
+
+    p->p_slot[s].s_blkno = blkno;
+    p->p_slot[s].s_hnext = *bp;
+    *bp = s;
+    pcache_unlink(p, s);
+    pcache_pushmru(p, s);
+}
+
+static void
+pcache_release(struct pcache* p, int32_t s)
+{
+    if (p->p_slot[s].s_blkno >= 0)
+        pcache_hremove(p, s);
+    p->p_slot[s].s_blkno = -1;
+    p->p_slot[s].s_gen++;
+    pcache_unlink(p, s);
+    pcache_pushlru(p, s);
+}
+
+/* the least recently used slot, emptied */
+static int32_t
+pcache_victim(struct pcache* p)
+{
+    int32_t s = p->p_lru;
+
+    pcache_release(p, s);
+
+    return s;
+}
+
+static void
+pcache_loadindex(struct pcache* p)
+{
+    char path[UNIXFS_MAXPATHLEN];
+    struct pcache_ihdr hdr;
+    struct pcache_ient* ents = NULL;
+
+    pcache_path(p, "index", path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+        memcmp(hdr.i_magic, PCACHE_MAGIC, sizeof(hdr.i_magic)) ||
+        (hdr.i_blocksize != UNIXFS_PCACHE_BLOCK))
+        goto out;
+
+    size_t len = (size_t)hdr.i_count * sizeof(struct pcache_ient);
+    if (!(ents = malloc(len ? len : 1)) ||
+        (read(fd, ents, len) != (ssize_t)len))
+        goto out;
+
+    /* LRU first, so that the MRU ends up in front again */
+    uint32_t i = hdr.i_count;
+    while (i-- > 0) {
+        struct pcache_ient* e = &ents[i];
+        if ((e->i_slot >= p->p_nslots) || (e->i_blkno < 0) ||
+            (e->i_blkno * UNIXFS_PCACHE_BLOCK >= p->p_size) ||
+            (p->p_slot[e->i_slot].s_blkno >= 0) ||
+            (pcache_find(p, e->i_blkno) >= 0))
+            continue;
+        pcache_assign(p, (int32_t)e->i_slot, e->i_blkno);
+    }
+
+out:
+    free(ents);
+    close(fd);
+    (void)unlink(path); /* slots get reused from here on */
+}
+
+static void
+pcache_saveindex(struct pcache* p)
+{
+    char path[UNIXFS_MAXPATHLEN], tmp[UNIXFS_MAXPATHLEN];
+    struct pcache_ihdr hdr;
+    struct pcache_ient e;
+    int32_t s;
+
+    pcache_path(p, "index", path);
+    pcache_path(p, "index.tmp", tmp);
+
+    FILE* fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.i_magic, PCACHE_MAGIC, sizeof(hdr.i_magic));
+    hdr.i_blocksize = UNIXFS_PCACHE_BLOCK;
+    for (s = p->p_mru; s >= 0; s = p->p_slot[s].s_next)
+        if (p->p_slot[s].s_blkno >= 0)
+            hdr.i_count++;
+
+    int ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1);
+
+    memset(&e, 0, sizeof(e));
+    for (s = p->p_mru; ok && (s >= 0); s = p->p_slot[s].s_next) {
+        if (p->p_slot[s].s_blkno < 0)
+            continue;
+        e.i_blkno = p->p_slot[s].s_blkno;
+        e.i_slot = (uint32_t)s;
+        ok = (fwrite(&e, sizeof(e), 1, fp) == 1);
+    }
+
+    if ((fclose(fp) != 0) || !ok || (fsync(p->p_cfd) != 0) ||
+        (rename(tmp, path) != 0)) {
+        fprintf(stderr, "*** warning: could not save the disk cache index\n");
+        (void)unlink(tmp);
+    }
+}
+
+/*
+ * Returns nonzero if the cached blocks are for the image as it is now.
+ * Otherwise, rewrites the description and throws the blocks away.
+ */
+static int
+pcache_validate(struct pcache* p)
+{
+    char path[UNIXFS_MAXPATHLEN], want[256], have[256];
+    char blk[UNIXFS_PCACHE_BLOCK];
+    struct stat stbuf;
+    uint64_t sum = 0xcbf29ce484222325ULL;
+    ssize_t n;
+
+    if (fstat(p->p_fd, &stbuf) != 0)
+        return 0;
+
+    if ((n = p->p_fill(p->p_fd, blk, sizeof(blk), (off_t)0)) > 0)
+        sum = pcache_fnv(sum, blk, n);
+    if (p->p_size > UNIXFS_PCACHE_BLOCK) {
+        off_t last = (p->p_size - 1) & ~(off_t)(UNIXFS_PCACHE_BLOCK - 1);
+        if ((n = p->p_fill(p->p_fd, blk, sizeof(blk), last)) > 0)
+            sum = pcache_fnv(sum, blk, n);
+    }
+
+    snprintf(want, sizeof(want),
+             "unixfs disk cache\nsize %lld\nmtime %lld\nsum %016llx\n",
+             (long long)p->p_size, (long long)stbuf.st_mtime,
+             (unsigned long long)sum);
+
+    pcache_path(p, "image", path);
+
+    memset(have, 0, sizeof(have));
+    FILE* fp = fopen(path, "r");
+    if (fp) {
+        size_t len = fread(have, 1, sizeof(have) - 1, fp);
+        have[len] = '\0';
+        fclose(fp);
+        if (strcmp(have, want) == 0)
+            return 1;
+    }
+
+    pcache_path(p, "index", path);
+    (void)unlink(path);
+    pcache_path(p, "blocks", path);
+    (void)unlink(path);
+
+    pcache_path(p, "image", path);
+    if ((fp = fopen(path, "w")) != NULL) {
+        fputs(want, fp);
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+void
+unixfs_pcache_config(const char* dir, off_t limit)
+{
+    free(pcache_dir);
+    pcache_dir = dir ? strdup(dir) : NULL;
+    pcache_limit = (limit > 0) ? limit : UNIXFS_PCACHE_SIZE;
+}
+
+int
+unixfs_pcache_attach(int fd, const char* path, off_t size,
+                     unixfs_pcache_fill_t fill)
+{
+    if (!pcache_dir)
+        return 0;
+
+    char real[PATH_MAX];
+    char blocks[UNIXFS_MAXPATHLEN];
+    uint32_t nslots = (uint32_t)min(pcache_limit / UNIXFS_PCACHE_BLOCK,
+                                    (off_t)INT32_MAX);
+    uint32_t i, nbuckets;
+    int err = 0;
+
+    if (!nslots)
+        return EINVAL;
+
+    if (!realpath(path, real))
+        snprintf(real, sizeof(real), "%s", path);
+
+    struct pcache* p = calloc(1, sizeof(struct pcache));
+    if (!p)
+        return ENOMEM;
+
+    p->p_fd = fd;
+    p->p_cfd = -1;
+    p->p_dfd = -1;
+    p->p_size = size;
+    p->p_fill = fill;
+    p->p_nslots = nslots;
+    p->p_mru = p->p_lru = -1;
+    if (snprintf(p->p_dir, sizeof(p->p_dir), "%s/%016llx", pcache_dir,
+                 (unsigned long long)pcache_fnv(0xcbf29ce484222325ULL, real,
+                                                strlen(real))) >=
+        (int)sizeof(p->p_dir)) {
+        err = ENAMETOOLONG;
+        goto out;
+    }
+
+    for (nbuckets = 1; nbuckets < nslots; nbuckets <<= 1)
+        continue;
+    p->p_hmask = nbuckets - 1;
+
+    p->p_slot = malloc(nslots * sizeof(struct pcache_slot));
+    p->p_hash = malloc(nbuckets * sizeof(int32_t));
+    if (!p->p_slot || !p->p_hash) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    memset(p->p_hash, 0xff, nbuckets * sizeof(int32_t));
+    for (i = 0; i < nslots; i++) {
+        p->p_slot[i].s_blkno = -1;
+        p->p_slot[i].s_hnext = -1;
+        p->p_slot[i].s_gen = 0;
+        pcache_pushlru(p, (int32_t)i);
+    }
+
+    if (((mkdir(pcache_dir, 0755) != 0) && (errno != EEXIST)) ||
+        ((mkdir(p->p_dir, 0755) != 0) && (errno != EEXIST))) {
+        err = errno;
+        goto out;
+    }
+
+    /* one mount per cache directory; any other runs uncached */
+    if ((p->p_dfd = open(p->p_dir, O_RDONLY)) < 0) {
+        err = errno;
+        goto out;
+    }
+    if (flock(p->p_dfd, LOCK_EX | LOCK_NB) != 0) {
+        err = (errno == EWOULDBLOCK) ? EBUSY : errno;
+        goto out;
+    }
+
+    int valid = pcache_validate(p);
+
+    pcache_path(p, "blocks", blocks);
+    if ((p->p_cfd = open(blocks, O_RDWR | O_CREAT, 0644)) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    if (valid)
+        pcache_loadindex(p);
+
+    (void)pthread_mutex_init(&p->p_lock, (const pthread_mutexattr_t*)0);
+
+    pthread_mutex_lock(&pcaches_lock);
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++) {
+        if (!pcaches[i]) {
+            pcaches[i] = p;
+            npcaches++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pcaches_lock);
+
+    if (i == UNIXFS_IMAGE_MAX) {
+        (void)pthread_mutex_destroy(&p->p_lock);
+        err = EMFILE;
+    }
+
+out:
+    if (err) {
+        fprintf(stderr, "*** warning: not using the disk cache (%s)\n",
+                strerror(err));
+        if (p->p_cfd >= 0)
+            close(p->p_cfd);
+        if (p->p_dfd >= 0)
+            close(p->p_dfd);
+        free(p->p_slot);
+        free(p->p_hash);
+        free(p);
+    }
+
+    return err;
+}
+
+void
+unixfs_pcache_detach(int fd)
+{
+    struct pcache* p = NULL;
+    int i;
+
+    pthread_mutex_lock(&pcaches_lock);
+    for (i = 0; i < UNIXFS_IMAGE_MAX; i++) {
+        if (pcaches[i] && (pcaches[i]->p_fd == fd)) {
+            p = pcaches[i];
+            pcaches[i] = NULL;
+            npcaches--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pcaches_lock);
+
+    if (!p)
+        return;
+
+    pcache_saveindex(p);
+
+    if (p->p_hits + p->p_misses)
+        fprintf(stderr, "disk cache: %llu hits, %llu misses\n",
+                (unsigned long long)p->p_hits,
+                (unsigned long long)p->p_misses);
+
+    close(p->p_cfd);
+    close(p->p_dfd);
+    (void)pthread_mutex_destroy(&p->p_lock);
+    free(p->p_slot);
+    free(p->p_hash);
+    free(p);
+}
+
+int
+unixfs_pcache_attached(int fd)
+{
+    return pcache_lookup(fd) != NULL;
+}
+
+ssize_t
+unixfs_pcache_pread(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    struct pcache* p = pcache_lookup(fd);
+    char blk[UNIXFS_PCACHE_BLOCK];
+    size_t done = 0;
+
+    if (!p) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (offset >= p->p_size)
+        return 0;
+
+    if (nbyte > (size_t)(p->p_size - offset))
+        nbyte = (size_t)(p->p_size - offset);
+
+    while (done < nbyte) {
+        off_t here = offset + done;
+        off_t blkno = here / UNIXFS_PCACHE_BLOCK;
+        size_t bofs = (size_t)(here % UNIXFS_PCACHE_BLOCK);
+        size_t tomove = min(UNIXFS_PCACHE_BLOCK - bofs, nbyte - done);
+
+        pthread_mutex_lock(&p->p_lock);
+        int32_t s = pcache_find(p, blkno);
+        uint32_t gen = (s >= 0) ? p->p_slot[s].s_gen : 0;
+        pthread_mutex_unlock(&p->p_lock);
+
+        /*
+         * A hit is read unlocked. The slot may be emptied and refilled
+         * meanwhile, in which case its generation has moved on and the
+         * block counts as a miss.
+         */
+        ssize_t r = (s >= 0) ? pread(p->p_cfd, blk, UNIXFS_PCACHE_BLOCK,
+                                     (off_t)s * UNIXFS_PCACHE_BLOCK) : -1;
+
+        pthread_mutex_lock(&p->p_lock);
+        if ((s >= 0) && (p->p_slot[s].s_gen == gen) &&
+            (p->p_slot[s].s_blkno == blkno)) {
+            if (r == UNIXFS_PCACHE_BLOCK) {
+                pcache_unlink(p, s);
+                pcache_pushmru(p, s);
+                p->p_hits++;
+                pthread_mutex_unlock(&p->p_lock);
+                memcpy((char*)buf + done, blk + bofs, tomove);
+                done += tomove;
+                continue;
+            }
+            pcache_release(p, s);
+        }
+        p->p_misses++;
+        pthread_mutex_unlock(&p->p_lock);
+
+        /* a miss: read ahead through the rest of the request */
+        off_t runstart = blkno * UNIXFS_PCACHE_BLOCK;
+        size_t runlen = min((bofs + (nbyte - done) + UNIXFS_PCACHE_BLOCK - 1) /
+                            UNIXFS_PCACHE_BLOCK, PCACHE_RUN) *
+                        UNIXFS_PCACHE_BLOCK;
+        runlen = min(runlen, (size_t)(p->p_size - runstart));
+
+        char* run = malloc(runlen);
+        if (!run) {
+            errno = ENOMEM;
+            break;
+        }
+
+        ssize_t n = p->p_fill(p->p_fd, run, runlen, runstart);
+        if (n <= (ssize_t)bofs) {
+            free(run);
+            if ((n < 0) && !done)
+                return -1;
+            break;
+        }
+
+        size_t off;
+
+        pthread_mutex_lock(&p->p_lock);
+        for (off = 0; off < (size_t)n; off += UNIXFS_PCACHE_BLOCK) {
+            size_t len = min(UNIXFS_PCACHE_BLOCK, (size_t)n - off);
+            const char* src = run + off;
+            if (len < UNIXFS_PCACHE_BLOCK) {
+                if (runstart + (off_t)(off + len) < p->p_size)
+                    break; /* short read; not the image's last block */
+                memcpy(blk, src, len);
+                memset(blk + len, 0, UNIXFS_PCACHE_BLOCK - len);
+                src = blk;
+            }
+            off_t b = blkno + (off_t)(off / UNIXFS_PCACHE_BLOCK);
+            if (pcache_find(p, b) >= 0)
+                continue;
+            s = pcache_victim(p);
+            if (pwrite(p->p_cfd, src, UNIXFS_PCACHE_BLOCK,
+                       (off_t)s * UNIXFS_PCACHE_BLOCK) == UNIXFS_PCACHE_BLOCK)
+                pcache_assign(p, s, b);
+        }
+        pthread_mutex_unlock(&p->p_lock);
+
+        size_t copy = min((size_t)n - bofs, nbyte - done);
+        memcpy((char*)buf + done, run + bofs, copy);
+        done += copy;
+        free(run);
+
+        if ((size_t)n < runlen)
+            break;
+    }
+
+    return (ssize_t)done;
+}
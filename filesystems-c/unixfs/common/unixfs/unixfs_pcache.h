@@ -0,0 +1,47 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through OSXFUSE.
+ */
+
+#ifndef _UNIXFS_PCACHE_H_
+#define _UNIXFS_PCACHE_H_
+
+#include <sys/types.h>
+
+/*
+ * Persistent read cache (--disk-cache DIR[,BYTES]), for images on slow
+ * media. Image reads go through it in UNIXFS_PCACHE_BLOCK units, which are
+ * kept in DIR, typically on a local SSD, and survive remounts. Each image
+ * gets a subdirectory named after a hash of its real path, holding:
+ *
+ *   image   what the image looked like when cached: size, modification
+ *           time and a checksum of its first and last blocks
+ *   blocks  the cached blocks, in fixed slots
+ *   index   which block is in which slot, in LRU order
+ *
+ * If the image no longer matches on attach, the old blocks are discarded.
+ * The index is read and removed on attach and written back on detach, so a
+ * crash loses the cache contents but never serves stale slots. When full,
+ * the least recently used slot is reused. An image's cache directory is
+ * flock'd while attached; a second mount of the same image runs uncached.
+ *
+ * The image layer attaches and detaches its images, and routes their
+ * reads through unixfs_pcache_pread with the fill function it is given.
+ */
+
+#define UNIXFS_PCACHE_BLOCK 4096
+#define UNIXFS_PCACHE_SIZE  (1024LL * 1024 * 1024) /* default, bytes */
+
+typedef ssize_t (*unixfs_pcache_fill_t)(int fd, void* buf, size_t nbyte,
+                                        off_t offset);
+
+void    unixfs_pcache_config(const char* dir, off_t limit);
+int     unixfs_pcache_attach(int fd, const char* path, off_t size,
+                             unixfs_pcache_fill_t fill);
+void    unixfs_pcache_detach(int fd);
+int     unixfs_pcache_attached(int fd);
+ssize_t unixfs_pcache_pread(int fd, void* buf, size_t nbyte, off_t offset);
+
+#endif /* _UNIXFS_PCACHE_H_ */
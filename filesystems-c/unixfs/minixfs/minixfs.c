@@ -11,6 +11,7 @@
  */
 
 #include "minixfs.h"
+#include "unixfs_bitmap.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -37,37 +38,24 @@ static ino_t         minix_find_entry(struct inode*, const char*);
 extern int           minix_get_block_v1(struct inode*, sector_t, off_t*);
 extern int           minix_get_block_v2(struct inode*, sector_t, off_t*);
 
-static const int nibblemap[] = { 4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0 };
-
 static unsigned long
 count_free(struct buffer_head* map[], unsigned numblocks, __u32 numbits)
 {
-    unsigned i, j, sum = 0;
+    unsigned i;
+    unsigned long sum = 0;
     struct buffer_head* bh;
-  
+
     for (i = 0; i < numblocks - 1; i++) {
         if (!(bh = map[i])) 
             return 0;
-        for (j = 0; j < bh->b_size; j++)
-            sum += nibblemap[bh->b_data[j] & 0xf]
-                + nibblemap[(bh->b_data[j] >> 4) & 0xf];
+        sum += unixfs_bitmap_count_clear(bh->b_data, bh->b_size * 8);
     }
 
     if (numblocks == 0 || !(bh = map[numblocks - 1]))
         return 0;
 
-    i = ((numbits - (numblocks - 1) * bh->b_size * 8) / 16) * 2;
-    for (j = 0; j < i; j++) {
-        sum += nibblemap[bh->b_data[j] & 0xf]
-            + nibblemap[(bh->b_data[j] >> 4) & 0xf];
-    }
-
-    i = numbits % 16;
-    if (i != 0) {
-        i = *(__u16*)(&bh->b_data[j]) | ~((1 << i) - 1);
-        sum += nibblemap[i & 0xf] + nibblemap[(i >> 4) & 0xf];
-        sum += nibblemap[(i >> 8) & 0xf] + nibblemap[(i >> 12) & 0xf];
-    }
+    i = numbits - (numblocks - 1) * bh->b_size * 8; /* bits in last block */
+    sum += unixfs_bitmap_count_clear(bh->b_data, i);
     return(sum);
 }
 
@@ -510,10 +498,11 @@ minixfs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
         return -1;
     n = start;
 
-    if (!dirbuf->flags.initialized || (*offset & ((PAGE_SIZE - 1))) == 0) {
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, (off_t)n << PAGE_CACHE_SHIFT)) {
         int ret = minixfs_get_page(dir, n, dirpagebuf);
         if (ret)
             return ret;
+        dirbuf->base = (off_t)n << PAGE_CACHE_SHIFT;
         dirbuf->flags.initialized = 1;
     }
 
@@ -35,10 +35,27 @@ unixfs_usage(void)
     "%s (version %s): Minix File System for OSXFUSE\n"
     "Amit Singh <http://osxbook.com>\n"
     "usage:\n"
-    "      %s [--force] --dmg DMG MOUNTPOINT [OSXFUSE args...]\n"
+    "      %s [--force] [--immutable] [--prewarm PATHS] --dmg DMG MOUNTPOINT [OSXFUSE args...]\n"
     "where:\n"
     "     . DMG must point to a Minix disk image\n"
-    "     . --force attempts mounting even if there are warnings or errors\n",
+    "     . --force attempts mounting even if there are warnings or errors\n"
+    "     . --immutable lets the kernel cache names, attributes and data\n"
+    "       indefinitely (the image must not change while mounted)\n"
+    "     . --prewarm PATH[:PATH...] pushes the files under those paths into\n"
+    "       the kernel's cache after mounting; --prewarm-budget BYTES caps it\n"
+    "     . --prefetch-meta sequentially reads the image's file system\n"
+    "       metadata (inode tables) in the background after mounting\n"
+    "     . --nocache-image keeps the image out of the host's buffer cache,\n"
+    "       so file data is cached only once, by the mount\n"
+    "     . --workers N hands requests to N worker threads (0: one per CPU),\n"
+    "       serving lookups and attributes ahead of reads and listings\n"
+    "     . --block-cache HOT[,COLD] bounds the block cache in bytes: HOT for\n"
+    "       recently used blocks, COLD for older ones kept compressed\n"
+    "       (default 8 MB and 32 MB; a HOT of 0 turns the cache off)\n"
+    "     . --disk-cache DIR[,BYTES] keeps image blocks in DIR across mounts,\n"
+    "       for images on slow media (default 1 GB per image)\n"
+    "     . --flatten OUT writes the file system out as a flattened image\n"
+    "       instead of mounting it; ancientfs mounts that as type flat\n",
     PROGNAME, PROGVERS, PROGNAME);
 }
 
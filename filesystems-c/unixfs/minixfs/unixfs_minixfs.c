@@ -5,6 +5,7 @@
  */
 
 #include "minixfs.h"
+#define UNIXFS_INTERNAL_PBREAD_ASYNC unixfs_internal_pbread_async
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -18,13 +19,19 @@
 
 DECL_UNIXFS("Minix", minix);
 
+static void
+minixfs_statvfs_count(struct super_block* sb, struct statvfs* svb)
+{
+    (void)minixfs_statvfs(sb, svb);
+}
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +40,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -58,7 +65,13 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     unixfs = sb;
     unixfs->s_flags = flags;
 
-    (void)minixfs_statvfs(sb, &(unixfs->s_statvfs));
+    /* the super block keeps no free counts; those come in the background */
+    unixfs->s_statvfs.f_bsize   = sb->s_blocksize;
+    unixfs->s_statvfs.f_frsize  = sb->s_blocksize;
+    unixfs->s_statvfs.f_blocks  =
+        (sbi->s_nzones - sbi->s_firstdatazone) << sbi->s_log_zone_size;
+    unixfs->s_statvfs.f_files   = sbi->s_ninodes;
+    unixfs->s_statvfs.f_namemax = sbi->s_namelen;
 
     unixfs->s_dentsize = 0;
 
@@ -74,10 +87,22 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     *fsname = unixfs->s_fsname;
     *volname = unixfs->s_volname;
 
+    (void)unixfs_statvfs_defer(unixfs, minixfs_statvfs_count);
+
+    off_t firstdata = (off_t)sbi->s_firstdatazone << sbi->s_log_zone_size;
+    if ((flags & UNIXFS_PREFETCH) && (firstdata > 2)) {
+        struct unixfs_extent* ext = malloc(sizeof(struct unixfs_extent));
+        if (ext) { /* the inode and zone maps, then the inode table */
+            ext->e_offset = (off_t)2 * sb->s_blocksize;
+            ext->e_length = (firstdata - 2) * sb->s_blocksize;
+            (void)unixfs_metaprefetch(sb, ext, 1);
+        }
+    }
+
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (sb) {
             free(sb);
             sb = NULL;
@@ -90,6 +115,8 @@ out:
 static void
 unixfs_internal_fini(void* filsys)
 {
+    unixfs_metaprefetch_stop();
+    unixfs_statvfs_wait();
     unixfs_inodelayer_fini();
 
     struct super_block* sb = (struct super_block*)filsys;
@@ -97,6 +124,9 @@ unixfs_internal_fini(void* filsys)
         struct minix_sb_info* sbi = minix_sb(sb);
         if (sbi)
             free(sbi);
+        if (sb->s_bdev >= 0)
+            unixfs_image_close(sb->s_bdev);
+        sb->s_bdev = -1;
         free(sb);
     }
 }
@@ -120,8 +150,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
+    if (unixfs_image_pread(sb->s_bdev, blkbuf, sb->s_blocksize,
+                           blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
         return EIO;
 
     return 0;
@@ -223,7 +253,7 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
     unsigned chunk_size = sbi->s_dirsize;
     struct minix_inode_info* minix_inode = minix_i(dir);
 
-    start = minix_inode->i_dir_start_lookup;
+    start = __atomic_load_n(&minix_inode->i_dir_start_lookup, __ATOMIC_RELAXED);
     if (start >= npages)
         start = 0;
     n = start;
@@ -268,7 +298,8 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
 found:
 
     if (found_ino)
-        minix_inode->i_dir_start_lookup = n;
+        __atomic_store_n(&minix_inode->i_dir_start_lookup, n,
+                         __ATOMIC_RELAXED);
 
     unixfs_internal_iput(dir);
 
@@ -290,29 +321,42 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    char* p = buf;
-    ssize_t done = 0;
-    ssize_t tomove = 0;
-    ssize_t remaining = nbyte;
+    struct super_block* sb = unixfs;
+    size_t bsize = sb->s_blocksize;
+
+    if (((offset % bsize) == 0) && (nbyte >= bsize) &&
+        (bsize == (1 << ip->I_blkbits)))
+        return unixfs_blocks_pread(sb, ip, buf, nbyte, offset,
+                                   unixfs_internal_bmap, error);
+
+    /* unaligned head or short tail: go through a page */
     char page[PAGE_SIZE];
-    sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
-
-    while (remaining > 0) { /* page sized reads */
-        *error = minixfs_get_page(ip, beginpgno, page);
-        if (*error)
-            break;
-        tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
-        remaining -= tomove;
-        done += tomove;
-        p += tomove;
-        beginpgno++;
-    }
+    size_t pgoff = offset & (PAGE_SIZE - 1);
+    size_t tomove = PAGE_SIZE - pgoff;
 
-    if ((done == 0) && *error)
+    *error = minixfs_get_page(ip, offset >> PAGE_CACHE_SHIFT, page);
+    if (*error)
         return -1;
-    
-    return done;
+
+    if (tomove > nbyte)
+        tomove = nbyte;
+    memcpy(buf, page + pgoff, tomove);
+
+    return tomove;
+}
+
+static int
+unixfs_internal_pbread_async(struct inode* ip, char* buf, size_t nbyte,
+                             off_t offset, unixfs_pbread_done_t done,
+                             void* arg)
+{
+    struct super_block* sb = unixfs;
+
+    if (sb->s_blocksize != (1 << ip->I_blkbits))
+        return EINVAL;
+
+    return unixfs_blocks_pread_async(sb, ip, buf, nbyte, offset,
+                                     unixfs_internal_bmap, done, arg);
 }
 
 static int
@@ -351,6 +395,6 @@ unixfs_internal_sanitycheck(void* filsys, off_t disksize)
 static int
 unixfs_internal_statvfs(struct statvfs* svb)
 {
-    memcpy(svb, &unixfs->s_statvfs, sizeof(struct statvfs));
+    unixfs_statvfs_get(unixfs, svb);
     return 0;
 }
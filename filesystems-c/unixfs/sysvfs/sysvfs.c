@@ -350,7 +350,7 @@ sysv_fill_super(int fd, void* args, int silent)
 
     for (i = 0; i < ARRAY_SIZE(flavours) && !size; i++) {
         blocknr = flavours[i].block;
-        if ((ret = pread(fd, bh->b_data, BLOCK_SIZE,
+        if ((ret = unixfs_image_pread(fd, bh->b_data, BLOCK_SIZE,
                         (off_t)(flavours[i].block * BLOCK_SIZE))) < 0)
             goto failed_errno;
         else if (ret != BLOCK_SIZE)
@@ -370,9 +370,11 @@ sysv_fill_super(int fd, void* args, int silent)
             sb->s_blocksize_bits = blksize_bits(512);
             if ((bh1 = malloc(sizeof(struct buffer_head))) == NULL)
                 goto failed_errno;
-            if (pread(fd, bh1->b_data, 512, (off_t)(blocknr * 512)) < 0)
+            if (unixfs_image_pread(fd, bh1->b_data, 512,
+                                   (off_t)(blocknr * 512)) < 0)
                 goto failed_errno;
-            if (pread(fd, bh->b_data, 512, (off_t)((blocknr + 1) * 512)) < 0)
+            if (unixfs_image_pread(fd, bh->b_data, 512,
+                                   (off_t)((blocknr + 1) * 512)) < 0)
                 goto failed_errno;
             break;
 
@@ -384,7 +386,8 @@ sysv_fill_super(int fd, void* args, int silent)
             blocknr = blocknr >> 1;
             sb->s_blocksize = 2048;
             sb->s_blocksize_bits = blksize_bits(2048);
-            if (pread(fd, bh->b_data, 2048, (off_t)(blocknr * 2048)) < 0)
+            if (unixfs_image_pread(fd, bh->b_data, 2048,
+                                   (off_t)(blocknr * 2048)) < 0)
                 goto failed_errno;
             bh1 = bh;
             break;
@@ -500,15 +503,22 @@ Ecount:
     goto done;
 }
 
+int
+sysv_itod(struct super_block* sb, ino_t ino)
+{
+    struct sysv_sb_info* sbi = SYSV_SB(sb);
+
+    return sbi->s_firstinodezone + sbi->s_block_base +
+           (((unsigned int)ino - 1) >> sbi->s_inodes_per_block_bits);
+}
+
 struct sysv_dinode*
 sysv_raw_inode(struct super_block* sb, ino_t ino, struct buffer_head* bh)
 {
     struct sysv_sb_info* sbi = SYSV_SB(sb);
     struct sysv_dinode* res;
-    int block = sbi->s_firstinodezone + sbi->s_block_base;
 
-    block += ((unsigned int)ino - 1) >> sbi->s_inodes_per_block_bits;
-    int ret = sb_bread_intobh(sb, block, bh);
+    int ret = sb_bread_intobh(sb, sysv_itod(sb, ino), bh);
     if (ret != 0)
         return NULL;
     res = (struct sysv_dinode*)(bh->b_data);
@@ -782,10 +792,11 @@ sysv_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
         return -1;
     n = start;
 
-    if (!dirbuf->flags.initialized || (*offset & ((PAGE_SIZE - 1))) == 0) {
+    if (!UNIXFS_DIRBUF_HAS(dirbuf, (off_t)n << PAGE_CACHE_SHIFT)) {
         int ret = sysv_get_page(dir, n, dirpagebuf);
         if (ret)
             return ret;
+        dirbuf->base = (off_t)n << PAGE_CACHE_SHIFT;
         dirbuf->flags.initialized = 1;
     }
 
@@ -317,6 +317,7 @@ const char* sysv_flavor(u_int type);
 u_long sysv_count_free_blocks(struct super_block* sb);
 u_long sysv_count_free_inodes(struct super_block* sb);
 
+int sysv_itod(struct super_block* sb, ino_t ino);
 struct sysv_dinode* sysv_raw_inode(struct super_block* sb, ino_t ino,
                                    struct buffer_head* bh);
 int sysv_next_direntry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
@@ -5,7 +5,9 @@
  */
 
 #include "sysvfs.h"
+#define UNIXFS_INTERNAL_PBREAD_ASYNC unixfs_internal_pbread_async
 #include "unixfs_common.h"
+#include "unixfs_dirent16.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -18,13 +20,21 @@
 
 DECL_UNIXFS("UNIX System V", sysv);
 
+static void
+sysv_statvfs_count(struct super_block* sb, struct statvfs* svb)
+{
+    svb->f_bavail = sysv_count_free_blocks(sb);
+    svb->f_bfree  = svb->f_bavail;
+    svb->f_ffree  = sysv_count_free_inodes(sb);
+}
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +43,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -61,10 +71,12 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     unixfs->s_statvfs.f_bsize   = max(PAGE_SIZE, sb->s_blocksize);
     unixfs->s_statvfs.f_frsize  = sb->s_blocksize;
     unixfs->s_statvfs.f_blocks  = sbi->s_ndatazones;
-    unixfs->s_statvfs.f_bavail  = sysv_count_free_blocks(sb);
+    unixfs->s_statvfs.f_bavail  = (sbi->s_type == FSTYPE_AFS) ? 0 :
+        fs32_to_host(sbi->s_bytesex, *sbi->s_free_blocks);
     unixfs->s_statvfs.f_bfree   = unixfs->s_statvfs.f_bavail;
     unixfs->s_statvfs.f_files   = sbi->s_ninodes;
-    unixfs->s_statvfs.f_ffree   = sysv_count_free_inodes(sb);
+    unixfs->s_statvfs.f_ffree   =
+        fs16_to_host(sbi->s_bytesex, *sbi->s_sb_total_free_inodes);
     unixfs->s_statvfs.f_namemax = SYSV_NAMELEN;
     unixfs->s_dentsize = 0;
 
@@ -75,10 +87,24 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     *fsname = unixfs->s_fsname;
     *volname = unixfs->s_volname;
 
+    (void)unixfs_statvfs_defer(unixfs, sysv_statvfs_count);
+
+    if ((flags & UNIXFS_PREFETCH) &&
+        (sbi->s_firstdatazone > sbi->s_firstinodezone)) {
+        struct unixfs_extent* ext = malloc(sizeof(struct unixfs_extent));
+        if (ext) { /* the inode list */
+            ext->e_offset = (off_t)(sbi->s_block_base +
+                                    sbi->s_firstinodezone) * sb->s_blocksize;
+            ext->e_length = (off_t)(sbi->s_firstdatazone -
+                                    sbi->s_firstinodezone) * sb->s_blocksize;
+            (void)unixfs_metaprefetch(sb, ext, 1);
+        }
+    }
+
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (sb) {
             struct sysv_sb_info* sbi = SYSV_SB(sb);
             if (sbi) {
@@ -103,6 +129,8 @@ out:
 static void
 unixfs_internal_fini(void* filsys)
 {
+    unixfs_metaprefetch_stop();
+    unixfs_statvfs_wait();
     unixfs_inodelayer_fini();
 
     struct super_block* sb = (struct super_block*)filsys;
@@ -121,6 +149,9 @@ unixfs_internal_fini(void* filsys)
                 brelse(bh2);
             free(sbi);
         }
+        if (sb->s_bdev >= 0)
+            unixfs_image_close(sb->s_bdev);
+        sb->s_bdev = -1;
         free(sb);
     }
 }
@@ -144,8 +175,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
+    if (unixfs_image_pread(sb->s_bdev, blkbuf, sb->s_blocksize,
+                           blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
         return EIO;
 
     return 0;
@@ -174,8 +205,13 @@ unixfs_internal_iget(ino_t ino)
     if (inode->I_initialized)
         return inode;
 
+    /* through the inode block cache; siblings are likely to follow */
     struct buffer_head  bh;
-    struct sysv_dinode* raw_inode = sysv_raw_inode(sb, ino, &bh);
+    struct sysv_dinode* raw_inode = NULL;
+    if (unixfs_inodelayer_ibread((off_t)sysv_itod(sb, ino), (char*)bh.b_data,
+                                 sb->s_blocksize, unixfs_internal_bread) == 0)
+        raw_inode = (struct sysv_dinode*)bh.b_data +
+                    (((unsigned int)ino - 1) & sbi->s_inodes_per_block_1);
     if (!raw_inode) {
         fprintf(stderr, "major problem: failed to read inode %llu\n", ino);
         unixfs_inodelayer_ifailed(inode);
@@ -184,8 +220,6 @@ unixfs_internal_iget(ino_t ino)
 
     struct sysv_inode_info *si = SYSV_I(inode);
 
-    inode->I_ino = ino;
-
     /* SystemV FS: kludge permissions if ino==SYSV_ROOT_INO ?? */
 
     inode->I_mode = fs16_to_host(unixfs->s_endian, raw_inode->di_mode);
@@ -276,11 +310,15 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
     unsigned long namelen = strlen(name);
     unsigned long start, n;
     unsigned long npages = sysv_dir_pages(dir);
-    struct sysv_dir_entry* de;
+    struct sysv_dir_entry* de = NULL;
     char page[PAGE_SIZE];
-    char* kaddr = NULL;
 
-    start = SYSV_I(dir)->i_dir_start_lookup;
+    if ((namelen > SYSV_NAMELEN) && !SYSV_SB(dir->I_sb)->s_truncate) {
+        unixfs_internal_iput(dir);
+        return ENAMETOOLONG;
+    }
+
+    start = __atomic_load_n(&SYSV_I(dir)->i_dir_start_lookup, __ATOMIC_RELAXED);
     if (start >= npages)
         start = 0;
     n = start;
@@ -288,16 +326,12 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
     do {
         int error = sysv_get_page(dir, n, page);
         if (!error) {
-            kaddr = (char*)page;
-            de = (struct sysv_dir_entry*) kaddr;
-            kaddr += PAGE_CACHE_SIZE - SYSV_DIRSIZE;
-            for ( ; (char*) de <= kaddr ; de++) {
-                if (!de->inode)
-                    continue;
-                if (sysv_namecompare(namelen, SYSV_NAMELEN, name, de->name)) {
-                    found = 1;
-                    goto found;
-                }
+            int i = unixfs_dirent16_find(page, PAGE_CACHE_SIZE / SYSV_DIRSIZE,
+                                         name);
+            if (i >= 0) {
+                de = (struct sysv_dir_entry*)page + i;
+                found = 1;
+                goto found;
             }
         }
 
@@ -308,7 +342,8 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
 found:
 
     if (found)
-        SYSV_I(dir)->i_dir_start_lookup = n;
+        __atomic_store_n(&SYSV_I(dir)->i_dir_start_lookup, n,
+                         __ATOMIC_RELAXED);
 
     unixfs_internal_iput(dir);
 
@@ -331,29 +366,42 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    char* p = buf;
-    ssize_t done = 0;
-    ssize_t tomove = 0;
-    ssize_t remaining = nbyte;
+    struct super_block* sb = unixfs;
+    size_t bsize = sb->s_blocksize;
+
+    if (((offset % bsize) == 0) && (nbyte >= bsize) &&
+        (bsize == (1 << ip->I_blkbits)))
+        return unixfs_blocks_pread(sb, ip, buf, nbyte, offset,
+                                   unixfs_internal_bmap, error);
+
+    /* unaligned head or short tail: go through a page */
     char page[PAGE_SIZE];
-    sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
-
-    while (remaining > 0) { /* page sized reads */
-        *error = sysv_get_page(ip, beginpgno, page);
-        if (*error)
-            break;
-        tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
-        remaining -= tomove;
-        done += tomove;
-        p += tomove;
-        beginpgno++;
-    }
+    size_t pgoff = offset & (PAGE_SIZE - 1);
+    size_t tomove = PAGE_SIZE - pgoff;
 
-    if ((done == 0) && *error)
+    *error = sysv_get_page(ip, offset >> PAGE_CACHE_SHIFT, page);
+    if (*error)
         return -1;
-    
-    return done;
+
+    if (tomove > nbyte)
+        tomove = nbyte;
+    memcpy(buf, page + pgoff, tomove);
+
+    return tomove;
+}
+
+static int
+unixfs_internal_pbread_async(struct inode* ip, char* buf, size_t nbyte,
+                             off_t offset, unixfs_pbread_done_t done,
+                             void* arg)
+{
+    struct super_block* sb = unixfs;
+
+    if (sb->s_blocksize != (1 << ip->I_blkbits))
+        return EINVAL;
+
+    return unixfs_blocks_pread_async(sb, ip, buf, nbyte, offset,
+                                     unixfs_internal_bmap, done, arg);
 }
 
 static int
@@ -392,6 +440,6 @@ unixfs_internal_sanitycheck(void* filsys, off_t disksize)
 static int
 unixfs_internal_statvfs(struct statvfs* svb)
 {
-    memcpy(svb, &unixfs->s_statvfs, sizeof(struct statvfs));
+    unixfs_statvfs_get(unixfs, svb);
     return 0;
 }
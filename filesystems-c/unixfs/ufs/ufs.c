@@ -899,6 +899,233 @@ ufs_get_dirpage(struct inode* inode, sector_t index, char* pagebuf)
     return ret;
 }
 
+/*
+ * Directory hashing, after FreeBSD's ufs_dirhash. The first lookup in a
+ * directory of at least UFS_DIRHASH_MINSIZE bytes builds an in-memory index
+ * of its names; later lookups (including misses) are answered from the index
+ * instead of by scanning every directory page. Indexes live on an LRU list
+ * and the least recently used ones are dropped to stay under
+ * UFS_DIRHASH_MAXMEM.
+ */
+
+#define UFS_DIRHASH_MINSIZE 2560
+#define UFS_DIRHASH_MAXMEM  (8 * 1024 * 1024)
+
+struct ufs_dirhash_entry {
+    u32 dh_hash;
+    u32 dh_next;   /* 1-based index of the next entry in the bucket */
+    u32 dh_ino;
+    u32 dh_name;   /* offset into dh_names */
+    u32 dh_namlen;
+};
+
+struct ufs_dirhash {
+    TAILQ_ENTRY(ufs_dirhash)  dh_lru;
+    ino_t                     dh_ino;
+    u32                       dh_nentries;
+    u32                       dh_mask;
+    u32*                      dh_buckets; /* 1-based; 0 is an empty bucket */
+    struct ufs_dirhash_entry* dh_entries;
+    char*                     dh_names;
+    size_t                    dh_memsize;
+};
+
+static pthread_mutex_t ufs_dirhash_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(ufs_dirhash_head, ufs_dirhash) ufs_dirhash_lru =
+    TAILQ_HEAD_INITIALIZER(ufs_dirhash_lru);
+static size_t ufs_dirhash_mem = 0;
+
+static inline u32
+ufs_dirhash_hash(const char* name, int namelen)
+{
+    u32 h = 2166136261U; /* FNV-1a */
+
+    while (namelen--) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static void
+ufs_dirhash_free(struct ufs_dirhash* dh)
+{
+    free(dh->dh_buckets);
+    free(dh->dh_entries);
+    free(dh->dh_names);
+    free(dh);
+}
+
+static struct ufs_dirhash*
+ufs_dirhash_build(struct inode* dir)
+{
+    struct super_block* sb = dir->I_sb;
+    unsigned long npages = ufs_dir_pages(dir), n;
+    size_t maxentries = 64, namesize = 0, maxnamesize = 1024;
+    u32 i;
+
+    struct ufs_dirhash* dh = calloc(1, sizeof(struct ufs_dirhash));
+    if (!dh)
+        return NULL;
+
+    dh->dh_ino = dir->I_ino;
+    dh->dh_entries = malloc(maxentries * sizeof(struct ufs_dirhash_entry));
+    dh->dh_names = malloc(maxnamesize);
+    if (!dh->dh_entries || !dh->dh_names)
+        goto fail;
+
+    for (n = 0; n < npages; n++) {
+        char page[PAGE_SIZE];
+        char* kaddr;
+        struct ufs_dir_entry* de;
+
+        if (ufs_get_dirpage(dir, n, page) != 0)
+            goto fail;
+
+        kaddr = page + ufs_last_byte(dir, n) - UFS_DIR_REC_LEN(1);
+        de = (struct ufs_dir_entry*)page;
+
+        while ((char*)de <= kaddr) {
+            if (de->d_reclen == 0)
+                goto fail;
+            if (de->d_ino) {
+                u32 namlen = ufs_get_de_namlen(sb, de);
+                struct ufs_dirhash_entry* dhe;
+                if (dh->dh_nentries == maxentries) {
+                    maxentries *= 2;
+                    dhe = realloc(dh->dh_entries,
+                            maxentries * sizeof(struct ufs_dirhash_entry));
+                    if (!dhe)
+                        goto fail;
+                    dh->dh_entries = dhe;
+                }
+                if (namesize + namlen > maxnamesize) {
+                    char* names;
+                    while (namesize + namlen > maxnamesize)
+                        maxnamesize *= 2;
+                    if (!(names = realloc(dh->dh_names, maxnamesize)))
+                        goto fail;
+                    dh->dh_names = names;
+                }
+                dhe = &dh->dh_entries[dh->dh_nentries++];
+                dhe->dh_hash = ufs_dirhash_hash((char*)de->d_name, namlen);
+                dhe->dh_ino = fs32_to_cpu(sb, de->d_ino);
+                dhe->dh_name = namesize;
+                dhe->dh_namlen = namlen;
+                memcpy(dh->dh_names + namesize, de->d_name, namlen);
+                namesize += namlen;
+            }
+            de = ufs_next_entry(sb, de);
+        }
+    }
+
+    for (i = 16; i < dh->dh_nentries; i <<= 1)
+        continue;
+    dh->dh_mask = i - 1;
+    dh->dh_buckets = calloc(i, sizeof(u32));
+    if (!dh->dh_buckets)
+        goto fail;
+
+    for (i = 0; i < dh->dh_nentries; i++) {
+        struct ufs_dirhash_entry* dhe = &dh->dh_entries[i];
+        u32* bucket = &dh->dh_buckets[dhe->dh_hash & dh->dh_mask];
+        dhe->dh_next = *bucket;
+        *bucket = i + 1;
+    }
+
+    dh->dh_memsize = sizeof(struct ufs_dirhash) +
+                     maxentries * sizeof(struct ufs_dirhash_entry) +
+                     maxnamesize + (dh->dh_mask + 1) * sizeof(u32);
+
+    return dh;
+
+fail:
+    ufs_dirhash_free(dh);
+    return NULL;
+}
+
+/*
+ * Returns 0 if the index answered the lookup (*result is 0 for a miss) and
+ * -1 if the caller should scan the directory instead.
+ */
+static int
+ufs_dirhash_lookup(struct inode* dir, const char* name, int namelen,
+                   ino_t* result)
+{
+    struct ufs_dirhash* dh;
+    struct ufs_dirhash* newdh = NULL;
+
+    pthread_mutex_lock(&ufs_dirhash_lock);
+
+again:
+    TAILQ_FOREACH(dh, &ufs_dirhash_lru, dh_lru) {
+        if (dh->dh_ino == dir->I_ino)
+            break;
+    }
+
+    if (dh) {
+        if (newdh) /* lost a race to build it */
+            ufs_dirhash_free(newdh);
+        TAILQ_REMOVE(&ufs_dirhash_lru, dh, dh_lru);
+        TAILQ_INSERT_HEAD(&ufs_dirhash_lru, dh, dh_lru);
+    } else if (newdh) {
+        if (newdh->dh_memsize > UFS_DIRHASH_MAXMEM) {
+            pthread_mutex_unlock(&ufs_dirhash_lock);
+            ufs_dirhash_free(newdh);
+            return -1;
+        }
+        while (ufs_dirhash_mem + newdh->dh_memsize > UFS_DIRHASH_MAXMEM) {
+            struct ufs_dirhash* victim = TAILQ_LAST(&ufs_dirhash_lru,
+                                                    ufs_dirhash_head);
+            TAILQ_REMOVE(&ufs_dirhash_lru, victim, dh_lru);
+            ufs_dirhash_mem -= victim->dh_memsize;
+            ufs_dirhash_free(victim);
+        }
+        TAILQ_INSERT_HEAD(&ufs_dirhash_lru, newdh, dh_lru);
+        ufs_dirhash_mem += newdh->dh_memsize;
+        dh = newdh;
+    } else {
+        pthread_mutex_unlock(&ufs_dirhash_lock);
+        if (!(newdh = ufs_dirhash_build(dir)))
+            return -1;
+        pthread_mutex_lock(&ufs_dirhash_lock);
+        goto again;
+    }
+
+    u32 hash = ufs_dirhash_hash(name, namelen);
+    u32 i = dh->dh_buckets[hash & dh->dh_mask];
+
+    *result = 0;
+
+    for (; i != 0; i = dh->dh_entries[i - 1].dh_next) {
+        struct ufs_dirhash_entry* dhe = &dh->dh_entries[i - 1];
+        if ((dhe->dh_hash == hash) && (dhe->dh_namlen == namelen) &&
+            !memcmp(dh->dh_names + dhe->dh_name, name, namelen)) {
+            *result = dhe->dh_ino;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&ufs_dirhash_lock);
+
+    return 0;
+}
+
+void
+U_ufs_dirhash_fini(void)
+{
+    struct ufs_dirhash* dh;
+
+    pthread_mutex_lock(&ufs_dirhash_lock);
+    while ((dh = TAILQ_FIRST(&ufs_dirhash_lru)) != NULL) {
+        TAILQ_REMOVE(&ufs_dirhash_lru, dh, dh_lru);
+        ufs_dirhash_free(dh);
+    }
+    ufs_dirhash_mem = 0;
+    pthread_mutex_unlock(&ufs_dirhash_lock);
+}
+
 static ino_t
 ufs_find_entry_s(struct inode* dir, const char* name)
 {
@@ -919,7 +1146,15 @@ ufs_find_entry_s(struct inode* dir, const char* name)
     if (npages == 0 || namelen > UFS_MAXNAMLEN)
         goto out;
 
-    start = ui->i_dir_start_lookup;
+    if ((dir->I_size >= UFS_DIRHASH_MINSIZE) &&
+        (ufs_dirhash_lookup(dir, name, namelen, &result) == 0))
+        goto out;
+
+    /*
+     * Where the last successful lookup ended is only a hint; concurrent
+     * lookups may overwrite it freely, and it is range-checked here.
+     */
+    start = __atomic_load_n(&ui->i_dir_start_lookup, __ATOMIC_RELAXED);
 
     if (start >= npages)
         start = 0;
@@ -955,7 +1190,7 @@ out:
     return result;
 
 found:
-    ui->i_dir_start_lookup = n;
+    __atomic_store_n(&ui->i_dir_start_lookup, n, __ATOMIC_RELAXED);
 
     return result;
 }
@@ -1510,6 +1745,32 @@ U_ufs_statvfs(struct super_block* sb, struct statvfs* buf)
     return 0;
 }
 
+/* Where each cylinder group keeps its inodes. */
+int
+U_ufs_inode_extents(struct super_block* sb, struct unixfs_extent** extp)
+{
+    struct ufs_sb_private_info* uspi = UFS_SB(sb)->s_uspi;
+    unsigned cg;
+
+    if (!uspi->s_ncg || !uspi->s_inopf)
+        return 0;
+
+    struct unixfs_extent* ext =
+        malloc(uspi->s_ncg * sizeof(struct unixfs_extent));
+    if (!ext)
+        return -1;
+
+    for (cg = 0; cg < uspi->s_ncg; cg++) {
+        ext[cg].e_offset = (off_t)ufs_cgimin(cg) * sb->s_blocksize;
+        ext[cg].e_length =
+            (off_t)(uspi->s_ipg / uspi->s_inopf) * sb->s_blocksize;
+    }
+
+    *extp = ext;
+
+    return (int)uspi->s_ncg;
+}
+
 int
 U_ufs_iget(struct super_block* sb, struct inode* inode)
 {
@@ -1583,10 +1844,9 @@ U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirpagebuf,
                     off_t* offset, struct unixfs_direntry* dent)
 {
     struct super_block* sb = dir->I_sb;
-    struct ufs_inode_info* ui = dir->I_private;
 
     unsigned long npages = ufs_dir_pages(dir);
-    unsigned long start, n;
+    unsigned long n;
     struct ufs_dir_entry* de;
 
     UFSD("ENTER, dir_ino %llu\n", dir->I_ino);
@@ -1597,18 +1857,17 @@ U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirpagebuf,
     if (npages == 0)
         return -1;
 
-    start = ui->i_dir_start_lookup;
-    n = start;
+    n = *offset >> PAGE_CACHE_SHIFT; /* which page from offset */
 
-    if (start > npages)
+    if (n >= npages)
         return -1;
 
-    if ((ui->i_unused1 == 0) || (*offset & ((PAGE_SIZE - 1))) == 0) {
+    if (!UNIXFS_DIRBUF_HAS(dirpagebuf, (off_t)n << PAGE_CACHE_SHIFT)) {
         int ret = ufs_get_dirpage(dir, n, dirpagebuf->data);
         if (ret != 0)
             return ret;
-        ui->i_dir_start_lookup++;
-        ui->i_unused1 = ui->i_dir_start_lookup;
+        dirpagebuf->base = (off_t)n << PAGE_CACHE_SHIFT;
+        dirpagebuf->flags.initialized = 1;
     }
 
     de = (struct ufs_dir_entry*)((char*)dirpagebuf->data +
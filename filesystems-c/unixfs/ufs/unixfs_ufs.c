@@ -5,6 +5,7 @@
  */
 
 #include "ufs.h"
+#define UNIXFS_INTERNAL_PBREAD_ASYNC unixfs_internal_pbread_async
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -24,7 +25,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_image_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +34,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_image_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -75,10 +76,17 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     *fsname = unixfs->s_fsname;
     *volname = unixfs->s_volname;
 
+    if (flags & UNIXFS_PREFETCH) {
+        struct unixfs_extent* ext = NULL;
+        int n = U_ufs_inode_extents(sb, &ext);
+        if (n > 0)
+            (void)unixfs_metaprefetch(sb, ext, n);
+    }
+
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
+            unixfs_image_close(fd);
         if (sb)
             free(sb);
         return NULL;
@@ -90,11 +98,17 @@ out:
 static void
 unixfs_internal_fini(void* filsys)
 {
+    unixfs_metaprefetch_stop();
     unixfs_inodelayer_fini();
+    U_ufs_dirhash_fini();
 
     struct super_block* sb = (struct super_block*)filsys;
-    if (sb)
+    if (sb) {
+        if (sb->s_bdev >= 0)
+            unixfs_image_close(sb->s_bdev);
+        sb->s_bdev = -1;
         free(sb);
+    }
 }
 
 static off_t
@@ -111,13 +125,23 @@ unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
     return result;
 }
 
+/* U_ufs_get_block fails for a hole; unixfs_blocks_pread wants 0 back */
+static off_t
+unixfs_ufs_bmap_hole(struct inode* ip, off_t lblkno, int* error)
+{
+    off_t result;
+    (void)U_ufs_get_block(ip, lblkno, &result);
+    *error = 0;
+    return result;
+}
+
 static int
 unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
+    if (unixfs_image_pread(sb->s_bdev, blkbuf, sb->s_blocksize,
+                           blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
         return EIO;
 
     return 0;
@@ -139,7 +163,6 @@ unixfs_internal_iget(ino_t ino)
         return inode;
 
     struct super_block* sb = unixfs;
-    inode->I_ino = ino;
 
     int error = U_ufs_iget(sb, inode);
     if (error) {
@@ -228,29 +251,42 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    char* p = buf;
-    ssize_t done = 0;
-    ssize_t tomove = 0;
-    ssize_t remaining = nbyte;
+    struct super_block* sb = unixfs;
+    size_t bsize = sb->s_blocksize;
+
+    if (((offset % bsize) == 0) && (nbyte >= bsize) &&
+        (bsize == (1 << ip->I_blkbits)))
+        return unixfs_blocks_pread(sb, ip, buf, nbyte, offset,
+                                   unixfs_ufs_bmap_hole, error);
+
+    /* unaligned head or short tail: go through a page */
     char page[PAGE_SIZE];
-    sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
-
-    while (remaining > 0) { /* page sized reads */
-        *error = U_ufs_get_page(ip, beginpgno, page);
-        if (*error)
-            break;
-        tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
-        remaining -= tomove;
-        done += tomove;
-        p += tomove;
-        beginpgno++;
-    }
+    size_t pgoff = offset & (PAGE_SIZE - 1);
+    size_t tomove = PAGE_SIZE - pgoff;
 
-    if ((done == 0) && *error)
+    *error = U_ufs_get_page(ip, offset >> PAGE_CACHE_SHIFT, page);
+    if (*error)
         return -1;
-    
-    return done;
+
+    if (tomove > nbyte)
+        tomove = nbyte;
+    memcpy(buf, page + pgoff, tomove);
+
+    return tomove;
+}
+
+static int
+unixfs_internal_pbread_async(struct inode* ip, char* buf, size_t nbyte,
+                             off_t offset, unixfs_pbread_done_t done,
+                             void* arg)
+{
+    struct super_block* sb = unixfs;
+
+    if (sb->s_blocksize != (1 << ip->I_blkbits))
+        return EINVAL;
+
+    return unixfs_blocks_pread_async(sb, ip, buf, nbyte, offset,
+                                     unixfs_ufs_bmap_hole, done, arg);
 }
 
 static int